@@ -0,0 +1,58 @@
+//
+//  arena
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "util.h"
+#include "colors.h"
+
+void arena_init(arena_t * arena, void * buf, size_t size)
+{
+  arena->base = buf;
+  arena->size = size;
+  arena->used = 0;
+  arena->peak = 0;
+}
+
+void * arena_alloc(arena_t * arena, size_t size)
+{
+  size = ARENA_SIZEOF(MAX(size, (size_t)1));
+  if (size > arena->size - arena->used)
+  {
+    printf(CL_RED "Arena exhausted: %zu bytes wanted, %zu of %zu free\n" CL_RESET,
+      size, arena->size - arena->used, arena->size);
+    return NULL;
+  }
+
+  void * ptr = arena->base + arena->used;
+  arena->used += size;
+  arena->peak = MAX(arena->peak, arena->used);
+  return ptr;
+}
+
+size_t arena_mark(arena_t * arena)
+{
+  return arena ? arena->used : 0;
+}
+
+void arena_release(arena_t * arena, size_t mark)
+{
+  if (arena && mark <= arena->used)
+    arena->used = mark;
+}
+
+void * arena_malloc(arena_t * arena, size_t size)
+{
+  return arena ? arena_alloc(arena, size) : malloc(size);
+}
+
+void arena_free(arena_t * arena, void * ptr)
+{
+  if (NULL == arena)
+    free(ptr);
+}
@@ -0,0 +1,43 @@
+//
+//  arena
+//
+//  A bump allocator over a caller-provided buffer, for builds that must not
+//  touch the heap once running. Allocations are released in LIFO order by
+//  rolling back to a mark. Modules take an optional arena and fall back to
+//  malloc/free when it is NULL, so the same code serves both builds.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef arena_h
+#define arena_h
+
+#define ARENA_ALIGN 8
+
+typedef struct {
+  uint8_t * base;
+  size_t size;
+  size_t used;
+  size_t peak;         // High-water mark, for sizing the buffer
+} arena_t;
+
+void arena_init(arena_t * arena, void * buf, size_t size);
+
+// NULL once it's full, which means the arena was sized wrongly for the part;
+// callers fail with LIBUSB_ERROR_NO_MEM
+void * arena_alloc(arena_t * arena, size_t size);
+
+size_t arena_mark(arena_t * arena);
+void arena_release(arena_t * arena, size_t mark);
+
+// Space arena_alloc takes for +size+ bytes, alignment included
+#define ARENA_SIZEOF(size) (((size_t)(size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+// From +arena+, or the heap when it's NULL. arena_free only frees heap blocks;
+// arena blocks go when the enclosing mark is released.
+void * arena_malloc(arena_t * arena, size_t size);
+void arena_free(arena_t * arena, void * ptr);
+
+#endif
@@ -0,0 +1,685 @@
+//
+//  bench
+//
+//  Microbenchmarks for the host side of a flash: hex decoding, building the
+//  image, the NVM CRC and cutting the image into bulk transfers. Synthetic
+//  Intel HEX corpora are generated up front so runs are repeatable.
+//
+//  unfused builds the image and then CRCs it; fused does both, and counts the
+//  records, from one parse with batched dispatch, as the flasher does.
+//
+//  Each stage is repeated for at least -m milliseconds and the fastest pass is
+//  reported. Allocation counts come from the first pass; the bench is linked
+//  with --wrap=malloc/calloc/realloc so only calls made by xflash code count.
+//
+//  The image.gz, image.xz and image.zst stages build the image from compressed
+//  copies of each corpus, for whichever decoders the build has; their MB/s is
+//  over the uncompressed hex so it compares directly with the image stage.
+//
+//  image.bin builds it from a raw binary of the same image (MB/s again over the
+//  hex), which maps the file rather than decoding it; it's skipped for images
+//  spanning more than 64 MB.
+//
+//  The patch stage updates the image CRC for a 16-byte serial number and a
+//  64-byte calibration block written over each image (image_patchCRC), as a
+//  production line does per unit; its MB/s is over the image, like the crc stage.
+//
+//  The stream stage flashes a simulated part out of an arena, as an ARENA=1 build
+//  does, and fails the run if it allocates at all.
+//
+//  Stages check what they produce against results worked out before timing (the
+//  image's size, its CRC prefix, the CRC a device would report), so none can get
+//  faster by being wrong; a wrong result fails the run. The CRC kernels are
+//  checked more thoroughly by bench/check, which `make bench` runs first.
+//
+//  Results are written as tab-separated lines, one per corpus and stage, so two
+//  runs can be diffed. Pass -b with an earlier results file to print the change
+//  in throughput against it.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#if HAVE_ZLIB
+  #include <zlib.h>
+#endif
+#if HAVE_LZMA
+  #include <lzma.h>
+#endif
+#if HAVE_ZSTD
+  #include <zstd.h>
+#endif
+
+#include "ihex.h"
+#include "image.h"
+#include "hexdecode.h"
+#include "bootloader.h"
+#include "arena.h"
+#include "decompress.h"
+#include "loader.h"
+#include "util.h"
+
+extern int verbose;
+
+#pragma mark - Allocation counting
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t n, size_t size);
+void * __real_realloc(void * ptr, size_t size);
+
+static uint64_t allocCount;
+static uint64_t allocBytes;
+
+void * __wrap_malloc(size_t size)
+{
+  allocCount++;
+  allocBytes += size;
+  return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t n, size_t size)
+{
+  allocCount++;
+  allocBytes += n * size;
+  return __real_calloc(n, size);
+}
+
+void * __wrap_realloc(void * ptr, size_t size)
+{
+  allocCount++;
+  allocBytes += size;
+  return __real_realloc(ptr, size);
+}
+
+#pragma mark - Corpora
+
+typedef struct {
+  const char * name;
+  int minLen, maxLen;   // Data bytes per record
+  int gapEvery;         // Records between gaps; 0 for none
+  int maxGap;           // Largest gap in bytes
+} bench_shape_t;
+
+static const bench_shape_t benchShapes[] = {
+  { "dense16", 16,  16,  0, 0 },
+  { "dense32", 32,  32,  0, 0 },
+  { "mixed",    1, 255, 16, 4096 },
+  { "sparse",  64,  64,  4, 65536 },
+};
+
+static const uint32_t benchSizes[] = { 4*1024, 64*1024, 1024*1024, 16*1024*1024 };
+
+static uint32_t benchSeed;
+
+static uint32_t _bench_random(void)
+{
+  benchSeed = benchSeed * 1103515245 + 12345;
+  return benchSeed >> 8;
+}
+
+static void _bench_putRecord(FILE * f, uint8_t type, uint16_t addr, const uint8_t * data, int len)
+{
+  uint8_t sum = len + (addr >> 8) + (addr & 0xff) + type;
+  fprintf(f, ":%02X%04X%02X", len, addr, type);
+
+  int i;
+  for (i=0; i<len; i++)
+  {
+    fprintf(f, "%02X", data[i]);
+    sum += data[i];
+  }
+  fprintf(f, "%02X\n", (uint8_t)-sum);
+}
+
+// Write +size+ payload bytes shaped like +shape+ to +path+. Returns the record count.
+static uint32_t bench_generate(const char * path, const bench_shape_t * shape, uint32_t size)
+{
+  FILE * f = fopen(path, "w");
+  if (NULL == f)
+  {
+    perror("Could not create corpus");
+    exit(2);
+  }
+
+  uint8_t data[255];
+  uint32_t addr = 0, written = 0, records = 0;
+  uint16_t segment = 0;
+
+  benchSeed = size ^ shape->minLen ^ (shape->maxLen << 8);
+
+  while (written < size)
+  {
+    int len = shape->minLen + _bench_random() % (shape->maxLen - shape->minLen + 1);
+    len = MIN((uint32_t)len, size - written);
+
+    // Records never straddle a 64K segment
+    len = MIN((uint32_t)len, 0x10000 - (addr & 0xffff));
+
+    if ((addr >> 16) != segment)
+    {
+      uint8_t ext[2] = { addr >> 24, addr >> 16 };
+      segment = addr >> 16;
+      _bench_putRecord(f, ihex_recordtype_ext_lin, 0, ext, 2);
+      records++;
+    }
+
+    int i;
+    for (i=0; i<len; i++)
+      data[i] = _bench_random();
+
+    _bench_putRecord(f, ihex_recordtype_data, addr & 0xffff, data, len);
+    records++;
+
+    addr += len;
+    written += len;
+
+    if (shape->gapEvery && 0 == records % shape->gapEvery)
+      addr += 1 + _bench_random() % shape->maxGap;
+  }
+
+  _bench_putRecord(f, ihex_recordtype_EOF, 0, NULL, 0);
+  records++;
+
+  fclose(f);
+  return records;
+}
+
+#define BENCH_MAX_RAW (64*1024*1024)
+
+// Write +image+ to +path+ as a raw binary, gaps filled
+static void bench_writeRaw(const char * path, image_t * image)
+{
+  FILE * f = fopen(path, "w");
+  uint8_t buf[4096];
+  uint32_t addr;
+  for (addr=0; f && addr<image->maxAddr; addr+=sizeof(buf))
+  {
+    uint32_t len = MIN(image->maxAddr - addr, (uint32_t)sizeof(buf));
+    image_read(image, addr, buf, len);
+    fwrite(buf, 1, len, f);
+  }
+
+  if (NULL == f || 0 != fclose(f))
+  {
+    printf("Could not write raw corpus %s\n", path);
+    exit(2);
+  }
+}
+
+// Compress +len+ bytes of +text+ as +format+ into +path+. Returns 0 when this
+// build has no encoder for +format+.
+static int bench_compress(const char * path, decompress_format_t format, const uint8_t * text, size_t len)
+{
+  uint8_t * out = NULL;
+  size_t outLen = 0;
+
+  switch (format)
+  {
+#if HAVE_ZLIB
+    case decompress_gzip:
+    {
+      z_stream z;
+      memset(&z, '\0', sizeof(z));
+      deflateInit2(&z, 6, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);  // 16: gzip wrapper
+      outLen = deflateBound(&z, len);
+      out = malloc(outLen);
+      z.next_in = (uint8_t *)text;
+      z.avail_in = len;
+      z.next_out = out;
+      z.avail_out = outLen;
+      deflate(&z, Z_FINISH);
+      outLen = z.total_out;
+      deflateEnd(&z);
+      break;
+    }
+#endif
+#if HAVE_LZMA
+    case decompress_xz:
+      out = malloc(len + len / 2 + 4096);
+      if (LZMA_OK != lzma_easy_buffer_encode(6, LZMA_CHECK_CRC64, NULL, text, len, out, &outLen, len + len / 2 + 4096))
+        outLen = 0;
+      break;
+#endif
+#if HAVE_ZSTD
+    case decompress_zstd:
+      out = malloc(ZSTD_compressBound(len));
+      outLen = ZSTD_compress(out, ZSTD_compressBound(len), text, len, 3);
+      if (ZSTD_isError(outLen))
+        outLen = 0;
+      break;
+#endif
+    default:
+      return 0;
+  }
+
+  FILE * f = fopen(path, "w");
+  int ok = (NULL != f && outLen > 0 && outLen == fwrite(out, 1, outLen, f));
+  if (f)
+    fclose(f);
+  free(out);
+
+  if (!ok)
+  {
+    printf("Could not write compressed corpus %s\n", path);
+    exit(2);
+  }
+  return 1;
+}
+
+#pragma mark - Stages
+
+typedef struct {
+  ihex_t * hex;
+  ihex_t * packed[decompress_zstd + 1];   // Compressed copies, by format
+  ihex_t * raw;                           // The image as a raw binary
+  image_t * image;
+  bootloader_t * bootloader;
+  uint64_t sink;
+
+  // Expected results, from the image built before timing
+  uint32_t size;
+  uint32_t maxAddr;
+  crc_t prefix;           // image_crcPrefix
+  uint32_t deviceCRC;     // REQ_CRC_APP once the image is flashed to the simulated part
+  int wrong;              // Passes that produced something else
+} bench_state_t;
+
+typedef struct {
+  const char * name;
+  void (*run)(bench_state_t *);
+  int usesHexBytes;    // Throughput over the hex text rather than the image
+  int onDevice;        // Needs the image to fit the simulated part; may not allocate
+  decompress_format_t format;   // Runs on the copy compressed this way
+  int raw;                      // Runs on the raw binary
+} bench_stage_t;
+
+static void _bench_countRecord(ihex_t * hex, ihex_record_t * rec, void * context)
+{
+  bench_state_t * state = context;
+  state->sink += rec->len;
+}
+
+static void bench_decode(bench_state_t * state)
+{
+  ihex_read(state->hex, _bench_countRecord, state);
+}
+
+static void bench_image(bench_state_t * state)
+{
+  image_t * image = image_fromHex(state->hex);
+  if (NULL == image || image->maxAddr != state->maxAddr)    // A raw binary's gaps count as data
+    state->wrong++;
+  image_free(image);
+}
+
+// What the preparation thread does in one parse: build the image, CRC it, count it
+static void bench_fused(bench_state_t * state)
+{
+  image_crcStream_t crcStream;
+  ihex_stats_t stats;
+  ihex_consumer_t also[] = { image_crcConsumer(&crcStream), ihex_statsConsumer(&stats) };
+  image_t * image = image_fromHexWith(state->hex, also, 2);
+
+  crc_t prefix;
+  if (!image_crcStreamFinish(&crcStream, &prefix))
+    image_crcPrefix(image, &prefix);
+  if (prefix.crc != state->prefix.crc || prefix.count != state->prefix.count || image->size != state->size)
+    state->wrong++;
+  state->sink += prefix.crc + stats.spans;
+  image_free(image);
+}
+
+// The same work as separate passes over the image
+static void bench_unfused(bench_state_t * state)
+{
+  image_t * image = image_fromHex(state->hex);
+
+  crc_t prefix;
+  image_crcPrefix(image, &prefix);
+  if (prefix.crc != state->prefix.crc || prefix.count != state->prefix.count || image->size != state->size)
+    state->wrong++;
+  state->sink += prefix.crc + image->count;
+  image_free(image);
+}
+
+static void bench_crc(bench_state_t * state)
+{
+  state->sink += image_crc(state->image, state->image->maxAddr - 1, 0xff);
+}
+
+// A serial number and a calibration block for one unit, without recomputing the CRC
+static void bench_patch(bench_state_t * state)
+{
+  static const uint8_t serial[16] = "XF-000000000001";
+  static uint8_t calibration[64];
+  uint32_t end = state->image->maxAddr;
+
+  image_patch_t patches[] = {
+    { end / 2, sizeof(serial), serial },
+    { end - MIN(end, (uint32_t)sizeof(calibration)), MIN(end, (uint32_t)sizeof(calibration)), calibration },
+  };
+  calibration[0] = (uint8_t)state->sink;
+  state->sink += image_patchCRC(state->image, patches, 2, (uint32_t)state->sink, end - 1, 0xff);
+}
+
+// Cut the image into bulk transfers the way bootloader_writeFlash does
+static void bench_chunk(bench_state_t * state)
+{
+  static uint8_t buf[BOOTLOADER_MAX_TRANSFER];
+  image_t * image = state->image;
+
+  image_paginate(image, BOOTLOADER_DEFAULT_PAGESIZE);
+
+  uint32_t addr, end = image->pageCount * image->pagesize;
+  for (addr=0; addr<end; addr+=sizeof(buf))
+  {
+    image_read(image, addr, buf, MIN(end - addr, (uint32_t)sizeof(buf)));
+    state->sink += buf[0];
+  }
+}
+
+static int _bench_streamBatch(ihex_t * hex, const ihex_batch_t * batch, void * context)
+{
+  int i;
+  for (i=0; i<batch->count; i++)
+    bootloader_streamWrite(context, batch->spans[i].addr, batch->spans[i].data, batch->spans[i].len);
+  return 0;
+}
+
+// Decode straight onto the simulator, write buffers from the arena
+static void bench_stream(bench_state_t * state)
+{
+  bootloader_stream_t * stream;
+  if (bootloader_streamBegin(state->bootloader, &stream) < 0)
+  {
+    state->wrong++;
+    return;
+  }
+
+  uint32_t crc = 0;
+  ihex_consumer_t consumer = { _bench_streamBatch, stream };
+  ihex_dispatch(state->hex, &consumer, 1);
+  if (bootloader_streamFinish(stream, &crc) < 0 || crc != state->deviceCRC)
+    state->wrong++;
+  state->sink += crc;
+}
+
+static const bench_stage_t benchStages[] = {
+  { "decode", bench_decode, 1, 0 },
+  { "image",  bench_image,  1, 0 },
+  { "unfused", bench_unfused, 1, 0 },
+  { "fused",  bench_fused,  1, 0 },
+  { "crc",    bench_crc,    0, 0 },
+  { "patch",  bench_patch,  0, 0 },
+  { "chunk",  bench_chunk,  0, 0 },
+  { "stream", bench_stream, 1, 1 },
+  { "image.gz",  bench_image, 1, 0, decompress_gzip },
+  { "image.xz",  bench_image, 1, 0, decompress_xz },
+  { "image.zst", bench_image, 1, 0, decompress_zstd },
+  { "image.bin", bench_image, 1, 0, decompress_none, 1 },
+};
+
+static void _bench_quietProgress(bootloader_t * bootloader, uint32_t bytesWritten, uint32_t total, void * context)
+{
+}
+
+#pragma mark - Results
+
+typedef struct {
+  char corpus[32];
+  char stage[16];
+  double mbps;
+} bench_baseline_t;
+
+static bench_baseline_t * baseline;
+static int baselineCount;
+
+static void bench_loadBaseline(const char * path)
+{
+  FILE * f = fopen(path, "r");
+  if (NULL == f)
+  {
+    perror("Could not open baseline");
+    exit(2);
+  }
+
+  char line[512];
+  while (fgets(line, sizeof(line), f))
+  {
+    bench_baseline_t b;
+    if ('#' == line[0] || 3 != sscanf(line, "%31s %15s %*s %*s %*s %*s %lf", b.corpus, b.stage, &b.mbps))
+      continue;
+
+    baseline = realloc(baseline, (baselineCount + 1) * sizeof(*baseline));
+    baseline[baselineCount++] = b;
+  }
+  fclose(f);
+}
+
+static double bench_baselineFor(const char * corpus, const char * stage)
+{
+  int i;
+  for (i=0; i<baselineCount; i++)
+    if (0 == strcmp(baseline[i].corpus, corpus) && 0 == strcmp(baseline[i].stage, stage))
+      return baseline[i].mbps;
+  return 0;
+}
+
+static void usage(const char * argv0)
+{
+  printf("Usage: %s [-o results.tsv] [-b baseline.tsv] [-s maxBytes] [-m minMs] [-c label]\n", argv0);
+  exit(1);
+}
+
+int main(int argc, char * argv[])
+{
+  const char * outPath = "bench/results.tsv";
+  const char * label = "";
+  uint32_t maxSize = benchSizes[sizeof(benchSizes)/sizeof(benchSizes[0]) - 1];
+  double minMs = 200;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "o:b:s:m:c:h")) != -1)
+  {
+    switch (opt)
+    {
+      case 'o': outPath = optarg;                   break;
+      case 'b': bench_loadBaseline(optarg);         break;
+      case 's': maxSize = strtoul(optarg, NULL, 0); break;
+      case 'm': minMs = atof(optarg);               break;
+      case 'c': label = optarg;                     break;
+      default:  usage(argv[0]);
+    }
+  }
+
+  FILE * out = fopen(outPath, "w");
+  if (NULL == out)
+  {
+    perror("Could not create results file");
+    return 2;
+  }
+
+  char dir[] = "/tmp/xflash-bench-XXXXXX";
+  if (NULL == mkdtemp(dir))
+  {
+    perror("Could not create corpus directory");
+    return 2;
+  }
+
+  // A simulated part with no modelled delays, for the stream stage
+  bootloader_t bootloader;
+  if (0 != bootloader_init(&bootloader, transport_simNew("128a4u,ctl=0,latency=0,kbps=1e9,erase=0")))
+  {
+    printf("Could not start the simulator\n");
+    return 2;
+  }
+  bootloader.progress = _bench_quietProgress;
+
+  arena_t arena;
+  size_t arenaSize = bootloader_arenaSize(&bootloader);
+  arena_init(&arena, malloc(arenaSize), arenaSize);
+  bootloader.arena = &arena;
+
+  int heapFailures = 0;
+  int wrongResults = 0;
+
+  fprintf(out, "# xflash bench %s kernel=%s\n", label, hex_decodeKernel());
+  fprintf(out, "# corpus\tstage\thexBytes\tbytes\trecords\titers\tMB/s\tns/record\tallocs\tallocBytes\n");
+
+  printf("Decode kernel: %s\n", hex_decodeKernel());
+  printf("%-16s %-9s %10s %9s %7s %9s %9s %12s\n",
+    "corpus", "stage", "bytes", "records", "iters", "MB/s", "ns/rec", "allocs");
+
+  int s, z, i;
+  for (z=0; z<(int)(sizeof(benchSizes)/sizeof(benchSizes[0])); z++)
+  {
+    if (benchSizes[z] > maxSize)
+      break;
+
+    for (s=0; s<(int)(sizeof(benchShapes)/sizeof(benchShapes[0])); s++)
+    {
+      const bench_shape_t * shape = &benchShapes[s];
+
+      char corpus[32], path[sizeof(dir) + 40], packedPath[sizeof(dir) + 48];
+      snprintf(corpus, sizeof(corpus), "%s-%uk", shape->name, benchSizes[z] / 1024);
+      snprintf(path, sizeof(path), "%s/%s.hex", dir, corpus);
+
+      uint32_t records = bench_generate(path, shape, benchSizes[z]);
+
+      bench_state_t state = { 0 };
+      state.bootloader = &bootloader;
+      state.hex = malloc(sizeof(ihex_t));
+      ihex_init(state.hex);
+      state.hex->fd = open(path, O_RDONLY);
+      if (-1 == state.hex->fd)
+      {
+        perror("Could not open corpus");
+        return 2;
+      }
+
+      // Map the corpus outside the timed region
+      bench_decode(&state);
+      uint32_t hexBytes = state.hex->mapLen;
+      state.image = image_fromHex(state.hex);
+      state.size = state.image->size;
+      state.maxAddr = state.image->maxAddr;
+      image_crcPrefix(state.image, &state.prefix);
+      if (state.image->maxAddr <= bootloader.info.memsize + 1)
+        state.deviceCRC = image_crc(state.image, bootloader.info.memsize, 0xff);
+
+      decompress_format_t f;
+      for (f=decompress_gzip; f<=decompress_zstd; f++)
+      {
+        snprintf(packedPath, sizeof(packedPath), "%s/%s.hex.%s", dir, corpus, decompress_formatName(f));
+        if (!bench_compress(packedPath, f, (const uint8_t *)state.hex->map, hexBytes))
+          continue;
+
+        state.packed[f] = malloc(sizeof(ihex_t));
+        ihex_init(state.packed[f]);
+        state.packed[f]->fd = open(packedPath, O_RDONLY);
+        state.packed[f]->format = f;
+        unlink(packedPath);
+      }
+
+      if (state.image->maxAddr <= BENCH_MAX_RAW)
+      {
+        snprintf(packedPath, sizeof(packedPath), "%s/%s.bin", dir, corpus);
+        bench_writeRaw(packedPath, state.image);
+
+        state.raw = malloc(sizeof(ihex_t));
+        ihex_init(state.raw);
+        state.raw->fd = open(packedPath, O_RDONLY);
+        state.raw->loader = &loader_bin;
+        unlink(packedPath);
+      }
+
+      for (i=0; i<(int)(sizeof(benchStages)/sizeof(benchStages[0])); i++)
+      {
+        const bench_stage_t * stage = &benchStages[i];
+        if (stage->onDevice && state.image->maxAddr > bootloader.info.memsize + 1)
+          continue;
+        if ((stage->format && NULL == state.packed[stage->format]) || (stage->raw && NULL == state.raw))
+          continue;
+
+        ihex_t * plain = state.hex;
+        if (stage->format)
+          state.hex = state.packed[stage->format];
+        if (stage->raw)
+          state.hex = state.raw;
+
+        uint32_t bytes = stage->usesHexBytes ? hexBytes : state.image->maxAddr;
+
+        uint64_t best = UINT64_MAX, total = 0, allocs = 0, allocSize = 0;
+        int iters = 0;
+        state.wrong = 0;
+        do
+        {
+          uint64_t count = allocCount, size = allocBytes;
+          uint64_t start = nowMicros();
+          stage->run(&state);
+          uint64_t elapsed = nowMicros() - start;
+
+          if (0 == iters)
+          {
+            allocs = allocCount - count;
+            allocSize = allocBytes - size;
+          }
+
+          best = MIN(best, MAX(elapsed, (uint64_t)1));
+          total += elapsed;
+          iters++;
+        } while (total < minMs * 1000);
+
+        state.hex = plain;
+
+        double mbps  = bytes / (double)best;
+        double nsRec = best * 1000.0 / records;
+
+        fprintf(out, "%s\t%s\t%u\t%u\t%u\t%d\t%.2f\t%.2f\t%llu\t%llu\n",
+          corpus, stage->name, hexBytes, bytes, records, iters, mbps, nsRec,
+          (unsigned long long)allocs, (unsigned long long)allocSize);
+
+        printf("%-16s %-9s %10u %9u %7d %9.2f %9.2f %12llu",
+          corpus, stage->name, bytes, records, iters, mbps, nsRec, (unsigned long long)allocs);
+
+        double base = bench_baselineFor(corpus, stage->name);
+        if (base > 0)
+          printf("  %+6.1f%%", (mbps / base - 1) * 100);
+        printf("\n");
+
+        if (stage->onDevice && allocs > 0)
+        {
+          printf("FAIL: %s %s made %llu heap allocations\n", corpus, stage->name, (unsigned long long)allocs);
+          heapFailures++;
+        }
+        if (state.wrong)
+        {
+          printf("FAIL: %s %s was wrong in %d of %d passes\n", corpus, stage->name, state.wrong, iters);
+          wrongResults++;
+        }
+      }
+
+      image_free(state.image);
+      ihex_free(state.hex);
+      for (f=decompress_gzip; f<=decompress_zstd; f++)
+        if (state.packed[f])
+          ihex_free(state.packed[f]);
+      if (state.raw)
+        ihex_free(state.raw);
+      unlink(path);
+    }
+  }
+
+  rmdir(dir);
+  fclose(out);
+  printf("Results written to %s\n", outPath);
+
+  free(arena.base);
+  bootloader_free(&bootloader);
+  return (heapFailures || wrongResults) ? 1 : 0;
+}
@@ -0,0 +1,196 @@
+//
+//  check
+//
+//  Keeps the table-driven CRC (crc.c) honest. crc_updateWord is the reference:
+//  one word at a time, as the XMEGA NVM controller does it. Golden vectors pin
+//  that reference down, computed independently of this code, and randomized
+//  runs check crc_update, crc_pad, crc_advance and crc_delta against it over
+//  odd lengths, split buffers and arbitrary starting registers.
+//
+//  The simulator CRCs its flash with crc_updateWord, so a simulated "CRC
+//  Matches" also compares the fast paths against the reference.
+//
+//  Run by `make test`, and by `make bench` before anything is timed.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crc.h"
+#include "util.h"
+
+#define CHECK_MAX_LEN 4096
+
+static int failures;
+
+static void check_equal(const char * what, uint32_t got, uint32_t expected)
+{
+  if (got == expected)
+    return;
+
+  printf("FAIL %s: 0x%06x, expected 0x%06x\n", what, got, expected);
+  failures++;
+}
+
+#pragma mark - Reference
+
+static uint32_t _check_refBytes(uint32_t crc, const uint8_t * data, size_t len)
+{
+  crc_t c = { crc, 0 };
+  size_t i;
+  for (i=0; i+1<len; i+=2)
+    crc_updateWord(&c, data[i] | data[i+1] << 8);
+  if (len & 1)
+    crc_updateWord(&c, data[len-1] | 0xff00);
+  return c.crc;
+}
+
+static uint32_t _check_refPad(uint32_t crc, uint32_t words, uint16_t pad)
+{
+  crc_t c = { crc, 0 };
+  while (words--)
+    crc_updateWord(&c, pad);
+  return c.crc;
+}
+
+#pragma mark - Golden vectors
+
+static void check_golden(void)
+{
+  static uint8_t data[128*1024];
+  crc_t c;
+  int i;
+
+  check_equal("empty", _check_refBytes(0, data, 0), 0x000000);
+  check_equal("\"123456789\"", _check_refBytes(0, (const uint8_t *)"123456789", 9), 0x02d50b);
+
+  memset(data, 0xff, sizeof(data));
+  check_equal("erased 32 KB", _check_refBytes(0, data, 32*1024), 0x54505b);
+  check_equal("erased 128 KB", _check_refBytes(0, data, 128*1024), 0x010001);
+
+  for (i=0; i<1024; i++)
+    data[i] = i;
+  check_equal("ramp 1 KB", _check_refBytes(0, data, 1024), 0x38c795);
+
+  check_equal("\"xflash\" + 1000 x 0xabcd",
+    _check_refPad(_check_refBytes(0, (const uint8_t *)"xflash", 6), 1000, 0xabcd), 0x231730);
+  check_equal("0x123456 + 100000 zero words", _check_refPad(0x123456, 100000, 0), 0x6c4f48);
+
+  // The same through the fast paths
+  crc_init(&c);
+  crc_update(&c, (const uint8_t *)"123456789", 9);
+  check_equal("crc_update \"123456789\"", c.crc, 0x02d50b);
+
+  crc_init(&c);
+  crc_pad(&c, 64*1024, 0xffff);
+  check_equal("crc_pad erased 128 KB", c.crc, 0x010001);
+
+  crc_init(&c);
+  crc_update(&c, data, 1024);
+  check_equal("crc_update ramp 1 KB", c.crc, 0x38c795);
+
+  crc_init(&c);
+  crc_update(&c, (const uint8_t *)"xflash", 6);
+  crc_pad(&c, 1000, 0xabcd);
+  check_equal("crc_pad \"xflash\" + 1000 x 0xabcd", c.crc, 0x231730);
+
+  check_equal("crc_advance 0x123456 by 100000", crc_advance(0x123456, 100000), 0x6c4f48);
+}
+
+#pragma mark - Randomized
+
+static uint32_t checkSeed = 1;
+
+static uint32_t _check_random(void)
+{
+  checkSeed = checkSeed * 1103515245 + 12345;
+  return checkSeed >> 8;
+}
+
+static void check_randomized(int rounds)
+{
+  static uint8_t data[CHECK_MAX_LEN], changed[CHECK_MAX_LEN];
+  char what[96];
+  int r;
+  size_t i;
+
+  for (r=0; r<rounds; r++)
+  {
+    size_t len = _check_random() % CHECK_MAX_LEN;
+    uint32_t start = _check_random() & CRC_MASK;
+    for (i=0; i<len; i++)
+      data[i] = _check_random();
+
+    // Whole, and split at an even offset as the image reads its spans
+    crc_t c = { start, 0 };
+    crc_update(&c, data, len);
+    snprintf(what, sizeof(what), "crc_update round %d, %zu bytes", r, len);
+    check_equal(what, c.crc, _check_refBytes(start, data, len));
+
+    size_t split = (len ? _check_random() % len : 0) & ~(size_t)1;
+    crc_t s = { start, 0 };
+    crc_update(&s, data, split);
+    crc_update(&s, data + split, len - split);
+    snprintf(what, sizeof(what), "crc_update round %d, split at %zu of %zu", r, split, len);
+    check_equal(what, s.crc, c.crc);
+
+    uint32_t words = _check_random() % 20000;
+    uint16_t pad = (r & 1) ? 0xffff : _check_random();
+    crc_t p = { start, 0 };
+    crc_pad(&p, words, pad);
+    snprintf(what, sizeof(what), "crc_pad round %d, %u x 0x%04x", r, words, pad);
+    check_equal(what, p.crc, _check_refPad(start, words, pad));
+
+    snprintf(what, sizeof(what), "crc_advance round %d, %u words", r, words);
+    check_equal(what, crc_advance(start, words), _check_refPad(start, words, 0));
+
+    // A change to an even-aligned run, with the rest of the data after it
+    size_t at = (len ? _check_random() % len : 0) & ~(size_t)1;
+    size_t run = MIN((size_t)(_check_random() % 64), len - at) & ~(size_t)1;
+    memcpy(changed, data, len);
+    for (i=at; i<at+run; i++)
+      changed[i] = _check_random();
+
+    uint32_t after = (len - at - run + 1) / 2;    // An odd last byte is a word too
+    uint32_t delta = crc_delta(data + at, changed + at, run, after);
+    snprintf(what, sizeof(what), "crc_delta round %d, %zu bytes at %zu of %zu", r, run, at, len);
+    check_equal(what, _check_refBytes(start, data, len) ^ delta, _check_refBytes(start, changed, len));
+  }
+}
+
+static void usage(const char * argv0)
+{
+  printf("Usage: %s [-n rounds] [-s seed]\n", argv0);
+  exit(1);
+}
+
+int main(int argc, char * argv[])
+{
+  int rounds = 2000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:h")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n': rounds = atoi(optarg);                 break;
+      case 's': checkSeed = strtoul(optarg, NULL, 0);  break;
+      default:  usage(argv[0]);
+    }
+  }
+
+  check_golden();
+  check_randomized(rounds);
+
+  if (failures)
+  {
+    printf("crc: %d checks failed\n", failures);
+    return 1;
+  }
+  printf("crc: golden vectors and %d randomized rounds OK\n", rounds);
+  return 0;
+}
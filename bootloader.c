@@ -11,52 +11,40 @@
 
 
 #include "bootloader.h"
+#include "trace.h"
+#include "crc.h"
 #include "util.h"
 #include "colors.h"
 
 extern int verbose;
 
-#define chkStatus(_s_, _msg_) _chkStatus(_s_, _msg_, __LINE__, 1)
-#define chkStatusSoft(_s_, _msg_) _chkStatus(_s_, _msg_, __LINE__, 0)
-static void _chkStatus(int status, const char * msg, int line, int kill);
-static void _chkStatus(int status, const char * msg, int line, int kill)
+int bootloader_open(bootloader_t * bootloader, transport_t *transport)
 {
-  if (status != 0)
-  { 
-    printf(CL_RED "Line %d: %s failed: %d\n" CL_RESET, 
-      line, msg, status); 
+  memset(bootloader, '\0', sizeof(*bootloader));
+  bootloader->transport = transport;
+  bootloader->queueDepth = BOOTLOADER_QUEUE_DEPTH;
+  bootloader->pagesPerTransfer = BOOTLOADER_PAGES_AUTO;
     
-    if (kill)
-      exit(3); 
-  }
+  // Claim the bulk interface
+  return transport_open(bootloader->transport);
 }
 
-
-void bootloader_init(bootloader_t * bootloader, libusb_device_handle *devHandle)
+int bootloader_init(bootloader_t * bootloader, transport_t *transport)
 {
-  sleep(1);
-  
-  int status;
-  memset(bootloader, '\0', sizeof(*bootloader));
-  bootloader->devHandle = devHandle;
-    
-  // Set Configuration
-  status = libusb_set_configuration(bootloader->devHandle, 1);
-  chkStatusSoft(status, "libusb_set_configuration");
-  
-  // Claim the bulk interface
-  status = libusb_claim_interface(bootloader->devHandle, 0);
-  chkStatus(status, "libusb_claim_interface");
+  int status = bootloader_open(bootloader, transport);
+  if (status != 0)
+    return status;
 
-  // Read Device Info
-  bootloader_readInfo(bootloader);
+  // Read Device Info. A bootloader that has only just attached may not answer 
+  // yet, so this doubles as the readiness probe.
+  return bootloader_readInfo(bootloader);
 }
 
 void bootloader_free(bootloader_t * bootloader)
 {
   // Clean up
-  libusb_release_interface(bootloader->devHandle, 1);
-  libusb_close(bootloader->devHandle);
+  transport_close(bootloader->transport);
+  bootloader->transport = NULL;
 }
 
 const char * bootloader_strForDevice(uint8_t * deviceID)
@@ -82,37 +70,52 @@ const char * bootloader_strForDevice(uint8_t * deviceID)
   return "Unknown Device";
 }
 
-void bootloader_readInfo(bootloader_t* bootloader)
+int bootloader_readInfo(bootloader_t* bootloader)
 {
   bootloader_info_t * buffer = &bootloader->info;
   int status;
 
   memset(buffer, '\0', sizeof(*buffer));
   
-  int i;
-  for(i=0; i<4; i++)
+  // Poll with short timeouts until the device answers
+  uint64_t start = nowMicros();
+  uint64_t deadline = start + BOOTLOADER_READY_TIMEOUT_MS * 1000;
+  for(;;)
   {
-    status = libusb_control_transfer(bootloader->devHandle, 
-                                     LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN, 
+    status = transport_controlIn(bootloader->transport, 
                                      REQ_INFO,  /* Request */
                                      0,         /* bValue */
                                      0,         /* wIndex */
                                      (uint8_t*)buffer, /* Receive Buffer */ 
                                      64,    /* Size */
-                                     1000); /* Timeout */
+                                     BOOTLOADER_PROBE_TIMEOUT_MS); /* Timeout */
     
-    if (status > -1) 
+    if (status > -1 || LIBUSB_ERROR_NO_DEVICE == status || nowMicros() >= deadline) 
       break;
 
-    printf(CL_RED "Info request failed: %d\n" CL_RESET, status);
-    printf("Retrying\n");
-    usleep(250000);
+    if (verbose > 1)
+      printf(CL_YELLOW "Info request failed: %d; retrying\n" CL_RESET, status);
+    trace_retry("REQ_INFO");
+    usleep(BOOTLOADER_PROBE_INTERVAL_MS * 1000);
   }
 
   if (status < 0)
-    exit(3);
-  
+  {
+    printf(CL_RED "Info request failed: %d\n" CL_RESET, status);
+    return status;
+  }
+
+  if (verbose > 0)
+    printf("Bootloader ready after %d ms\n", (int)((nowMicros() - start) / 1000));
   
+  bootloader_printInfo(bootloader);
+  return 0;
+}
+
+void bootloader_printInfo(bootloader_t * bootloader)
+{
+  bootloader_info_t * buffer = &bootloader->info;
+
   // Correct endian
   buffer->pagesize = buffer->pagesize;
   buffer->memsize  = buffer->memsize;
@@ -144,13 +147,13 @@ void bootloader_readInfo(bootloader_t* bootloader)
 
 int bootloader_reset(bootloader_t *bootloader)
 {
-  return libusb_control_transfer(bootloader->devHandle, 0x40 | 0x80, REQ_RESET, 0, 0, NULL, 0, 1000);
+  return transport_controlIn(bootloader->transport, REQ_RESET, 0, 0, NULL, 0, 1000);
 }
 
 int bootloader_erase(bootloader_t *bootloader)
 {
 #if ACTUALLY_FLASH
-  return libusb_control_transfer(bootloader->devHandle, 0x40 | 0x80, REQ_ERASE, 0, 0, NULL, 0, 1000);
+  return transport_controlIn(bootloader->transport, REQ_ERASE, 0, 0, NULL, 0, 1000);
 #else
   return 0;
 #endif
@@ -158,160 +161,562 @@ int bootloader_erase(bootloader_t *bootloader)
 
 int bootloader_appCRC(bootloader_t * bootloader, uint32_t* crc)
 {
-  int status = libusb_control_transfer(bootloader->devHandle, 0x40 | 0x80, REQ_CRC_APP, 0, 0, (uint8_t *)crc, 4, 1000);
+  int status = transport_controlIn(bootloader->transport, REQ_CRC_APP, 0, 0, (uint8_t *)crc, 4, 1000);
   return status;
 }
 
+int bootloader_bootCRC(bootloader_t * bootloader, uint32_t* crc)
+{
+  return transport_controlIn(bootloader->transport, REQ_CRC_BOOT, 0, 0, (uint8_t *)crc, 4, 1000);
+}
+
+#pragma mark - Planning
+
+void bootloader_planWrite(bootloader_t * bootloader, image_t * image, bootloader_plan_t * plan)
+{
+  memset(plan, '\0', sizeof(*plan));
+
+  plan->pagesize = bootloader->info.pagesize;
+  if (0 == plan->pagesize)
+  {
+    printf(CL_YELLOW "Device reported no page size; assuming %d\n" CL_RESET, BOOTLOADER_DEFAULT_PAGESIZE);
+    plan->pagesize = BOOTLOADER_DEFAULT_PAGESIZE;
+  }
+
+  // Only the last page is padded. A stream can run to the end of the application section.
+  uint32_t end   = image ? image_patchedEnd(image, bootloader->patches, bootloader->patchCount) : bootloader->info.memsize + 1;
+  plan->pages    = (end + plan->pagesize - 1) / plan->pagesize;
+  plan->maxPages = MAX(BOOTLOADER_MAX_TRANSFER / plan->pagesize, 1);
+
+  plan->pagesPerTransfer = MIN(bootloader->pagesPerTransfer, plan->maxPages);
+  if (BOOTLOADER_PAGES_AUTO == plan->pagesPerTransfer)
+  {
+    // An image too small to probe goes in the largest transfers, a few at most
+    plan->probeBudget = plan->pages / BOOTLOADER_PROBE_SHARE;
+    plan->probing = (plan->probeBudget >= BOOTLOADER_PROBE_ROUNDS);
+    plan->pagesPerTransfer = plan->probing ? 1 : plan->maxPages;
+  }
+
+  if (verbose > 1)
+    printf("Plan: %d pages of %d bytes; %s%d pages per transfer\n", plan->pages, plan->pagesize, 
+           plan->probing ? "probing from " : "", plan->pagesPerTransfer);
+}
+
+// Record how long a probe transfer took and decide the next transfer size. Each size
+// is tried BOOTLOADER_PROBE_ROUNDS times; the ladder doubles while throughput improves
+// and the next size fits in what is left of the probe's budget.
+static void _bootloader_planDidProbe(bootloader_plan_t * plan, int pages, uint64_t micros)
+{
+  double rate = (double)pages * plan->pagesize / MAX(micros, 1);
+  plan->probeRate = MAX(plan->probeRate, rate);
+  plan->probeBudget -= MIN((uint32_t)pages, plan->probeBudget);
+
+  if (++plan->probeRound < BOOTLOADER_PROBE_ROUNDS)
+    return;
+
+  if (verbose > 1)
+    printf("\nProbe: %d pages per transfer: %.2f MB/s\n", plan->pagesPerTransfer, plan->probeRate);
+
+  int improved = (plan->probeRate > plan->bestRate * 1.05);
+  if (improved)
+  {
+    plan->bestRate  = plan->probeRate;
+    plan->bestPages = plan->pagesPerTransfer;
+  }
+
+  plan->probeRound = 0;
+  plan->probeRate  = 0;
+
+  if (improved && plan->pagesPerTransfer * 2 <= plan->maxPages &&
+      (uint32_t)plan->pagesPerTransfer * 2 * BOOTLOADER_PROBE_ROUNDS <= plan->probeBudget)
+  {
+    plan->pagesPerTransfer *= 2;
+    return;
+  }
+
+  plan->probing = 0;
+  plan->pagesPerTransfer = plan->bestPages;
+
+  if (verbose > 0)
+    printf("\nUsing %d pages (%d bytes) per transfer\n", plan->pagesPerTransfer, plan->pagesPerTransfer * plan->pagesize);
+}
+
 #pragma mark - Writing Flash
-#define TSIZE 256
 
-struct _flash_context {
-  int cnt;
-  int bytesWritten;
+struct _write_queue;
+
+struct _write_slot {
+  transport_transfer_t * transfer;
   uint8_t * buf;
+  int busy;
+  int pages;
+  uint64_t submitted;
+  struct _write_queue * queue;
+};
+
+struct _write_queue {
   bootloader_t * bootloader;
+  bootloader_plan_t plan;
+  struct _write_slot * slots;
+  int depth;
+  int inFlight;
+  int status;       // First error reported by a transfer, or 0
+  int completed;    // Set by each completion to wake the event loop
+  int cancelled;    // What was in flight at the first failure has been cancelled
+  uint32_t bytesWritten;
+  uint32_t total;
+  size_t mark;      // Arena position before the slots
 };
 
-static void _bootloader_didReadHexRecord(ihex_t * hex, ihex_record_t* rec, struct _flash_context *ctx)
+static void _bootloader_didWriteChunk(struct _write_slot * slot, int status, int length, int transfered)
 {
-  struct _flash_context * c = ctx; //(struct _flash_context *)ctx;
+  struct _write_queue * q = slot->queue;
 
-  // Ignore non-data records
-  if (rec->recordType != ihex_recordtype_data)
-  {
-    if (verbose > 1)
-      printf("(Ignoring non-data record)\n");
+  slot->busy = 0;
+  q->inFlight--;
+  q->completed = 1;
 
-    // Write the final buffer
-    if (ihex_recordtype_EOF == rec->recordType)
+  if (status < 0 || transfered != length)
+  {
+    // Transfers cancelled behind the first failure aren't worth reporting
+    if (0 == q->status)
     {
-      // Pad to TSIZE
-      int delta = TSIZE-c->cnt;
-      if (verbose > 1)
-        printf("Last buffer has %d bytes; delta: %d\n", c->cnt, delta);
-      memset((c->buf + c->cnt), 0xff, delta);
-      c->cnt += delta;
-      
-      // printf(CL_GREEN "=> Writing packet: %d bytes " CL_RESET, c->cnt);
-      int transfered=0;
+      q->status = (status < 0) ? status : LIBUSB_ERROR_IO;
+      printf(CL_RED "Flash Error: %d (%d/%d bytes)\n" CL_RESET, status, transfered, length);
+    }
+    return;
+  }
+
+  if (q->plan.probing)
+    _bootloader_planDidProbe(&q->plan, slot->pages, nowMicros() - slot->submitted);
+
+  q->bytesWritten += transfered;
+  if (q->bootloader->progress)
+  {
+    q->bootloader->progress(q->bootloader, q->bytesWritten, q->total, q->bootloader->progressContext);
+  }
+  else if (q->total)
+  {
+    printf("\b\b\b\b"); // Back up
+    printf("% 3d%%", (int)((uint64_t)q->bytesWritten * 100 / q->total));
+    fflush(stdout);
+  }
+  else
+  {
+    printf("\b\b\b\b\b\b\b\b\b"); // Size unknown while streaming
+    printf("%6u KB", q->bytesWritten / 1024);
+    fflush(stdout);
+  }
+}
 
+static void _bootloader_transferCallback(transport_transfer_t * transfer)
+{
+  _bootloader_didWriteChunk(transfer->context, transfer->status, transfer->length, transfer->actualLength);
+}
+
+static int _bootloader_submitChunk(struct _write_slot * slot, int pages)
+{
+  struct _write_queue * q = slot->queue;
+  int len = pages * q->plan.pagesize;
+
+  slot->busy = 1;
+  slot->pages = pages;
+  slot->submitted = nowMicros();
+  q->inFlight++;
 
 #if ACTUALLY_FLASH
-      int status = libusb_bulk_transfer(c->bootloader->devHandle, LIBUSB_ENDPOINT_OUT | 0x01, c->buf, c->cnt, &transfered, 1000);
+  slot->transfer->buf = slot->buf;
+  slot->transfer->length = len;
+  slot->transfer->timeout = 1000 + 20 * pages;
+  slot->transfer->callback = _bootloader_transferCallback;
+  slot->transfer->context = slot;
+  int status = transport_submit(q->bootloader->transport, slot->transfer);
+  if (status < 0)
+  {
+    slot->busy = 0;
+    q->inFlight--;
+  }
+  return status;
 #else
-      int status = 1;
-      if (verbose > 1)
-      {
-        printHexStr(c->buf, c->cnt);
-        printf("\n");
-      }
-#endif
-      if (status >= 0)
-      {
-        printf("\b\b\b\b100%%");
-        if (verbose > 2)
-          printf("(wrote %d OK)\n", status);
-      }
-      else
-        printf(CL_RED "Error writing final buffer: %d\n" CL_RESET, status);
-
-      if (verbose > 1)
-        printf ("\nDone\n");
-      return;
-    }
+  if (verbose > 1)
+  {
+    printHexStr(slot->buf, len);
+    printf("\n");
   }
-  
+  _bootloader_didWriteChunk(slot, 0, len, len);
+  return 0;
+#endif
+}
 
-  
+// Run the event loop until a transfer completes
+static void _bootloader_waitForCompletion(struct _write_queue * q)
+{
+  q->completed = 0;
+  while (!q->completed && q->inFlight > 0)
+    transport_handleEvents(q->bootloader->transport, &q->completed);
+}
 
-  // Write the record's data into the buffer
-  int len = TSIZE - c->cnt;
-  len = MIN(rec->len, len);            // May not copy the entire record!
-  // printf("->Copying %d bytes\n", len);
-  memcpy(c->buf + c->cnt, rec->data, rec->len);
-  c->cnt += len;
-  
-  if (c->cnt >= TSIZE)
-  {
-    // Send the USB packet
-    //
-    // printf(CL_GREEN "=> Writing packet: %d bytes " CL_RESET, c->cnt);
-    int transfered=0;
+static int _bootloader_startWrite(bootloader_t * bootloader)
+{
 #if ACTUALLY_FLASH
-    int status = libusb_bulk_transfer(c->bootloader->devHandle, LIBUSB_ENDPOINT_OUT | 0x01, c->buf, c->cnt, &transfered, 1000);
+  int status = transport_controlIn(bootloader->transport, REQ_START_WRITE, 0, 0, NULL, 0, 1000);
 #else
-    int status = 1;
-    if (verbose > 1)
-    {
-      printHexStr(c->buf, c->cnt);
-      printf("\n");
-    }
-#endif
-    
-    if (status >= 0)
-    {
-      c->bytesWritten += c->cnt;
-      printf("\b\b\b\b"); // Back up
-      printf("% 3d%%", c->bytesWritten * 100 / hex->size);
-    }
-    else
-      printf(CL_RED "Flash Error: %d\n" CL_RESET, status);
-    
-    
-    // If we didn't write the entire record, copy it to the beginning of the buffer
-    if (len < rec->len)
-    {
-      c->cnt = rec->len - len;
-      // Copy the unhandled bytes
-      memcpy(c->buf, rec->data + len, c->cnt);
-    }
-    else
-    {
-      // Record data was aligned; new buffer is empty
-      c->cnt = 0;
-    }
-    
+  int status = 0;
+#endif  
+  if (status < 0)
+    printf(CL_RED "Could not start write\n" CL_RESET);
+  return status;
+}
+
+// Release the slots and whatever they hold
+static void _bootloader_queueFree(struct _write_queue * q)
+{
+  arena_t * arena = q->bootloader->arena;
+  int i;
+  for (i=0; q->slots && i<q->depth; i++)
+  {
+    transport_freeTransfer(q->bootloader->transport, q->slots[i].transfer);
+    arena_free(arena, q->slots[i].buf);
   }
-  else
+  arena_free(arena, q->slots);
+  arena_release(arena, q->mark);
+  q->slots = NULL;
+}
+
+// Set up +depth+ slots, each large enough for the biggest transfer the plan may use.
+// Returns LIBUSB_ERROR_NO_MEM, with nothing left allocated, if they don't fit.
+static int _bootloader_queueOpen(struct _write_queue * q, bootloader_t * bootloader, image_t * image)
+{
+  memset(q, '\0', sizeof(*q));
+  q->bootloader = bootloader;
+  q->depth = MAX(bootloader->queueDepth, 1);
+  bootloader_planWrite(bootloader, image, &q->plan);
+  q->total = image ? q->plan.pages * q->plan.pagesize : 0;
+  q->mark = arena_mark(bootloader->arena);
+  q->slots = arena_malloc(bootloader->arena, q->depth * sizeof(struct _write_slot));
+  if (NULL == q->slots)
+    return LIBUSB_ERROR_NO_MEM;
+  memset(q->slots, '\0', q->depth * sizeof(struct _write_slot));
+
+  int maxPages = q->plan.probing ? q->plan.maxPages : q->plan.pagesPerTransfer;
+  int i;
+  for (i=0; i<q->depth; i++)
   {
-    if (len < rec->len)
+    q->slots[i].transfer = transport_allocTransfer(bootloader->transport, bootloader->arena);
+    q->slots[i].buf = arena_malloc(bootloader->arena, maxPages * q->plan.pagesize);
+    q->slots[i].queue = q;
+    if (NULL == q->slots[i].transfer || NULL == q->slots[i].buf)
     {
-      printf(CL_RED "This should never happen: " CL_RESET 
-             " Had enough room to write %d byte record, but only wrote %d bytes\n",
-             rec->len, len);
+      printf(CL_RED "No memory for %d write buffers\n" CL_RESET, q->depth);
+      _bootloader_queueFree(q);
+      return LIBUSB_ERROR_NO_MEM;
     }
   }
+  return 0;
+}
 
+// Wait for a free slot. Up to +depth+ transfers are in flight while the next ones 
+// are staged, except while probing, when each transfer is timed on its own.
+// Returns NULL once a transfer has failed.
+static struct _write_slot * _bootloader_queueNextSlot(struct _write_queue * q)
+{
+  while (q->inFlight >= (q->plan.probing ? 1 : q->depth) && 0 == q->status)
+    _bootloader_waitForCompletion(q);
+  if (0 != q->status)
+    return NULL;
+
+  struct _write_slot * slot = q->slots;
+  while (slot->busy)
+    slot++;
+  return slot;
+}
+
+// Wait for everything in flight, then release the slots. On error, anything still 
+// queued behind the failure is cancelled first.
+static int _bootloader_queueClose(struct _write_queue * q)
+{
+  int i;
+  if (0 != q->status && !q->cancelled)
+  {
+    for (i=0; i<q->depth; i++)
+      if (q->slots[i].busy)
+        transport_cancel(q->bootloader->transport, q->slots[i].transfer);
+  }
+  while (q->inFlight > 0)
+    _bootloader_waitForCompletion(q);
+
+  if (verbose > 1)
+    printf ("\nDone\n");
   
-  
+  _bootloader_queueFree(q);
+  return q->status;
 }
 
-void bootloader_writeFlash(bootloader_t *bootloader, ihex_t *hex)
+struct bootloader_writer_s {
+  struct _write_queue queue;
+  image_t * image;
+  uint32_t page;               // Next to submit
+  size_t mark;
+};
+
+int bootloader_writeFlash(bootloader_t *bootloader, image_t *image)
 {
   int status;
   
-  // Check that the file will fit
-  if (hex->maxAddr > bootloader->info.memsize)
+  // Check that the image will fit
+  if (image_patchedEnd(image, bootloader->patches, bootloader->patchCount) > bootloader->info.memsize + 1)
   {
     printf(CL_RED "Input file size exceeds max device memory\n" CL_RESET);
-    exit(4);
+    return LIBUSB_ERROR_OVERFLOW;
   }
   
-  // Signal Write Start
-  //
-#if ACTUALLY_FLASH
-  status = libusb_control_transfer(bootloader->devHandle, 0x40 | 0x80, REQ_START_WRITE, 0, 0, NULL, 0, 1000);
-#else
-  status = 0;
-#endif  
+  status = _bootloader_startWrite(bootloader);
   if (status < 0)
-    printf(CL_RED "Could not start write\n" CL_RESET);
-  
+    return status;
   
-  // Read the hex, writing to the bootloader in the callback
-  uint8_t * buf = malloc(TSIZE+1); // byte 0 is the current buffer count! byte 1 is the start of the buffer
-  struct _flash_context context = { 0, 0, buf, bootloader };
-  ihex_read(hex, (ihex_readCallback*)_bootloader_didReadHexRecord, &context);
-  
-  free(buf);
-}
\ No newline at end of file
+  bootloader_writer_t * writer = bootloader_writerOpen(bootloader, image);
+  if (NULL == writer)
+    return LIBUSB_ERROR_NO_MEM;
+  while (0 == (status = bootloader_writerPump(writer)))
+    _bootloader_waitForCompletion(&writer->queue);
+
+  return bootloader_writerClose(writer);
+}
+
+#pragma mark - Non-blocking Writes
+
+bootloader_writer_t * bootloader_writerOpen(bootloader_t * bootloader, image_t * image)
+{
+  size_t mark = arena_mark(bootloader->arena);
+  bootloader_writer_t * writer = arena_malloc(bootloader->arena, sizeof(bootloader_writer_t));
+  if (NULL == writer)
+    return NULL;
+  memset(writer, '\0', sizeof(*writer));
+  writer->mark = mark;
+  writer->image = image;
+  if (_bootloader_queueOpen(&writer->queue, bootloader, image) < 0)
+  {
+    arena_free(bootloader->arena, writer);
+    arena_release(bootloader->arena, mark);
+    return NULL;
+  }
+
+  // The bootloader writes sequentially from the start of flash, so stream every 
+  // page up to the end of the image; gaps between records read back as 0xFF.
+  //
+  // The image is only read from here on: other devices may be writing it at the 
+  // same time. Its page index, if the owner built one, just speeds up lookups.
+  return writer;
+}
+
+int bootloader_writerPump(bootloader_writer_t * writer)
+{
+  struct _write_queue * q = &writer->queue;
+
+  while (0 == q->status && writer->page < q->plan.pages && q->inFlight < (q->plan.probing ? 1 : q->depth))
+  {
+    struct _write_slot * slot = q->slots;
+    while (slot->busy)
+      slot++;
+
+    int pages = MIN(q->plan.pagesPerTransfer, q->plan.pages - writer->page);
+    image_readPatched(writer->image, q->bootloader->patches, q->bootloader->patchCount,
+                      writer->page * q->plan.pagesize, slot->buf, pages * q->plan.pagesize);
+    
+    int status = _bootloader_submitChunk(slot, pages);
+    if (status < 0)
+    {
+      printf(CL_RED "Could not submit transfer: %d\n" CL_RESET, status);
+      q->status = status;
+      break;
+    }
+    writer->page += pages;
+  }
+
+  // After a failure, what's still queued is cancelled and left to drain
+  if (0 != q->status && q->inFlight > 0 && !q->cancelled)
+  {
+    int i;
+    for (i=0; i<q->depth; i++)
+      if (q->slots[i].busy)
+        transport_cancel(q->bootloader->transport, q->slots[i].transfer);
+    q->cancelled = 1;
+  }
+
+  if (q->inFlight > 0)
+    return 0;
+  return (0 != q->status) ? q->status : 1;
+}
+
+int bootloader_writerClose(bootloader_writer_t * writer)
+{
+  arena_t * arena = writer->queue.bootloader->arena;
+  int status = _bootloader_queueClose(&writer->queue);
+  size_t mark = writer->mark;
+
+  arena_free(arena, writer);
+  arena_release(arena, mark);
+  return status;
+}
+
+#pragma mark - Streaming
+
+struct bootloader_stream_s {
+  struct _write_queue queue;
+  struct _write_slot * slot;   // Being filled
+  uint32_t slotAddr;           // Flash address of slot->buf[0]
+  uint32_t slotLen;            // Bytes the slot will carry
+  uint32_t slotFill;           // Bytes staged so far, gaps included
+  uint32_t limit;              // End of the application section
+  crc_t crc;                   // Over everything submitted so far
+  size_t mark;                 // Arena position before the stream
+};
+
+// Take the next slot and clear it to erased flash
+static int _bootloader_streamNextSlot(bootloader_stream_t * stream)
+{
+  bootloader_plan_t * plan = &stream->queue.plan;
+
+  stream->slot = _bootloader_queueNextSlot(&stream->queue);
+  if (NULL == stream->slot)
+    return stream->queue.status;
+
+  stream->slotLen  = MIN(plan->pagesPerTransfer * plan->pagesize, plan->pages * plan->pagesize - stream->slotAddr);
+  stream->slotFill = 0;
+  memset(stream->slot->buf, IMAGE_FILL, stream->slotLen);
+  return 0;
+}
+
+// Send what has been staged, rounded up to whole pages
+static int _bootloader_streamFlush(bootloader_stream_t * stream)
+{
+  uint16_t pagesize = stream->queue.plan.pagesize;
+  int pages = (stream->slotFill + pagesize - 1) / pagesize;
+  if (0 == pages)
+    return 0;
+
+  crc_update(&stream->crc, stream->slot->buf, pages * pagesize);
+
+  int status = _bootloader_submitChunk(stream->slot, pages);
+  if (status < 0)
+  {
+    printf(CL_RED "Could not submit transfer: %d\n" CL_RESET, status);
+    stream->queue.status = status;
+    return status;
+  }
+
+  stream->slotAddr += pages * pagesize;
+  stream->slot = NULL;
+  return 0;
+}
+
+int bootloader_streamBegin(bootloader_t * bootloader, bootloader_stream_t ** streamOut)
+{
+  *streamOut = NULL;
+
+  int status = _bootloader_startWrite(bootloader);
+  if (status < 0)
+    return status;
+
+  size_t mark = arena_mark(bootloader->arena);
+  bootloader_stream_t * stream = arena_malloc(bootloader->arena, sizeof(bootloader_stream_t));
+  if (NULL == stream)
+    return LIBUSB_ERROR_NO_MEM;
+  memset(stream, '\0', sizeof(*stream));
+  stream->mark = mark;
+  status = _bootloader_queueOpen(&stream->queue, bootloader, NULL);
+  if (status < 0)
+  {
+    arena_free(bootloader->arena, stream);
+    arena_release(bootloader->arena, mark);
+    return status;
+  }
+  stream->limit = bootloader->info.memsize + 1;
+  crc_init(&stream->crc);
+
+  *streamOut = stream;
+  return 0;
+}
+
+int bootloader_streamWrite(bootloader_stream_t * stream, uint32_t addr, const uint8_t * data, uint32_t len)
+{
+  if (0 != stream->queue.status)
+    return stream->queue.status;
+
+  if (addr < stream->slotAddr)
+  {
+    printf(CL_RED "\nRecord at 0x%x is behind data already sent (0x%x); "
+                  "streamed input must be in address order\n" CL_RESET, addr, stream->slotAddr);
+    return stream->queue.status = LIBUSB_ERROR_INVALID_PARAM;
+  }
+
+  if (addr + len > stream->limit)
+  {
+    printf(CL_RED "\nInput file size exceeds max device memory\n" CL_RESET);
+    return stream->queue.status = LIBUSB_ERROR_OVERFLOW;
+  }
+
+  while (len > 0)
+  {
+    int status = 0;
+    if (NULL == stream->slot)
+      status = _bootloader_streamNextSlot(stream);
+    else if (addr >= stream->slotAddr + stream->slotLen)
+    {
+      // Past this slot; send it whole, gap and all
+      stream->slotFill = stream->slotLen;
+      status = _bootloader_streamFlush(stream);
+    }
+    else
+    {
+      uint32_t offset = addr - stream->slotAddr;
+      uint32_t n = MIN(len, stream->slotLen - offset);
+      memcpy(stream->slot->buf + offset, data, n);
+      stream->slotFill = MAX(stream->slotFill, offset + n);
+
+      addr += n;
+      data += n;
+      len  -= n;
+    }
+
+    if (status < 0)
+      return status;
+  }
+
+  return 0;
+}
+
+int bootloader_streamFinish(bootloader_stream_t * stream, uint32_t * crc)
+{
+  if (0 == stream->queue.status && stream->slot)
+    _bootloader_streamFlush(stream);
+
+  int status = _bootloader_queueClose(&stream->queue);
+
+  // The device CRCs the whole application section; the rest of it is erased
+  uint32_t words = stream->queue.bootloader->info.memsize / 2 + 1;
+  crc_pad(&stream->crc, words - stream->slotAddr / 2, IMAGE_FILL | (IMAGE_FILL << 8));
+  *crc = stream->crc.crc;
+
+  arena_t * arena = stream->queue.bootloader->arena;
+  size_t mark = stream->mark;
+  arena_free(arena, stream);
+  arena_release(arena, mark);
+  return status;
+}
+
+#pragma mark - Memory
+
+size_t bootloader_arenaSize(bootloader_t * bootloader)
+{
+  // Slots are sized as _bootloader_queueOpen sizes them
+  int pagesize = bootloader->info.pagesize ? bootloader->info.pagesize : BOOTLOADER_DEFAULT_PAGESIZE;
+  int maxPages = MAX(BOOTLOADER_MAX_TRANSFER / pagesize, 1);
+  int pages = (BOOTLOADER_PAGES_AUTO == bootloader->pagesPerTransfer) ? maxPages :
+              MIN(bootloader->pagesPerTransfer, maxPages);
+  int depth = MAX(bootloader->queueDepth, 1);
+
+  return ARENA_SIZEOF(sizeof(bootloader_stream_t)) +
+         ARENA_SIZEOF(depth * sizeof(struct _write_slot)) +
+         depth * (transport_transferArenaSize(bootloader->transport) + ARENA_SIZEOF(pages * pagesize));
+}
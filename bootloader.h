@@ -5,7 +5,9 @@
 //  Copyright (c) 2013 Design Elements. All rights reserved.
 //
 #include <libusb.h>
-#include "ihex.h"
+#include "image.h"
+#include "transport.h"
+#include "arena.h"
 
 #define ACTUALLY_FLASH 1
 
@@ -40,23 +42,108 @@ typedef  struct {
   uint8_t padding[32];
 } __attribute__((packed)) bootloader_info_t;
 
-typedef struct {
-	libusb_device_handle *devHandle;
+// Readiness probing: REQ_INFO is retried until the bootloader answers
+#define BOOTLOADER_READY_TIMEOUT_MS  2000
+#define BOOTLOADER_PROBE_TIMEOUT_MS  100
+#define BOOTLOADER_PROBE_INTERVAL_MS 10
+
+// Bulk transfers kept in flight while writing flash
+#define BOOTLOADER_QUEUE_DEPTH 4
+
+// Transfer sizing. Each bulk transfer carries whole pages; with
+// BOOTLOADER_PAGES_AUTO the first transfers probe for the fastest size. Probe
+// transfers go one at a time, so the probe stops at 1/BOOTLOADER_PROBE_SHARE of
+// the pages and keeps the best size it has seen.
+#define BOOTLOADER_PAGES_AUTO       0
+#define BOOTLOADER_MAX_TRANSFER     (16*1024)
+#define BOOTLOADER_DEFAULT_PAGESIZE 256
+#define BOOTLOADER_PROBE_ROUNDS     2
+#define BOOTLOADER_PROBE_SHARE      8
+
+struct bootloader_s;
+typedef void bootloader_progressCallback(struct bootloader_s *, uint32_t bytesWritten, uint32_t total, void *);
+
+typedef struct bootloader_s {
+	transport_t *transport;
 	bootloader_info_t info;
+	int queueDepth;
+	int pagesPerTransfer;
+
+	// Called as each transfer completes; prints a percentage when NULL. +total+ is 0
+	// while streaming.
+	bootloader_progressCallback *progress;
+	void *progressContext;
+
+	// Write buffers come from here when set; see bootloader_arenaSize
+	arena_t *arena;
+
+	// Written over the image as it goes out, e.g. a serial number; not when streaming
+	const image_patch_t *patches;
+	int patchCount;
 } bootloader_t;
 
+typedef struct {
+  uint16_t pagesize;
+  uint32_t pages;          // Pages to write; only the last one is padded
+  int maxPages;            // Largest transfer, in pages
+  int pagesPerTransfer;
+
+  // Auto-probe state
+  int probing;
+  uint32_t probeBudget;    // Pages the probe may still write
+  int probeRound;
+  double probeRate;        // Best MB/s seen at the current size
+  double bestRate;
+  int bestPages;
+} bootloader_plan_t;
 
 
-void bootloader_init(bootloader_t * bootloader, libusb_device_handle *devHandle);
+
+// Takes ownership of +transport+; bootloader_free closes it
+int bootloader_init(bootloader_t * bootloader, transport_t *transport);
 void bootloader_free(bootloader_t * bootloader);
 
-void bootloader_readInfo(bootloader_t* buffer);
+// bootloader_init without reading the info, for callers that request it themselves;
+// they fill in +info+ and print it with bootloader_printInfo
+int bootloader_open(bootloader_t * bootloader, transport_t *transport);
+
+int bootloader_readInfo(bootloader_t* buffer);
+void bootloader_printInfo(bootloader_t * bootloader);
 const char * bootloader_strForDevice(uint8_t * deviceID);
 
 int bootloader_reset(bootloader_t *bootloader);
 int bootloader_erase(bootloader_t* bootloader);
 int bootloader_appCRC(bootloader_t * bootloader, uint32_t* buffer);
-void bootloader_writeFlash(bootloader_t *bootloader, ihex_t *hex);
+int bootloader_bootCRC(bootloader_t * bootloader, uint32_t* buffer);
+void bootloader_planWrite(bootloader_t * bootloader, image_t * image, bootloader_plan_t * plan);
+int bootloader_writeFlash(bootloader_t *bootloader, image_t *image);
+
+// Arena space a write or stream needs with the current page size, queue depth and
+// transfer size. Call after bootloader_init.
+size_t bootloader_arenaSize(bootloader_t *bootloader);
+
+// Streamed writes: data arrives in address order and goes out as soon as a 
+// transfer's worth is staged, so the image never has to be held in memory. 
+// bootloader_streamFinish returns the expected REQ_CRC_APP value. Writes that run
+// out of memory for their buffers, in the arena or the heap, fail with
+// LIBUSB_ERROR_NO_MEM.
+typedef struct bootloader_stream_s bootloader_stream_t;
+
+int bootloader_streamBegin(bootloader_t *bootloader, bootloader_stream_t **stream);
+int bootloader_streamWrite(bootloader_stream_t *stream, uint32_t addr, const uint8_t *data, uint32_t len);
+int bootloader_streamFinish(bootloader_stream_t *stream, uint32_t *crc);
+
+// bootloader_writeFlash for callers running the transport's events themselves:
+// after REQ_START_WRITE, open a writer and pump it whenever a transfer may have
+// completed. bootloader_writerPump never blocks; it returns 0 while transfers are
+// in flight, 1 once the image is written, or the status of the first failure once
+// what was queued behind it has drained. Close returns the same status. Open
+// returns NULL when there's no memory for the write buffers.
+typedef struct bootloader_writer_s bootloader_writer_t;
+
+bootloader_writer_t * bootloader_writerOpen(bootloader_t *bootloader, image_t *image);
+int bootloader_writerPump(bootloader_writer_t *writer);
+int bootloader_writerClose(bootloader_writer_t *writer);
 
 
 
@@ -0,0 +1,360 @@
+//
+//  cache
+//
+//  Entry layout (host byte order; the magic doubles as an endianness check):
+//
+//    cache_header_t
+//    cache_extent_t × extentCount
+//    payload, starting at a CACHE_ALIGN boundary
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "loader.h"
+#include "util.h"
+#include "colors.h"
+
+extern int verbose;
+
+typedef struct {
+  uint32_t memsize;
+  uint32_t crc;
+} cache_crc_t;
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint64_t hash;
+  uint64_t hexSize;
+  uint32_t maxAddr;
+  uint32_t size;
+  uint32_t extentCount;
+  uint32_t payloadOffset;
+  cache_crc_t crcs[CACHE_MAX_CRCS];   // memsize 0 marks an unused slot
+} cache_header_t;
+
+typedef struct {
+  uint32_t addr;
+  uint32_t len;
+  uint32_t offset;     // From the start of the payload
+} cache_extent_t;
+
+struct cache_s {
+  char * path;
+  int fd;              // Open while the entry is valid
+  uint64_t hash;
+  uint64_t hexSize;
+  cache_header_t header;
+  pthread_mutex_t lock;
+};
+
+#pragma mark - Hashing
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+static inline uint64_t _cache_load64(const uint8_t * p)
+{
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline uint64_t _cache_mix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= HASH_PRIME2;
+  h ^= h >> 29;
+  h *= HASH_PRIME1;
+  h ^= h >> 32;
+  return h;
+}
+
+// Four independent lanes keep the multiplier busy; this runs well past memory
+// bandwidth for hex-sized inputs. Not cryptographic.
+uint64_t cache_hash(const void * bytes, size_t len)
+{
+  const uint8_t * data = bytes;
+  uint64_t lane[4] = { HASH_PRIME1, HASH_PRIME2, ~HASH_PRIME1, ~HASH_PRIME2 };
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32)
+  {
+    lane[0] = (lane[0] ^ _cache_load64(data + i))      * HASH_PRIME1;
+    lane[1] = (lane[1] ^ _cache_load64(data + i + 8))  * HASH_PRIME1;
+    lane[2] = (lane[2] ^ _cache_load64(data + i + 16)) * HASH_PRIME1;
+    lane[3] = (lane[3] ^ _cache_load64(data + i + 24)) * HASH_PRIME1;
+  }
+
+  uint64_t h = len * HASH_PRIME2;
+  h = _cache_mix(h ^ lane[0]);
+  h = _cache_mix(h ^ lane[1]);
+  h = _cache_mix(h ^ lane[2]);
+  h = _cache_mix(h ^ lane[3]);
+
+  for (; i < len; i++)
+    h = (h ^ data[i]) * HASH_PRIME1;
+
+  return _cache_mix(h);
+}
+
+#pragma mark - Entries
+
+cache_t * cache_open(const char * dir, ihex_t * hex)
+{
+  size_t len;
+  const char * contents = ihex_contents(hex, &len);
+  if (NULL == contents)
+    return NULL;
+
+  if (0 != mkdir(dir, 0755) && EEXIST != errno)
+  {
+    printf(CL_YELLOW "Could not create cache directory %s: %s\n" CL_RESET, dir, strerror(errno));
+    return NULL;
+  }
+
+  cache_t * cache = malloc(sizeof(cache_t));
+  memset(cache, '\0', sizeof(*cache));
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->hash = cache_hash(contents, len);
+
+  // The same bytes mean something else in another format; Intel HEX keys stay as they were
+  if (hex->loader && &loader_ihex != hex->loader)
+    cache->hash ^= cache_hash(hex->loader->name, strlen(hex->loader->name));
+  cache->hexSize = len;
+
+  size_t pathLen = strlen(dir) + 32;
+  cache->path = malloc(pathLen);
+  snprintf(cache->path, pathLen, "%s/%016llx.xfc", dir, (unsigned long long)cache->hash);
+
+  // Only an entry for exactly this content counts
+  cache->fd = open(cache->path, O_RDWR);
+  if (-1 != cache->fd)
+  {
+    cache_header_t * h = &cache->header;
+    if (sizeof(*h) != pread(cache->fd, h, sizeof(*h), 0) ||
+        0 != memcmp(h->magic, CACHE_MAGIC, 4) || CACHE_VERSION != h->version ||
+        h->hash != cache->hash || h->hexSize != cache->hexSize)
+    {
+      if (verbose > 0)
+        printf(CL_YELLOW "Ignoring stale cache entry %s\n" CL_RESET, cache->path);
+      close(cache->fd);
+      cache->fd = -1;
+    }
+  }
+
+  if (verbose > 1)
+    printf("Cache %s: %s\n", (-1 == cache->fd) ? "miss" : "hit", cache->path);
+
+  return cache;
+}
+
+void cache_close(cache_t * cache)
+{
+  if (NULL == cache)
+    return;
+
+  if (-1 != cache->fd)
+    close(cache->fd);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->path);
+  free(cache);
+}
+
+image_t * cache_image(cache_t * cache)
+{
+  if (NULL == cache || -1 == cache->fd)
+    return NULL;
+
+  cache_header_t * h = &cache->header;
+  struct stat st;
+  if (0 != fstat(cache->fd, &st))
+    return NULL;
+
+  size_t tableEnd = sizeof(cache_header_t) + (size_t)h->extentCount * sizeof(cache_extent_t);
+  if ((size_t)st.st_size < tableEnd || (size_t)st.st_size < h->payloadOffset || h->payloadOffset < tableEnd)
+    return NULL;
+
+  uint8_t * map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, cache->fd, 0);
+  if (MAP_FAILED == map)
+    return NULL;
+
+  image_t * image = image_new();
+  image->mapping    = map;
+  image->mappingLen = st.st_size;
+  image->maxAddr    = h->maxAddr;
+  image->size       = h->size;
+  image->count      = h->extentCount;
+  image->capacity   = h->extentCount;
+  image->extents    = malloc(MAX(h->extentCount, 1) * sizeof(image_extent_t));
+
+  const cache_extent_t * extents = (const cache_extent_t *)(map + sizeof(cache_header_t));
+  size_t payloadLen = st.st_size - h->payloadOffset;
+
+  uint32_t i;
+  for (i=0; i<h->extentCount; i++)
+  {
+    if ((size_t)extents[i].offset + extents[i].len > payloadLen)
+    {
+      printf(CL_YELLOW "Cache entry %s is truncated\n" CL_RESET, cache->path);
+      image_free(image);
+      return NULL;
+    }
+
+    image_extent_t * e = &image->extents[i];
+    e->addr     = extents[i].addr;
+    e->len      = extents[i].len;
+    e->capacity = extents[i].len;
+    e->data     = map + h->payloadOffset + extents[i].offset;
+  }
+
+  return image;
+}
+
+void cache_store(cache_t * cache, image_t * image)
+{
+  if (NULL == cache)
+    return;
+
+  cache_header_t h;
+  memset(&h, '\0', sizeof(h));
+  memcpy(h.magic, CACHE_MAGIC, 4);
+  h.version     = CACHE_VERSION;
+  h.hash        = cache->hash;
+  h.hexSize     = cache->hexSize;
+  h.maxAddr     = image->maxAddr;
+  h.size        = image->size;
+  h.extentCount = image->count;
+
+  size_t tableEnd = sizeof(h) + (size_t)image->count * sizeof(cache_extent_t);
+  h.payloadOffset = (tableEnd + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+
+  cache_extent_t * extents = malloc(MAX(image->count, 1) * sizeof(cache_extent_t));
+  uint32_t offset = 0;
+  int i;
+  for (i=0; i<image->count; i++)
+  {
+    extents[i].addr   = image->extents[i].addr;
+    extents[i].len    = image->extents[i].len;
+    extents[i].offset = offset;
+    offset += image->extents[i].len;
+  }
+
+  // Write beside the entry and rename over it, so a reader never sees half a file
+  size_t tmpLen = strlen(cache->path) + 16;
+  char * tmp = malloc(tmpLen);
+  snprintf(tmp, tmpLen, "%s.%d", cache->path, (int)getpid());
+
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  int ok = (-1 != fd);
+  if (ok)
+  {
+    ok = (sizeof(h) == pwrite(fd, &h, sizeof(h), 0)) &&
+         ((ssize_t)(image->count * sizeof(cache_extent_t)) ==
+           pwrite(fd, extents, image->count * sizeof(cache_extent_t), sizeof(h)));
+
+    for (i=0; ok && i<image->count; i++)
+      ok = ((ssize_t)image->extents[i].len ==
+             pwrite(fd, image->extents[i].data, image->extents[i].len, h.payloadOffset + extents[i].offset));
+
+    ok = ok && (0 == rename(tmp, cache->path));
+  }
+
+  if (!ok)
+  {
+    printf(CL_YELLOW "Could not write cache entry %s: %s\n" CL_RESET, cache->path, strerror(errno));
+    if (-1 != fd)
+    {
+      close(fd);
+      unlink(tmp);
+    }
+  }
+  else
+  {
+    pthread_mutex_lock(&cache->lock);
+    if (-1 != cache->fd)
+      close(cache->fd);
+    cache->fd = fd;
+    cache->header = h;
+    pthread_mutex_unlock(&cache->lock);
+
+    if (verbose > 1)
+      printf("Cached %d bytes in %d extents as %s\n", image->size, image->count, cache->path);
+  }
+
+  free(tmp);
+  free(extents);
+}
+
+#pragma mark - CRCs
+
+int cache_crc(cache_t * cache, uint32_t memsize, uint32_t * crc)
+{
+  if (NULL == cache)
+    return 0;
+
+  int i, found = 0;
+  pthread_mutex_lock(&cache->lock);
+  for (i=0; i<CACHE_MAX_CRCS && -1 != cache->fd; i++)
+  {
+    if (cache->header.crcs[i].memsize == memsize + 1)
+    {
+      *crc = cache->header.crcs[i].crc;
+      found = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return found;
+}
+
+void cache_storeCRC(cache_t * cache, uint32_t memsize, uint32_t crc)
+{
+  if (NULL == cache)
+    return;
+
+  pthread_mutex_lock(&cache->lock);
+
+  // Keyed by memsize + 1 so that 0 can mark a free slot; the oldest is replaced when full
+  cache_crc_t * crcs = cache->header.crcs;
+  int i;
+  for (i=0; i<CACHE_MAX_CRCS - 1; i++)
+    if (0 == crcs[i].memsize || crcs[i].memsize == memsize + 1)
+      break;
+
+  if (0 != crcs[i].memsize && crcs[i].memsize != memsize + 1)
+  {
+    memmove(&crcs[0], &crcs[1], (CACHE_MAX_CRCS - 1) * sizeof(cache_crc_t));
+    i = CACHE_MAX_CRCS - 1;
+  }
+
+  crcs[i].memsize = memsize + 1;
+  crcs[i].crc = crc;
+
+  // A table only partly written could hand a later run a CRC that was never stored, and
+  // so skip a device as current. Clear it instead, or failing that drop the entry.
+  if (-1 != cache->fd &&
+      (ssize_t)sizeof(cache->header.crcs) != pwrite(cache->fd, crcs, sizeof(cache->header.crcs), offsetof(cache_header_t, crcs)))
+  {
+    printf(CL_YELLOW "Could not store CRC in cache entry %s: %s\n" CL_RESET, cache->path, strerror(errno));
+
+    cache_crc_t cleared[CACHE_MAX_CRCS];
+    memset(cleared, '\0', sizeof(cleared));
+    if ((ssize_t)sizeof(cleared) != pwrite(cache->fd, cleared, sizeof(cleared), offsetof(cache_header_t, crcs)))
+      unlink(cache->path);
+  }
+
+  pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,44 @@
+//
+//  cache
+//
+//  Parsed images kept on disk, keyed by a hash of the hex file's contents.
+//  A cache entry holds the extent table and payload plus the padded CRC for
+//  each device memsize it has been flashed to, and is memory mapped on a hit
+//  so nothing has to be decoded or copied.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdint.h>
+#include <stddef.h>
+#include "ihex.h"
+#include "image.h"
+
+#ifndef cache_h
+#define cache_h
+
+#define CACHE_MAGIC     "XFC1"
+#define CACHE_VERSION   1
+#define CACHE_MAX_CRCS  8       // Distinct memsizes remembered per image
+#define CACHE_ALIGN     4096    // Payload alignment in the file
+
+typedef struct cache_s cache_t;
+
+// The content hash entries are keyed by
+uint64_t cache_hash(const void * data, size_t len);
+
+// Hash the contents of +hex+ and look for an entry in +dir+, which is created
+// if needed. Returns NULL when the input can't be hashed up front (e.g. a pipe).
+cache_t * cache_open(const char * dir, ihex_t * hex);
+void cache_close(cache_t * cache);
+
+// The cached image, mapped, or NULL on a miss
+image_t * cache_image(cache_t * cache);
+
+// Write +image+ as the entry for this content
+void cache_store(cache_t * cache, image_t * image);
+
+// Padded CRC for a device of +memsize+. cache_crc returns 0 on a miss.
+int  cache_crc(cache_t * cache, uint32_t memsize, uint32_t * crc);
+void cache_storeCRC(cache_t * cache, uint32_t memsize, uint32_t crc);
+
+#endif
@@ -0,0 +1,168 @@
+//
+//  crc
+//
+//  The 24-bit CRC the XMEGA NVM controller computes over flash (REQ_CRC_APP).
+//  Flash is consumed as little-endian 16-bit words.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+//  Each word updates the register as crc' = A*crc ^ d, where A shifts left by one
+//  and folds bit 23 back in through CRC32_POLY. Everything here leans on that
+//  being linear over GF(2):
+//
+//   - For j <= 8, A^j * d is just d << j (a 16-bit word can't reach bit 23 within
+//     8 shifts), so a block of 8 words needs a table only to apply A^8 to the
+//     register; the data words fold in with plain shifts.
+//
+//   - Padding with n copies of p is crc' = A^n * crc ^ (A^(n-1) + ... + A + 1) * p.
+//     A^(2^k) is precomputed, so any n is applied as O(log n) 24x24 bit-matrix steps.
+//
+//   - Changing words changes the result by the CRC of the difference alone, advanced
+//     past whatever follows it, so a patch never needs the rest of the data.
+//
+#include <string.h>
+
+#include "crc.h"
+#include "util.h"
+
+#define CRC_BITS   24
+#define CRC_LEVELS 32  // A^(2^k) for every bit of a 32-bit word count
+
+// A 24x24 matrix over GF(2), stored as the image of each basis bit
+typedef struct {
+  uint32_t col[CRC_BITS];
+} crc_matrix_t;
+
+static uint32_t advance8[3][256];            // A^8 applied to each byte of the register
+static crc_matrix_t advancePow2[CRC_LEVELS]; // A^(2^k)
+
+static inline uint32_t _crc_shift(uint32_t x)
+{
+  return ((x << 1) & 0x00FFfffe) ^ ((x & (1 << 23)) ? CRC32_POLY : 0);
+}
+
+static uint32_t _crc_apply(const crc_matrix_t * m, uint32_t x)
+{
+  uint32_t r = 0;
+  int i;
+  for (i=0; x; i++, x >>= 1)
+    if (x & 1)
+      r ^= m->col[i];
+  return r;
+}
+
+__attribute__((constructor))
+static void _crc_buildTables(void)
+{
+  int i, b, v;
+
+  // A itself
+  for (i=0; i<CRC_BITS; i++)
+    advancePow2[0].col[i] = _crc_shift(1UL << i);
+
+  // A^(2^(k+1)) = A^(2^k) * A^(2^k)
+  for (i=1; i<CRC_LEVELS; i++)
+  {
+    for (b=0; b<CRC_BITS; b++)
+      advancePow2[i].col[b] = _crc_apply(&advancePow2[i-1], advancePow2[i-1].col[b]);
+  }
+
+  // A^8 per register byte
+  for (b=0; b<3; b++)
+  {
+    for (v=0; v<256; v++)
+      advance8[b][v] = _crc_apply(&advancePow2[3], (uint32_t)v << (8*b));
+  }
+}
+
+void crc_init(crc_t * c)
+{
+  memset(c, '\0', sizeof(*c));
+}
+
+void crc_updateWord(crc_t * c, uint16_t d)
+{
+  c->crc = _crc_shift(c->crc) ^ d;
+  c->count++;
+}
+
+static inline uint32_t _readWord(const uint8_t * p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+void crc_update(crc_t * c, const uint8_t * data, size_t len)
+{
+  uint32_t crc = c->crc;
+  const uint8_t * end = data + (len & ~(size_t)15);
+
+  // 8 words per step
+  for (; data < end; data += 16)
+  {
+    crc = advance8[0][crc & 0xff] ^ advance8[1][(crc >> 8) & 0xff] ^ advance8[2][crc >> 16];
+    crc ^= (_readWord(data +  0) << 7) ^ (_readWord(data +  2) << 6)
+         ^ (_readWord(data +  4) << 5) ^ (_readWord(data +  6) << 4)
+         ^ (_readWord(data +  8) << 3) ^ (_readWord(data + 10) << 2)
+         ^ (_readWord(data + 12) << 1) ^  _readWord(data + 14);
+  }
+  c->crc = crc;
+  c->count += (len & ~(size_t)15) / 2;
+
+  // Remaining words
+  len &= 15;
+  for (; len >= 2; len -= 2, data += 2)
+    crc_updateWord(c, _readWord(data));
+
+  if (len)
+    crc_updateWord(c, data[0] | 0xff00);
+}
+
+uint32_t crc_advance(uint32_t crc, uint32_t words)
+{
+  int k;
+  for (k=0; words; k++, words >>= 1)
+    if (words & 1)
+      crc = _crc_apply(&advancePow2[k], crc);
+  return crc;
+}
+
+uint32_t crc_delta(const uint8_t * from, const uint8_t * to, size_t len, uint32_t wordsAfter)
+{
+  uint8_t diff[64];
+  crc_t c;
+  crc_init(&c);
+
+  size_t i;
+  while (len)
+  {
+    size_t n = MIN(len, sizeof(diff));
+    for (i=0; i<n; i++)
+      diff[i] = from[i] ^ to[i];
+    crc_update(&c, diff, n);
+
+    from += n;
+    to += n;
+    len -= n;
+  }
+  return crc_advance(c.crc, wordsAfter);
+}
+
+void crc_pad(crc_t * c, uint32_t words, uint16_t pad)
+{
+  uint32_t crc = c->crc;
+  uint32_t sum = pad; // (A^(2^k - 1) + ... + A + 1) * pad, starting at k = 0
+
+  c->count += words;
+
+  int k;
+  for (k=0; words; k++, words >>= 1)
+  {
+    if (words & 1)
+      crc = _crc_apply(&advancePow2[k], crc) ^ sum;
+
+    // Sum over 2^(k+1) words = A^(2^k) * sum ^ sum
+    sum = _crc_apply(&advancePow2[k], sum) ^ sum;
+  }
+
+  c->crc = crc;
+}
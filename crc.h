@@ -0,0 +1,43 @@
+//
+//  crc
+//
+//  The 24-bit CRC the XMEGA NVM controller computes over flash (REQ_CRC_APP).
+//  Flash is consumed as little-endian 16-bit words.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef crc_h
+#define crc_h
+
+#define CRC32_POLY 0x0080001BL
+#define CRC_MASK   0x00FFFFFFL
+
+typedef struct {
+  uint32_t crc;
+  uint32_t count; // Number of words processed so far
+} crc_t;
+
+void crc_init(crc_t * c);
+
+// Reference kernel: one word at a time, exactly as the NVM controller does it
+void crc_updateWord(crc_t * c, uint16_t d);
+
+// Process +len+ bytes of flash. An odd trailing byte is paired with 0xFF.
+void crc_update(crc_t * c, const uint8_t * data, size_t len);
+
+// Process +words+ copies of +pad+ in O(log words)
+void crc_pad(crc_t * c, uint32_t words, uint16_t pad);
+
+// The register after +words+ zero words, i.e. A^words * crc, in O(log words)
+uint32_t crc_advance(uint32_t crc, uint32_t words);
+
+// What a CRC changes by when +len+ bytes (a whole number of words) of the data it
+// covers change from +from+ to +to+, with +wordsAfter+ words following them. XOR
+// it into the CRC: only the difference matters, so this is O(len + log wordsAfter)
+// however much data there is.
+uint32_t crc_delta(const uint8_t * from, const uint8_t * to, size_t len, uint32_t wordsAfter);
+
+#endif
@@ -0,0 +1,350 @@
+//
+//  decompress
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#if HAVE_ZLIB
+  #include <zlib.h>
+#endif
+#if HAVE_LZMA
+  #include <lzma.h>
+#endif
+#if HAVE_ZSTD
+  #include <zstd.h>
+#endif
+
+#include "decompress.h"
+#include "colors.h"
+
+extern int verbose;
+
+struct decompress_s {
+  decompress_format_t format;
+  int fd;
+  int atEOF;          // Nothing more to read from fd
+  int finished;       // The last stream ended cleanly
+  int inFrame;        // zstd: the current frame hasn't ended
+  uint8_t * next;     // Unconsumed input in +in+
+  size_t avail;
+
+  union {
+#if HAVE_ZLIB
+    z_stream z;
+#endif
+#if HAVE_LZMA
+    lzma_stream xz;
+#endif
+#if HAVE_ZSTD
+    ZSTD_DStream * zstd;
+#endif
+    int unused;
+  };
+
+  uint8_t in[DECOMPRESS_BLOCK];
+};
+
+#pragma mark - Formats
+
+decompress_format_t decompress_detect(const uint8_t * head, size_t len)
+{
+  static const uint8_t gzip[] = { 0x1f, 0x8b };
+  static const uint8_t xz[]   = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+  static const uint8_t zstd[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+  if (len >= sizeof(gzip) && 0 == memcmp(head, gzip, sizeof(gzip)))
+    return decompress_gzip;
+  if (len >= sizeof(xz) && 0 == memcmp(head, xz, sizeof(xz)))
+    return decompress_xz;
+  if (len >= sizeof(zstd) && 0 == memcmp(head, zstd, sizeof(zstd)))
+    return decompress_zstd;
+
+  return decompress_none;
+}
+
+const char * decompress_formatName(decompress_format_t format)
+{
+  switch (format)
+  {
+    case decompress_gzip: return "gzip";
+    case decompress_xz:   return "xz";
+    case decompress_zstd: return "zstd";
+    default:              return "plain";
+  }
+}
+
+// What a build needs to decode +format+
+static const char * _decompress_library(decompress_format_t format)
+{
+  switch (format)
+  {
+    case decompress_gzip: return "zlib";
+    case decompress_xz:   return "liblzma";
+    case decompress_zstd: return "libzstd";
+    default:              return "nothing";
+  }
+}
+
+#pragma mark - Input
+
+#if HAVE_ZLIB || HAVE_LZMA || HAVE_ZSTD
+// Refill +in+ once it has all been consumed. Returns -1 on a read error.
+static int _decompress_fill(decompress_t * d)
+{
+  if (d->avail > 0 || d->atEOF)
+    return 0;
+
+  ssize_t len;
+  do {
+    len = read(d->fd, d->in, sizeof(d->in));
+  } while (len < 0 && (EINTR == errno || EAGAIN == errno));
+
+  if (len < 0)
+  {
+    perror(CL_RED "Could not read" CL_RESET);
+    return -1;
+  }
+
+  d->next = d->in;
+  d->avail = len;
+  d->atEOF = (0 == len);
+  return 0;
+}
+
+static ssize_t _decompress_fail(decompress_t * d, const char * what)
+{
+  printf(CL_RED "Corrupt %s input: %s\n" CL_RESET, decompress_formatName(d->format), what);
+  return -1;
+}
+#endif
+
+#pragma mark - gzip
+
+#if HAVE_ZLIB
+static int _decompress_gzipOpen(decompress_t * d)
+{
+  // 32 lets zlib take a gzip or zlib header
+  return Z_OK == inflateInit2(&d->z, 32 + MAX_WBITS);
+}
+
+static ssize_t _decompress_gzipRead(decompress_t * d, uint8_t * buf, size_t len)
+{
+  z_stream * z = &d->z;
+  z->next_out = buf;
+  z->avail_out = len;
+
+  while (z->avail_out == len && !d->finished)
+  {
+    if (_decompress_fill(d) < 0)
+      return -1;
+    if (0 == d->avail && d->atEOF)
+      return _decompress_fail(d, "truncated");
+
+    z->next_in = d->next;
+    z->avail_in = d->avail;
+    int status = inflate(z, Z_NO_FLUSH);
+    d->next = z->next_in;
+    d->avail = z->avail_in;
+
+    if (Z_STREAM_END == status)
+    {
+      // gzip allows members to be concatenated
+      if (_decompress_fill(d) < 0)
+        return -1;
+      if (0 == d->avail)
+        d->finished = 1;
+      else
+        inflateReset(z);
+    }
+    else if (Z_OK != status && Z_BUF_ERROR != status)
+      return _decompress_fail(d, z->msg ? z->msg : "inflate failed");
+  }
+
+  return len - z->avail_out;
+}
+#endif
+
+#pragma mark - xz
+
+#if HAVE_LZMA
+static int _decompress_xzOpen(decompress_t * d)
+{
+  lzma_stream init = LZMA_STREAM_INIT;
+  d->xz = init;
+  return LZMA_OK == lzma_stream_decoder(&d->xz, DECOMPRESS_MEMLIMIT, LZMA_CONCATENATED);
+}
+
+static ssize_t _decompress_xzRead(decompress_t * d, uint8_t * buf, size_t len)
+{
+  lzma_stream * xz = &d->xz;
+  xz->next_out = buf;
+  xz->avail_out = len;
+
+  while (xz->avail_out == len && !d->finished)
+  {
+    if (_decompress_fill(d) < 0)
+      return -1;
+
+    xz->next_in = d->next;
+    xz->avail_in = d->avail;
+    lzma_ret status = lzma_code(xz, d->atEOF ? LZMA_FINISH : LZMA_RUN);
+    d->next = (uint8_t *)xz->next_in;
+    d->avail = xz->avail_in;
+
+    if (LZMA_STREAM_END == status)
+      d->finished = 1;
+    else if (LZMA_MEMLIMIT_ERROR == status)
+      return _decompress_fail(d, "needs more than DECOMPRESS_MEMLIMIT to decode");
+    else if (LZMA_BUF_ERROR == status)
+      return _decompress_fail(d, "truncated");
+    else if (LZMA_OK != status)
+      return _decompress_fail(d, "lzma_code failed");
+  }
+
+  return len - xz->avail_out;
+}
+#endif
+
+#pragma mark - zstd
+
+#if HAVE_ZSTD
+static int _decompress_zstdOpen(decompress_t * d)
+{
+  d->zstd = ZSTD_createDStream();
+  if (NULL == d->zstd)
+    return 0;
+
+  // Refuse frames whose window wouldn't fit under the limit
+  int windowLog = 10;
+  while ((1 << (windowLog + 1)) <= DECOMPRESS_MEMLIMIT)
+    windowLog++;
+  ZSTD_DCtx_setParameter(d->zstd, ZSTD_d_windowLogMax, windowLog);
+  d->inFrame = 1;
+  return 1;
+}
+
+static ssize_t _decompress_zstdRead(decompress_t * d, uint8_t * buf, size_t len)
+{
+  ZSTD_outBuffer out = { buf, len, 0 };
+
+  while (0 == out.pos && !d->finished)
+  {
+    if (_decompress_fill(d) < 0)
+      return -1;
+    if (0 == d->avail && d->atEOF)
+    {
+      if (d->inFrame)
+        return _decompress_fail(d, "truncated");
+      d->finished = 1;
+      break;
+    }
+
+    ZSTD_inBuffer in = { d->next, d->avail, 0 };
+    size_t hint = ZSTD_decompressStream(d->zstd, &out, &in);
+    d->next += in.pos;
+    d->avail -= in.pos;
+
+    if (ZSTD_isError(hint))
+      return _decompress_fail(d, ZSTD_getErrorName(hint));
+    d->inFrame = (0 != hint);   // 0 once a frame is complete and flushed
+  }
+
+  return out.pos;
+}
+#endif
+
+#pragma mark - Streams
+
+decompress_t * decompress_open(decompress_format_t format, int fd, const uint8_t * head, size_t headLen)
+{
+  decompress_t * d = malloc(sizeof(decompress_t));
+  memset(d, '\0', offsetof(decompress_t, in));
+  d->format = format;
+  d->fd = fd;
+
+  // Bytes already taken from fd to detect the format come first
+  if (headLen > 0)
+  {
+    memcpy(d->in, head, headLen);
+    d->next = d->in;
+    d->avail = headLen;
+  }
+
+  int ok = 0;
+  switch (format)
+  {
+#if HAVE_ZLIB
+    case decompress_gzip: ok = _decompress_gzipOpen(d); break;
+#endif
+#if HAVE_LZMA
+    case decompress_xz:   ok = _decompress_xzOpen(d);   break;
+#endif
+#if HAVE_ZSTD
+    case decompress_zstd: ok = _decompress_zstdOpen(d); break;
+#endif
+    default:
+      printf(CL_RED "%s input needs a build with %s\n" CL_RESET, decompress_formatName(format),
+        _decompress_library(format));
+      free(d);
+      return NULL;
+  }
+
+  if (!ok)
+  {
+    printf(CL_RED "Could not start the %s decoder\n" CL_RESET, decompress_formatName(format));
+    free(d);
+    return NULL;
+  }
+
+  if (verbose > 1)
+    printf("Decoding %s input\n", decompress_formatName(format));
+
+  return d;
+}
+
+ssize_t decompress_read(decompress_t * d, void * buf, size_t len)
+{
+  if (d->finished || 0 == len)
+    return 0;
+
+  switch (d->format)
+  {
+#if HAVE_ZLIB
+    case decompress_gzip: return _decompress_gzipRead(d, buf, len);
+#endif
+#if HAVE_LZMA
+    case decompress_xz:   return _decompress_xzRead(d, buf, len);
+#endif
+#if HAVE_ZSTD
+    case decompress_zstd: return _decompress_zstdRead(d, buf, len);
+#endif
+    default:              return -1;
+  }
+}
+
+void decompress_close(decompress_t * d)
+{
+  if (NULL == d)
+    return;
+
+  switch (d->format)
+  {
+#if HAVE_ZLIB
+    case decompress_gzip: inflateEnd(&d->z); break;
+#endif
+#if HAVE_LZMA
+    case decompress_xz:   lzma_end(&d->xz); break;
+#endif
+#if HAVE_ZSTD
+    case decompress_zstd: ZSTD_freeDStream(d->zstd); break;
+#endif
+    default: break;
+  }
+
+  free(d);
+}
@@ -0,0 +1,44 @@
+//
+//  decompress
+//
+//  Compressed input, recognized by its magic bytes and decoded as it is read
+//  so that nothing is unpacked to disk first. Each format needs its library at
+//  build time (HAVE_ZLIB, HAVE_LZMA, HAVE_ZSTD); the makefile enables whichever
+//  are installed. Decoder memory is bounded by DECOMPRESS_MEMLIMIT.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifndef decompress_h
+#define decompress_h
+
+#define DECOMPRESS_MAGIC_LEN  6                   // Enough to tell the formats apart
+#define DECOMPRESS_BLOCK      (64*1024)           // Compressed bytes read at a time
+#define DECOMPRESS_MEMLIMIT   (16*1024*1024)      // Largest xz dictionary or zstd window
+
+typedef enum {
+  decompress_none = 0,
+  decompress_gzip,
+  decompress_xz,
+  decompress_zstd,
+} decompress_format_t;
+
+typedef struct decompress_s decompress_t;
+
+decompress_format_t decompress_detect(const uint8_t * head, size_t len);
+const char * decompress_formatName(decompress_format_t format);
+
+// Decode +format+ from +fd+. +head+ holds bytes already taken from +fd+, which come
+// first. Returns NULL, with a message, when this build can't decode +format+.
+decompress_t * decompress_open(decompress_format_t format, int fd, const uint8_t * head, size_t headLen);
+
+// Up to +len+ decoded bytes; 0 at the end of the input, negative on corrupt or
+// truncated input (a message is printed)
+ssize_t decompress_read(decompress_t * d, void * buf, size_t len);
+
+void decompress_close(decompress_t * d);
+
+#endif
@@ -0,0 +1,140 @@
+//
+//  elf
+//
+//  ELF executables, as the linker leaves them: the file contents of every
+//  PT_LOAD segment are flashed at its physical (load) address, as objcopy does
+//  when it makes a hex file. Files without program headers fall back to their
+//  allocated PROGBITS sections. 32 and 64 bit, either byte order.
+//
+//  avr-gcc puts RAM, EEPROM, fuses and lock bits at 0x800000 and up; those
+//  segments are left out so an AVR ELF flashes like its .hex.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdio.h>
+#include <string.h>
+
+#include "loader.h"
+#include "colors.h"
+
+extern int verbose;
+
+#define ELF_PT_LOAD       1
+#define ELF_SHT_PROGBITS  1
+#define ELF_SHF_ALLOC     2
+#define ELF_EM_AVR        83
+#define ELF_AVR_FLASH_END 0x800000
+
+typedef struct {
+  const uint8_t * bytes;
+  size_t len;
+  int is64;
+  int bigEndian;
+} elf_file_t;
+
+static uint64_t _elf_read(elf_file_t * elf, size_t offset, int size)
+{
+  uint64_t v = 0;
+  int i;
+  for (i=0; i<size; i++)
+  {
+    int shift = elf->bigEndian ? 8 * (size - 1 - i) : 8 * i;
+    v |= (uint64_t)elf->bytes[offset + i] << shift;
+  }
+  return v;
+}
+
+// Where the program header (or, with +sections+, section header) at +entry+ puts
+// its file contents. Returns 0 if there's nothing to load.
+static int _elf_loadable(elf_file_t * elf, size_t entry, int sections,
+                         uint64_t * offset, uint64_t * addr, uint64_t * size)
+{
+  if (sections)
+  {
+    uint64_t flags = _elf_read(elf, entry + 8, elf->is64 ? 8 : 4);
+    if (ELF_SHT_PROGBITS != _elf_read(elf, entry + 4, 4) || !(flags & ELF_SHF_ALLOC))
+      return 0;
+
+    *addr   = elf->is64 ? _elf_read(elf, entry + 16, 8) : _elf_read(elf, entry + 12, 4);
+    *offset = elf->is64 ? _elf_read(elf, entry + 24, 8) : _elf_read(elf, entry + 16, 4);
+    *size   = elf->is64 ? _elf_read(elf, entry + 32, 8) : _elf_read(elf, entry + 20, 4);
+  }
+  else
+  {
+    if (ELF_PT_LOAD != _elf_read(elf, entry, 4))
+      return 0;
+
+    *offset = elf->is64 ? _elf_read(elf, entry + 8,  8) : _elf_read(elf, entry + 4,  4);
+    *addr   = elf->is64 ? _elf_read(elf, entry + 24, 8) : _elf_read(elf, entry + 12, 4);
+    *size   = elf->is64 ? _elf_read(elf, entry + 32, 8) : _elf_read(elf, entry + 16, 4);
+  }
+
+  return *size > 0;
+}
+
+static void _elf_readData(ihex_t * input, ihex_dataCallback callback, void * context)
+{
+  int done = 0;
+  elf_file_t elf = { 0 };
+  elf.bytes = ihex_bytes(input, &elf.len);
+  if (NULL == elf.bytes)
+    return;
+
+  // e_ident: magic, class, data
+  if (elf.len < 52 || 0 != memcmp(elf.bytes, "\x7f" "ELF", 4) ||
+      elf.bytes[4] < 1 || elf.bytes[4] > 2 || elf.bytes[5] < 1 || elf.bytes[5] > 2 ||
+      (2 == elf.bytes[4] && elf.len < 64))
+  {
+    ihex_invalid(input, "Invalid ELF header", 0, &done);
+    return;
+  }
+  elf.is64 = (2 == elf.bytes[4]);
+  elf.bigEndian = (2 == elf.bytes[5]);
+
+  int machine = _elf_read(&elf, 18, 2);
+
+  // Linked executables have program headers. Objects (e.g. objcopy -O elf32-little
+  // from a hex file) only have sections; their allocated contents are used instead.
+  int sections = (0 == _elf_read(&elf, elf.is64 ? 56 : 44, 2));
+  uint64_t table = sections ? _elf_read(&elf, elf.is64 ? 40 : 32, elf.is64 ? 8 : 4)
+                            : _elf_read(&elf, elf.is64 ? 32 : 28, elf.is64 ? 8 : 4);
+  int entrySize  = _elf_read(&elf, elf.is64 ? (sections ? 58 : 54) : (sections ? 46 : 42), 2);
+  int entries    = _elf_read(&elf, elf.is64 ? (sections ? 60 : 56) : (sections ? 48 : 44), 2);
+  int minSize    = sections ? (elf.is64 ? 64 : 40) : (elf.is64 ? 56 : 32);
+
+  if (entries > 0 && (entrySize < minSize || table > elf.len || (uint64_t)entries * entrySize > elf.len - table))
+  {
+    ihex_invalid(input, sections ? "Invalid ELF section headers" : "Invalid ELF program headers", table, &done);
+    return;
+  }
+
+  int i;
+  for (i=0; i<entries; i++)
+  {
+    size_t entry = table + (size_t)i * entrySize;
+    uint64_t offset, addr, size;
+    if (!_elf_loadable(&elf, entry, sections, &offset, &addr, &size))
+      continue;
+    if (ELF_EM_AVR == machine && addr >= ELF_AVR_FLASH_END)
+      continue;
+
+    if (offset > elf.len || size > elf.len - offset || size > INT32_MAX || addr + size > 0x100000000ULL)
+    {
+      ihex_invalid(input, "ELF segment out of range", entry, &done);
+      return;
+    }
+
+    if (verbose > 1)
+      printf("ELF %s: %llu bytes at 0x%llx\n", sections ? "section" : "segment",
+        (unsigned long long)size, (unsigned long long)addr);
+
+    callback(input, addr, elf.bytes + offset, size, context);
+    if (input->stopped)
+      return;
+  }
+}
+
+const loader_t loader_elf = {
+  .name     = "ELF",
+  .readData = _elf_readData,
+};
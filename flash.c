@@ -0,0 +1,1282 @@
+//
+//  flash
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libusb.h>
+
+#include "flash.h"
+#include "util.h"
+#include "bootloader.h"
+#include "trace.h"
+#include "colors.h"
+
+int verbose=0;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+  #define HAVE_HOTPLUG 1
+#endif
+
+struct flash_session_s {
+  libusb_context *ctx;
+  int ownsContext;
+  flash_options_t options;
+  policy_t policy;          // Timeouts learned from every device in the session
+
+  // Held from enumeration until the bootloaders of any reset applications have
+  // been found, so arrivals can be told apart from another job's
+  pthread_mutex_t reattachLock;
+
+  // Ports of the applications that were reset; their bootloaders come back there
+  char reattachPaths[FLASH_MAX_DEVICES][DEVICE_LABEL_LEN];
+  int reattachPathCount;
+  volatile int reattachArrivals;
+#if HAVE_HOTPLUG
+  int reattachRegistered;
+  libusb_hotplug_callback_handle reattachHandle;
+#endif
+
+  // Ports of the devices being flashed
+  pthread_mutex_t busyLock;
+  char busyLabels[FLASH_MAX_DEVICES][DEVICE_LABEL_LEN];
+  int busyCount;
+};
+
+#pragma mark - Sessions
+
+void flash_defaultOptions(flash_options_t *options)
+{
+  memset(options, '\0', sizeof(*options));
+  options->vendorID = FLASH_ID_ANY;
+  options->productID = FLASH_ID_ANY;
+  options->queueDepth = BOOTLOADER_QUEUE_DEPTH;
+  options->pagesPerTransfer = BOOTLOADER_PAGES_AUTO;
+  options->writeAttempts = FLASH_WRITE_ATTEMPTS;
+  options->learnTimeouts = 1;
+}
+
+int flash_sessionNew(flash_session_t **sessionOut, const flash_options_t *options, libusb_context *usb)
+{
+  *sessionOut = NULL;
+
+  flash_session_t *session = malloc(sizeof(flash_session_t));
+  if (NULL == session)
+    return LIBUSB_ERROR_NO_MEM;
+  memset(session, '\0', sizeof(*session));
+
+  if (options)
+    session->options = *options;
+  else
+    flash_defaultOptions(&session->options);
+  session->options.queueDepth = MAX(session->options.queueDepth, 1);
+
+  session->ctx = usb;
+  if (NULL == usb)
+  {
+    int s = libusb_init(&session->ctx);
+    if (0 != s)
+    {
+      free(session);
+      return s;
+    }
+    session->ownsContext = 1;
+  }
+
+  pthread_mutex_init(&session->reattachLock, NULL);
+  pthread_mutex_init(&session->busyLock, NULL);
+  policy_init(&session->policy);
+
+  *sessionOut = session;
+  return 0;
+}
+
+// Flashes in the session must have finished
+void flash_sessionFree(flash_session_t *session)
+{
+  if (NULL == session)
+    return;
+
+  pthread_mutex_destroy(&session->reattachLock);
+  pthread_mutex_destroy(&session->busyLock);
+  policy_destroy(&session->policy);
+  if (session->ownsContext)
+    libusb_exit(session->ctx);
+  free(session);
+}
+
+libusb_context * flash_sessionContext(flash_session_t *session)
+{
+  return session->ctx;
+}
+
+const flash_options_t * flash_sessionOptions(flash_session_t *session)
+{
+  return &session->options;
+}
+
+policy_t * flash_sessionPolicy(flash_session_t *session)
+{
+  return session->options.learnTimeouts ? &session->policy : NULL;
+}
+
+#pragma mark - Selection
+
+void device_path(libusb_device *dev, char *path, size_t len)
+{
+  uint8_t ports[7];
+  int count = libusb_get_port_numbers(dev, ports, sizeof(ports));
+  int n = snprintf(path, len, "%d", libusb_get_bus_number(dev));
+
+  int i;
+  for (i=0; i<count && n < (int)len; i++)
+    n += snprintf(path + n, len - n, "%c%d", i ? '.' : '-', ports[i]);
+
+  // No port chain (a root hub, or the platform can't tell); the address will do
+  if (count <= 0 && n < (int)len)
+    snprintf(path + n, len - n, "@%d", libusb_get_device_address(dev));
+}
+
+void device_parseSelector(const char *string, device_selector_t *selector)
+{
+  memset(selector, '\0', sizeof(*selector));
+  if (NULL == string || 0 == strcmp(string, "all"))
+    return;
+
+  if (0 == strncmp(string, "serial=", 7))
+    snprintf(selector->serial, sizeof(selector->serial), "%s", string + 7);
+  else
+    snprintf(selector->path, sizeof(selector->path), "%s", string);
+}
+
+// Reading the serial means opening the device, so it's the last thing checked
+static int _device_hasSerial(libusb_device *dev, struct libusb_device_descriptor *desc, const char *serial)
+{
+  if (0 == desc->iSerialNumber)
+    return 0;
+
+  libusb_device_handle *devHandle = NULL;
+  if (0 != libusb_open(dev, &devHandle))
+    return 0;
+
+  unsigned char buf[64];
+  int len = libusb_get_string_descriptor_ascii(devHandle, desc->iSerialNumber, buf, sizeof(buf) - 1);
+  libusb_close(devHandle);
+
+  if (len < 0)
+    return 0;
+  buf[len] = '\0';
+  return 0 == strcmp((char *)buf, serial);
+}
+
+// The first bootloader matching +selector+, else the last matching application.
+// Returns a referenced device, or NULL.
+static libusb_device * _flash_findDevice(flash_session_t *session, const device_selector_t *selector,
+                                          int vendorID, int productID)
+{
+  ssize_t i = 0;
+  printf("Searching for devices...\n");
+
+  libusb_device **list;
+  ssize_t cnt = libusb_get_device_list(session->ctx, &list);
+
+  if (cnt < 0)
+  {
+    return NULL;
+  }
+
+  uint16_t searchProductID = (FLASH_ID_ANY != productID) ? productID : BOOTLOADER_PID;
+  uint16_t searchVendorID  = (FLASH_ID_ANY != vendorID)  ? vendorID  : BOOTLOADER_VID;
+
+  printf("Searching for Vendor ID:  %04x\n", searchProductID);
+  printf("Searching for Product ID: %04x\n", searchVendorID);
+  if (selector->path[0])
+    printf("Searching at port:        %s\n", selector->path);
+  if (selector->serial[0])
+    printf("Searching for serial:     %s\n", selector->serial);
+
+
+  libusb_device *device = NULL;
+  libusb_device *preferredDevice = NULL;
+  for (i = 0; i < cnt; i++)
+  {
+       device = list[i];
+
+      // printf("-> Found device %p\n", device);
+
+      // Skip devices on other ports without reading their descriptors
+      char path[DEVICE_LABEL_LEN];
+      device_path(device, path, sizeof(path));
+      if (selector->path[0] && 0 != strcmp(selector->path, path))
+        continue;
+
+      // Determine if device is interesting
+      //
+      struct libusb_device_descriptor desc;
+      int status = libusb_get_device_descriptor(device, &desc);
+      if (status < 0)
+      {
+        printf("---> Failed to get device descriptor\n");
+        continue;
+      }
+
+      if (verbose > 2)
+        printf("-> Checking %04x:%04x at %s: ", desc.idVendor, desc.idProduct, path);
+
+
+      // Is this a bootloader?
+      if (desc.idVendor == searchVendorID && desc.idProduct == searchProductID)
+      {
+        if (selector->serial[0] && !_device_hasSerial(device, &desc, selector->serial))
+          continue;
+
+        if (verbose > 2)
+          printf( CL_GREEN " <=\n" CL_RESET);
+
+        preferredDevice = device;
+        break; // Use first bootloader available
+      }
+
+      // Is this a resettable application?
+      if (FLASH_ID_ANY == vendorID && desc.idVendor == MY_VID &&               // Only search for MY_VID if vendor unset
+         (FLASH_ID_ANY == productID || desc.idProduct == searchProductID))     // Search for productID if given
+      {
+        if (selector->serial[0] && !_device_hasSerial(device, &desc, selector->serial))
+          continue;
+
+        printf(":");
+
+        if (verbose > 2)
+          printf(CL_RED " <=\n" CL_RESET);
+
+        preferredDevice = device; // Possibly use this application device, unless we find a bootloader
+      }
+
+      if (verbose > 2)
+        printf("\n");
+  }
+
+  if (NULL != preferredDevice)
+  {
+    libusb_ref_device(preferredDevice);
+  }
+
+  libusb_free_device_list(list, 1);
+  return preferredDevice;
+}
+
+
+// One scan for every bootloader and resettable application matching +selector+.
+// Returned devices are referenced.
+static void _flash_findDevices(flash_session_t *session, const device_selector_t *selector, int vendorID, int productID,
+                               libusb_device **bootloaders, int *bootloaderCount, libusb_device **apps, int *appCount)
+{
+  *bootloaderCount = 0;
+  *appCount = 0;
+
+  libusb_device **list;
+  ssize_t cnt = libusb_get_device_list(session->ctx, &list);
+  if (cnt < 0)
+    return;
+
+  uint16_t searchProductID = (FLASH_ID_ANY != productID) ? productID : BOOTLOADER_PID;
+  uint16_t searchVendorID  = (FLASH_ID_ANY != vendorID)  ? vendorID  : BOOTLOADER_VID;
+
+  ssize_t i;
+  for (i = 0; i < cnt; i++)
+  {
+    char path[DEVICE_LABEL_LEN];
+    device_path(list[i], path, sizeof(path));
+    if (selector->path[0] && 0 != strcmp(selector->path, path))
+      continue;
+
+    struct libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(list[i], &desc) < 0)
+      continue;
+
+    int isBootloader = (desc.idVendor == searchVendorID && desc.idProduct == searchProductID);
+    int isApp = !isBootloader && FLASH_ID_ANY == vendorID && desc.idVendor == MY_VID &&
+                (FLASH_ID_ANY == productID || desc.idProduct == searchProductID);
+
+    if (!isBootloader && !isApp)
+      continue;
+    if (selector->serial[0] && !_device_hasSerial(list[i], &desc, selector->serial))
+      continue;
+
+    if (isBootloader && *bootloaderCount < FLASH_MAX_DEVICES)
+      bootloaders[(*bootloaderCount)++] = libusb_ref_device(list[i]);
+    else if (isApp && *appCount < FLASH_MAX_DEVICES)
+      apps[(*appCount)++] = libusb_ref_device(list[i]);
+  }
+
+  libusb_free_device_list(list, 1);
+}
+
+void flash_findDevices(flash_session_t *session, const device_selector_t *selector,
+                       libusb_device **bootloaders, int *bootloaderCount, libusb_device **apps, int *appCount)
+{
+  pthread_mutex_lock(&session->reattachLock);
+  _flash_findDevices(session, selector, session->options.vendorID, session->options.productID,
+                     bootloaders, bootloaderCount, apps, appCount);
+  pthread_mutex_unlock(&session->reattachLock);
+}
+
+#pragma mark - Reattach
+
+#define REATTACH_TIMEOUT_MS 3000
+#define REATTACH_POLL_MS    20
+
+static int reattach_isExpected(flash_session_t *session, const char *path)
+{
+  int i;
+  for (i=0; i<session->reattachPathCount; i++)
+    if (0 == strcmp(session->reattachPaths[i], path))
+      return 1;
+  return 0;
+}
+
+#if HAVE_HOTPLUG
+static int LIBUSB_CALL _reattach_didArrive(libusb_context *context, libusb_device *device,
+                                           libusb_hotplug_event event, void *user_data)
+{
+  flash_session_t *session = user_data;
+  char path[DEVICE_LABEL_LEN];
+  device_path(device, path, sizeof(path));
+  if (reattach_isExpected(session, path))
+    session->reattachArrivals++;
+  return 0; // Stay registered
+}
+#endif
+
+// Start listening for bootloaders. Call with reattachLock held, before resetting
+// any application so an early arrival can't be missed.
+static void reattach_begin(flash_session_t *session)
+{
+  session->reattachArrivals = 0;
+  session->reattachPathCount = 0;
+
+#if HAVE_HOTPLUG
+  if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+  {
+    int s = libusb_hotplug_register_callback(session->ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+                                             BOOTLOADER_VID, BOOTLOADER_PID, LIBUSB_HOTPLUG_MATCH_ANY,
+                                             _reattach_didArrive, session, &session->reattachHandle);
+    session->reattachRegistered = (LIBUSB_SUCCESS == s);
+  }
+#endif
+}
+
+// Wait for a bootloader at +path+, where an application is about to be reset
+static void reattach_expect(flash_session_t *session, const char *path)
+{
+  if (session->reattachPathCount < FLASH_MAX_DEVICES)
+    snprintf(session->reattachPaths[session->reattachPathCount++], DEVICE_LABEL_LEN, "%s", path);
+}
+
+static void reattach_end(flash_session_t *session)
+{
+#if HAVE_HOTPLUG
+  if (session->reattachRegistered)
+    libusb_hotplug_deregister_callback(session->ctx, session->reattachHandle);
+  session->reattachRegistered = 0;
+#endif
+}
+
+// Bootloaders at the expected ports. Only their descriptors are read.
+static int _reattach_countArrived(flash_session_t *session)
+{
+  libusb_device **list;
+  ssize_t cnt = libusb_get_device_list(session->ctx, &list);
+  if (cnt < 0)
+    return 0;
+
+  int count = 0;
+  ssize_t i;
+  for (i = 0; i < cnt; i++)
+  {
+    char path[DEVICE_LABEL_LEN];
+    device_path(list[i], path, sizeof(path));
+    if (!reattach_isExpected(session, path))
+      continue;
+
+    struct libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(list[i], &desc) >= 0 &&
+        desc.idVendor == BOOTLOADER_VID && desc.idProduct == BOOTLOADER_PID)
+      count++;
+  }
+
+  libusb_free_device_list(list, 1);
+  return count;
+}
+
+// Wait until a bootloader has attached at every expected port, or REATTACH_TIMEOUT_MS
+// passes. Returns as soon as they're seen.
+static void reattach_wait(flash_session_t *session)
+{
+  uint64_t start = nowMicros();
+  uint64_t deadline = start + REATTACH_TIMEOUT_MS * 1000;
+
+#if HAVE_HOTPLUG
+  if (session->reattachRegistered)
+  {
+    while (session->reattachArrivals < session->reattachPathCount && nowMicros() < deadline)
+    {
+      struct timeval tv = { 0, REATTACH_POLL_MS * 1000 };
+      libusb_handle_events_timeout_completed(session->ctx, &tv, NULL);
+    }
+
+    reattach_end(session);
+
+    if (verbose > 0)
+      printf("%d of %d bootloaders arrived after %d ms\n", session->reattachArrivals, session->reattachPathCount,
+        (int)((nowMicros() - start) / 1000));
+    return;
+  }
+#endif
+
+  // No hotplug support; poll the device list until the same deadline
+  int count = 0;
+  while (nowMicros() < deadline)
+  {
+    count = _reattach_countArrived(session);
+    if (count >= session->reattachPathCount)
+      break;
+    usleep(REATTACH_POLL_MS * 1000);
+  }
+
+  if (verbose > 0)
+    printf("%d of %d bootloaders attached after %d ms\n", count, session->reattachPathCount,
+      (int)((nowMicros() - start) / 1000));
+}
+
+// A freshly attached device can refuse to open until udev has finished with it
+static int open_device(libusb_device *dev, libusb_device_handle **devHandle)
+{
+  uint64_t deadline = nowMicros() + REATTACH_TIMEOUT_MS * 1000;
+  int s;
+
+  trace_span_t span;
+  trace_begin(&span, "open");
+
+  for (;;)
+  {
+    s = libusb_open(dev, devHandle);
+    if (0 == s || nowMicros() >= deadline || 
+       (LIBUSB_ERROR_ACCESS != s && LIBUSB_ERROR_BUSY != s && LIBUSB_ERROR_NOT_FOUND != s))
+      break;
+
+    trace_retry("libusb_open");
+    usleep(REATTACH_POLL_MS * 1000);
+  }
+
+  trace_end(&span, s);
+  return s;
+}
+
+
+static void printdev(libusb_device *dev) 
+{
+  struct libusb_device_descriptor desc;
+  // int desc;
+  int r = libusb_get_device_descriptor(dev, &desc);
+  if (r < 0) {
+    printf("-> Failed to get device descriptor\n");
+    return;
+  }
+  printf("  Number of configurations: %d\n", desc.bNumConfigurations);
+  printf("  Device Class: %d\n", desc.bDeviceClass);
+  printf("  VendorID: 0x%02x\n", desc.idVendor);
+  printf("  ProductID: 0x%02x\n", desc.idProduct);
+}
+
+#pragma mark - Flashing
+
+const char * flash_resultStr(flash_result_t result)
+{
+  switch (result)
+  {
+    case flash_result_ok:           return "OK";
+    case flash_result_openFailed:   return "Could not open device";
+    case flash_result_initFailed:   return "Could not read bootloader info";
+    case flash_result_tooLarge:     return "Image exceeds device memory";
+    case flash_result_eraseFailed:  return "Erase failed";
+    case flash_result_writeFailed:  return "Write failed";
+    case flash_result_crcMismatch:  return "CRC Mismatch";
+    case flash_result_current:      return "Already current";
+    case flash_result_bootMismatch: return "Boot section CRC mismatch";
+    case flash_result_badInput:     return "Invalid input file";
+    case flash_result_notFound:     return "Could not locate device";
+    case flash_result_noReattach:   return "Bootloader did not attach after reset";
+    case flash_result_cancelled:    return "Cancelled";
+  }
+  return "Unknown";
+}
+
+int flash_isTransient(flash_result_t result, int status)
+{
+  // A board that has gone, or a write that can never fit, won't do better next time.
+  // Nor will one that doesn't answer an erase: that's a dead board, not a glitch.
+  if (LIBUSB_ERROR_NO_DEVICE == status || LIBUSB_ERROR_OVERFLOW == status)
+    return 0;
+  return flash_result_writeFailed == result || flash_result_crcMismatch == result;
+}
+
+// Ask an application device to jump to its bootloader. The handle stays open.
+static int reset_application(libusb_device_handle *devHandle)
+{
+  int s;
+
+  // Set Configuration
+  s = libusb_set_configuration(devHandle, 1);
+  if (s !=0) { printf( CL_RED "libusb_set_configuration error %d\n" CL_RESET, s); }
+
+  // Reset device into bootloader
+  uint64_t start = traceEnabled ? nowMicros() : 0;
+  s = libusb_control_transfer(devHandle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN, REQ_APP_RESET, 0, 0, NULL, 0, 1000);
+  if (traceEnabled)
+    trace_transfer(trace_kind_control, REQ_APP_RESET, 0, 0, MIN(s, 0), start, nowMicros());
+  if (s < 0) { printf( CL_RED "libusb_control_transfer error %d\n" CL_RESET, s); }
+
+  return s;
+}
+
+#pragma mark - Preparation
+
+static void flash_printStats(const ihex_stats_t *stats)
+{
+  if (verbose > 0)
+    printf("Input: %u bytes in %u records, 0x%x to 0x%x%s\n", stats->bytes, stats->spans,
+      stats->minAddr, stats->endAddr, stats->unordered ? ", out of order" : "");
+}
+
+static void * _flash_prepMain(void *context)
+{
+  flash_prep_t *prep = context;
+  ihex_t *hex = prep->hex;
+  trace_setThreadName("prepare");
+
+  trace_span_t span;
+  trace_begin(&span, "parse");
+  image_t *image = NULL;
+  if (prep->cacheDir)
+  {
+    prep->cache = cache_open(prep->cacheDir, hex);
+    image = cache_image(prep->cache);
+  }
+
+  // One parse builds the image and CRCs it
+  image_crcStream_t crcStream;
+  ihex_stats_t stats;
+  int crcDone = 0;
+  if (NULL == image)
+  {
+    ihex_consumer_t also[] = { image_crcConsumer(&crcStream), ihex_statsConsumer(&stats) };
+    image = image_fromHexWith(hex, also, 2);
+    if (hex->error)
+    {
+      image_free(image);
+      image = NULL;
+    }
+    else
+    {
+      cache_store(prep->cache, image);
+      crcDone = image_crcStreamFinish(&crcStream, &prep->crcPrefix);
+      flash_printStats(&stats);
+    }
+  }
+  trace_end(&span, image ? 0 : -1);
+
+  ihex_free(hex);
+  prep->hex = NULL;
+
+  if (image)
+  {
+    trace_begin(&span, "stage");
+    image_paginate(image, BOOTLOADER_DEFAULT_PAGESIZE);
+    if (!crcDone)
+      image_crcPrefix(image, &prep->crcPrefix);
+    trace_end(&span, 0);
+  }
+
+  pthread_mutex_lock(&prep->lock);
+  prep->image = image;
+  prep->ready = 1;
+  pthread_cond_broadcast(&prep->didFinish);
+  pthread_mutex_unlock(&prep->lock);
+  return NULL;
+}
+
+void flash_prepStart(flash_prep_t *prep, ihex_t *hex, const char *cacheDir)
+{
+  memset(prep, '\0', sizeof(*prep));
+  prep->hex = hex;
+  prep->cacheDir = cacheDir;
+  pthread_mutex_init(&prep->lock, NULL);
+  pthread_cond_init(&prep->didFinish, NULL);
+
+  if (0 != pthread_create(&prep->thread, NULL, _flash_prepMain, prep))
+    _flash_prepMain(prep);
+}
+
+int flash_prepReady(flash_prep_t *prep)
+{
+  pthread_mutex_lock(&prep->lock);
+  int ready = prep->ready;
+  pthread_mutex_unlock(&prep->lock);
+  return ready;
+}
+
+image_t * flash_prepWait(flash_prep_t *prep)
+{
+  pthread_mutex_lock(&prep->lock);
+  while (!prep->ready)
+    pthread_cond_wait(&prep->didFinish, &prep->lock);
+  pthread_mutex_unlock(&prep->lock);
+  return prep->image;
+}
+
+void flash_prepFree(flash_prep_t *prep)
+{
+  flash_prepWait(prep);
+  pthread_join(prep->thread, NULL);
+  if (prep->image)
+    image_free(prep->image);
+  cache_close(prep->cache);
+  pthread_mutex_destroy(&prep->lock);
+  pthread_cond_destroy(&prep->didFinish);
+}
+
+#pragma mark - Flashing Devices
+
+// A failed write ends the parse; nothing after it would be used
+static int _flash_streamBatch(ihex_t *hex, const ihex_batch_t *batch, void *context)
+{
+  int i, s = 0;
+  for (i=0; i<batch->count && s >= 0; i++)
+    s = bootloader_streamWrite(context, batch->spans[i].addr, batch->spans[i].data, batch->spans[i].len);
+  return MIN(s, 0);
+}
+
+// Parse +hex+ straight onto the device in one pass, computing the expected CRC as it goes
+static int flash_stream(bootloader_t *bootloader, ihex_t *hex, uint32_t *crc)
+{
+  bootloader_stream_t *stream;
+  int s = bootloader_streamBegin(bootloader, &stream);
+  if (s < 0)
+    return s;
+
+  ihex_stats_t stats;
+  ihex_consumer_t consumers[] = { { _flash_streamBatch, stream }, ihex_statsConsumer(&stats) };
+  ihex_dispatch(hex, consumers, 2);
+  s = bootloader_streamFinish(stream, crc);
+  if (!hex->error && !hex->stopped && verbose > 0)
+  {
+    printf("\n");   // After the progress line
+    flash_printStats(&stats);
+  }
+
+  // What was sent before a malformed record is on the device, but it isn't the image
+  if (s >= 0 && hex->error)
+    s = LIBUSB_ERROR_INVALID_PARAM;
+  return s;
+}
+
+void flash_phaseEnd(flash_job_t *job, trace_span_t *span, int status)
+{
+  trace_end(span, status);
+  if (job->phase)
+    job->phase(job, span->name, status, nowMicros() - span->start);
+}
+
+void flash_didProgress(bootloader_t *bootloader, uint32_t bytesWritten, uint32_t total, void *context)
+{
+  flash_job_t *job = context;
+  if (0 == total)
+    return;
+
+  int percent = (int)((uint64_t)bytesWritten * 10 / total) * 10;
+  if (percent != job->lastProgress)
+  {
+    job->lastProgress = percent;
+    job->progress(job, percent);
+  }
+}
+
+uint32_t flash_imageCRC(flash_job_t *job, image_t *image, cache_t *cache, uint32_t memsize)
+{
+  uint32_t crc;
+  if (!cache_crc(cache, memsize, &crc))
+  {
+    if (job->prep)
+      crc = image_crcFinish(image, &job->prep->crcPrefix, memsize, 0xff);
+    else
+      crc = image_crc(image, memsize, 0xff);
+    cache_storeCRC(cache, memsize, crc);
+  }
+  return crc;
+}
+
+// One erase, write and verify. *status is the libusb status behind a failure, for
+// flash_isTransient.
+static flash_result_t _flash_program(bootloader_t *bootloader, flash_job_t *job, image_t *image,
+                                     uint32_t *fileCRC, int erased, int *status)
+{
+  trace_span_t span;
+  int s;
+
+  // Erase device
+  if (!erased)
+  {
+    trace_begin(&span, "erase");
+    s = *status = bootloader_erase(bootloader);
+    flash_phaseEnd(job, &span, s);
+    if (s < 0)
+    {
+      printf(CL_RED "Erase failed: %d\n" CL_RESET, s);
+      return flash_result_eraseFailed;
+    }
+  }
+
+  // Write flash
+  trace_begin(&span, "write");
+  if (image)
+  {
+    printf(CL_GREEN "-> Writing %d bytes\n" CL_RESET, image->size);
+    s = bootloader_writeFlash(bootloader, image);
+  }
+  else
+  {
+    printf(CL_GREEN "-> Streaming\n" CL_RESET);
+    s = flash_stream(bootloader, job->hex, fileCRC);
+  }
+  *status = s;
+  flash_phaseEnd(job, &span, s);
+  if (s < 0)
+  {
+    printf(CL_RED "\nWrite failed: %d\n" CL_RESET, s);
+    if (NULL == image && job->hex->error)
+      return flash_result_badInput;
+    return (LIBUSB_ERROR_OVERFLOW == s) ? flash_result_tooLarge : flash_result_writeFailed;
+  }
+  printf(CL_GREEN "\nDone\n" CL_RESET);
+
+  // Check App CRC
+  uint32_t crc=0;
+  trace_begin(&span, "verify");
+  s = *status = bootloader_appCRC(bootloader, &crc);
+  flash_phaseEnd(job, &span, s);
+  if (s < 0)
+  {
+    printf(CL_RED "Could not read App CRC: %d\n" CL_RESET, s);
+    return flash_result_writeFailed;
+  }
+  printf("File CRC:0x%04x\n", *fileCRC);
+  printf("App CRC: 0x%04x\n", crc);
+
+  if (crc != *fileCRC)
+  {
+    printf(CL_RED "CRC Mismatch\n" CL_RESET);
+    return flash_result_crcMismatch;
+  }
+
+  printf(CL_GREEN "CRC Matches\n" CL_RESET);
+  return flash_result_ok;
+}
+
+flash_result_t flash_device(flash_session_t *session, transport_t *transport, flash_job_t *job)
+{
+  const flash_options_t *options = &session->options;
+  int s;
+  flash_result_t result = flash_result_ok;
+  trace_span_t span;
+  image_t *image = job->image;
+  cache_t *cache = job->cache;
+  int erased = 0;
+
+  // Create a bootloader object to manage the flash
+  bootloader_t bootloader;
+  transport_setPolicy(transport, flash_sessionPolicy(session));
+  trace_begin(&span, "init");
+  s = bootloader_init(&bootloader, transport);
+  flash_phaseEnd(job, &span, s);
+  if (0 != s)
+  {
+    bootloader_free(&bootloader);
+    return flash_result_initFailed;
+  }
+  transport_setPolicyKey(transport, bootloader.info.memsize);
+  bootloader.queueDepth = options->queueDepth;
+  bootloader.pagesPerTransfer = options->pagesPerTransfer;
+  bootloader.arena = job->arena;
+  bootloader.patches = job->patches;
+  bootloader.patchCount = job->patchCount;
+  if (job->progress)
+  {
+    job->lastProgress = -1;
+    bootloader.progress = flash_didProgress;
+    bootloader.progressContext = job;
+  }
+
+  if (job->arena && bootloader_arenaSize(&bootloader) > job->arena->size - job->arena->used)
+  {
+    printf(CL_RED "Arena has %zu bytes free; %d byte pages need %zu. Lower -q or -t.\n" CL_RESET,
+      job->arena->size - job->arena->used, bootloader.info.pagesize, bootloader_arenaSize(&bootloader));
+    bootloader_free(&bootloader);
+    return flash_result_initFailed;
+  }
+
+  if (job->patchCount && NULL == image && NULL == job->prep)
+  {
+    printf(CL_RED "Patches need an image; streamed input can't take them\n" CL_RESET);
+    bootloader_free(&bootloader);
+    return flash_result_badInput;
+  }
+
+  // Refuse boards whose bootloader isn't the expected one
+  if (options->checkBootCRC)
+  {
+    uint32_t bootCRC = 0;
+    s = bootloader_bootCRC(&bootloader, &bootCRC);
+    if (s < 0 || bootCRC != options->expectedBootCRC)
+    {
+      printf(CL_RED "Boot CRC: 0x%04x; expected 0x%04x\n" CL_RESET, bootCRC, options->expectedBootCRC);
+      bootloader_free(&bootloader);
+      return flash_result_bootMismatch;
+    }
+  }
+
+  if (job->prep)
+  {
+    // Still parsing: erase meanwhile rather than wait. Without -i the application
+    // is going either way, though an image that turns out too large or malformed
+    // now leaves the device in its bootloader.
+    if (!options->skipIfCurrent && !flash_prepReady(job->prep))
+    {
+      trace_begin(&span, "erase");
+      s = bootloader_erase(&bootloader);
+      flash_phaseEnd(job, &span, s);
+      if (s < 0)
+      {
+        printf(CL_RED "Erase failed: %d\n" CL_RESET, s);
+        bootloader_free(&bootloader);
+        return flash_result_eraseFailed;
+      }
+      erased = 1;
+    }
+
+    trace_begin(&span, "prepare wait");
+    image = flash_prepWait(job->prep);
+    cache = job->prep->cache;
+    flash_phaseEnd(job, &span, 0);
+
+    if (NULL == image)
+    {
+      printf(CL_RED "Input file is invalid; not writing%s\n" CL_RESET, erased ? " (already erased)" : "");
+      bootloader_free(&bootloader);
+      return flash_result_badInput;
+    }
+  }
+
+  // Check that the image will fit before touching the device
+  if (image && image_patchedEnd(image, job->patches, job->patchCount) > bootloader.info.memsize + 1)
+  {
+    printf(CL_RED "Input file size exceeds max device memory\n" CL_RESET);
+    bootloader_free(&bootloader);
+    return flash_result_tooLarge;
+  }
+
+  uint32_t fileCRC = 0;
+  if (image)
+  {
+    trace_begin(&span, "image crc");
+    fileCRC = flash_imageCRC(job, image, cache, bootloader.info.memsize);
+    fileCRC = image_patchCRC(image, job->patches, job->patchCount, fileCRC, bootloader.info.memsize, 0xff);
+    flash_phaseEnd(job, &span, 0);
+  }
+
+  // Nothing to do if the application is already this image
+  if (options->skipIfCurrent && image)
+  {
+    uint32_t crc = 0;
+    trace_begin(&span, "check");
+    s = bootloader_appCRC(&bootloader, &crc);
+    flash_phaseEnd(job, &span, s);
+
+    if (s >= 0 && crc == fileCRC)
+    {
+      printf(CL_GREEN "App CRC 0x%04x matches; already current\n" CL_RESET, crc);
+      s = bootloader_reset(&bootloader);
+      if (s != 0)
+        printf(CL_RED "Could not reset target: %d\n" CL_RESET, s);
+
+      bootloader_free(&bootloader);
+      return flash_result_current;
+    }
+  }
+  else if (options->skipIfCurrent && verbose > 0)
+  {
+    printf(CL_YELLOW "Streamed input has no CRC up front; flashing anyway\n" CL_RESET);
+  }
+
+  // Erase, write and verify, starting again from the erase when something fails on
+  // the way. Streamed input can't be rewound, so it gets one attempt.
+  int attempts = image ? MAX(options->writeAttempts, 1) : 1;
+  int attempt;
+  for (attempt = 1; ; attempt++)
+  {
+    result = _flash_program(&bootloader, job, image, &fileCRC, erased, &s);
+    if (flash_result_ok == result || attempt >= attempts || !flash_isTransient(result, s))
+      break;
+
+    int backoff = MIN(FLASH_RETRY_BACKOFF_MS << (attempt - 1), FLASH_RETRY_BACKOFF_MAX_MS);
+    printf(CL_YELLOW "Attempt %d of %d failed: %d; erasing again in %d ms\n" CL_RESET, attempt, attempts, s, backoff);
+    trace_retry("erase");
+    usleep(backoff * 1000);
+    erased = 0;
+  }
+
+  if (flash_result_ok == result)
+  {
+    trace_begin(&span, "reset");
+    s = bootloader_reset(&bootloader);
+    flash_phaseEnd(job, &span, s);
+    if (s != 0)
+    {
+      printf(CL_RED "Could not reset target: %d\n" CL_RESET, s);
+    }
+  }
+
+  bootloader_free(&bootloader);
+  return result;
+}
+
+#pragma mark - Claims
+
+static int _flash_labelIndex(char labels[][DEVICE_LABEL_LEN], int count, const char *label)
+{
+  int i;
+  for (i=0; i<count; i++)
+    if (0 == strcmp(labels[i], label))
+      return i;
+  return -1;
+}
+
+int flash_claim(flash_session_t *session, const char *label)
+{
+  pthread_mutex_lock(&session->busyLock);
+  int claimed = (-1 == _flash_labelIndex(session->busyLabels, session->busyCount, label) &&
+                 session->busyCount < FLASH_MAX_DEVICES);
+  if (claimed)
+    strcpy(session->busyLabels[session->busyCount++], label);
+  pthread_mutex_unlock(&session->busyLock);
+  return claimed;
+}
+
+void flash_release(flash_session_t *session, const char *label)
+{
+  pthread_mutex_lock(&session->busyLock);
+  int i = _flash_labelIndex(session->busyLabels, session->busyCount, label);
+  if (-1 != i)
+    memcpy(session->busyLabels[i], session->busyLabels[--session->busyCount], sizeof(session->busyLabels[i]));
+  pthread_mutex_unlock(&session->busyLock);
+}
+
+int flash_isBusy(flash_session_t *session, const char *label)
+{
+  pthread_mutex_lock(&session->busyLock);
+  int busy = (-1 != _flash_labelIndex(session->busyLabels, session->busyCount, label));
+  pthread_mutex_unlock(&session->busyLock);
+  return busy;
+}
+
+#pragma mark - One Device
+
+// Find and claim the device, reset it into its bootloader if need be, and open it
+static flash_result_t _flash_openOne(flash_session_t *session, const device_selector_t *match, flash_job_t *job,
+                                     libusb_device_handle **devHandle)
+{
+  const flash_options_t *options = &session->options;
+  trace_span_t span;
+  int s;
+
+  // Find an interesting device
+  //
+  trace_begin(&span, "enumerate");
+  libusb_device *dev = _flash_findDevice(session, match, options->vendorID, options->productID);
+  trace_end(&span, dev ? 1 : 0);
+
+  if (NULL == dev)
+  {
+    printf("Could not locate device\n");
+    return flash_result_notFound;
+  }
+
+  device_path(dev, job->label, sizeof(job->label));
+  if (!flash_claim(session, job->label))
+  {
+    printf(CL_RED "[%s] Already being flashed\n" CL_RESET, job->label);
+    job->label[0] = '\0';
+    libusb_unref_device(dev);
+    return flash_result_openFailed;
+  }
+  job->dev = dev;
+
+  // Open Device
+  //
+  s = libusb_open(dev, devHandle);
+  if (0 != s)
+  {
+    printf(CL_RED "Could not open device: error %d\n" CL_RESET, s);
+    libusb_unref_device(dev);
+    return flash_result_openFailed;
+  }
+
+  // Dump device info for debugging
+  //
+  if (verbose > 2)
+  {
+    printf("Using Device:\n");
+    printdev(dev);
+  }
+
+  // Determine what to do. If the device has a prototype vendor ID, 
+  // assume it should be reset to bootloader. Otherwise, flash.
+  //
+  struct libusb_device_descriptor desc;
+  s = libusb_get_device_descriptor(dev, &desc);
+
+  // Referenced device is returned from _flash_findDevice; open also adds a reference.
+  // Let libusb own the device now.
+  libusb_unref_device(dev);
+  job->dev = NULL;
+
+  if (s < 0)
+  {
+    printf("-> Failed to get device descriptor\n");
+    libusb_close(*devHandle);
+    *devHandle = NULL;
+    return flash_result_openFailed;
+  }
+
+  if (desc.idVendor != BOOTLOADER_VID && desc.idProduct != BOOTLOADER_PID)
+  {
+    printf(CL_YELLOW "Resetting application\n" CL_RESET);
+
+    // The bootloader comes back on the same port; look only there
+    reattach_begin(session);
+    reattach_expect(session, job->label);
+    trace_begin(&span, "app reset");
+    reset_application(*devHandle);
+    libusb_close(*devHandle);
+    *devHandle = NULL;
+    trace_end(&span, 0);
+
+    // Wait for the bootloader to show up, then open it
+    trace_begin(&span, "reattach");
+    reattach_wait(session);
+    trace_end(&span, 0);
+
+    // Now, find the device in bootloader, meaning we need to eschew the preferential
+    // treatment formerly given to the device/product IDs
+    device_selector_t port;
+    device_parseSelector(job->label, &port);
+    dev = _flash_findDevice(session, &port, BOOTLOADER_VID, BOOTLOADER_PID);
+
+    if (NULL == dev)
+    {
+      // We've waited REATTACH_TIMEOUT_MS for the device to reattach and came up empty-handed.
+      printf(CL_RED "Unable to locate device after reset\n" CL_RESET);
+      return flash_result_noReattach;
+    }
+
+    // Go ahead and open this device now.
+    s = open_device(dev, devHandle);
+    libusb_unref_device(dev);
+    if (0 != s)
+    {
+      printf(CL_RED "Could not open device: error %d\n" CL_RESET, s);
+      return flash_result_openFailed;
+    }
+  }
+
+  return flash_result_ok;
+}
+
+flash_result_t flash_one(flash_session_t *session, const device_selector_t *match, flash_job_t *job)
+{
+  libusb_device_handle *devHandle = NULL;
+  uint64_t start = nowMicros();
+
+  job->session = session;
+  job->label[0] = '\0';
+
+  pthread_mutex_lock(&session->reattachLock);
+  job->result = _flash_openOne(session, match, job, &devHandle);
+  pthread_mutex_unlock(&session->reattachLock);
+
+  if (flash_result_ok == job->result)
+    job->result = flash_device(session, transport_usbFromHandle(session->ctx, devHandle), job);
+
+  // No label if it wasn't found, or was busy
+  if (job->label[0])
+    flash_release(session, job->label);
+
+  job->elapsed = nowMicros() - start;
+  if (job->done)
+    job->done(job);
+  return job->result;
+}
+
+#pragma mark - Multiple Devices
+
+static void * _flash_jobMain(void *context)
+{
+  flash_job_t *job = context;
+  libusb_device_handle *devHandle = NULL;
+  trace_setThreadName(job->label);
+  uint64_t start = nowMicros();
+
+  int s = open_device(job->dev, &devHandle);
+  libusb_unref_device(job->dev);
+  job->dev = NULL;
+  if (0 != s)
+  {
+    printf(CL_RED "[%s] Could not open device: error %d\n" CL_RESET, job->label, s);
+    job->result = flash_result_openFailed;
+  }
+  else
+  {
+    job->result = flash_device(job->session, transport_usbFromHandle(job->session->ctx, devHandle), job);
+  }
+
+  job->elapsed = nowMicros() - start;
+  if (job->done)
+    job->done(job);
+  return NULL;
+}
+
+int flash_devices(flash_session_t *session, const device_selector_t *match,
+                  const flash_job_t *prototype, flash_job_t *jobs)
+{
+  libusb_device *bootloaders[FLASH_MAX_DEVICES], *apps[FLASH_MAX_DEVICES], *selected[FLASH_MAX_DEVICES];
+  int bootloaderCount, appCount, selectedCount = 0, i;
+  char label[DEVICE_LABEL_LEN];
+  trace_span_t span;
+
+  pthread_mutex_lock(&session->reattachLock);
+
+  trace_begin(&span, "enumerate");
+  _flash_findDevices(session, match, session->options.vendorID, session->options.productID,
+                     bootloaders, &bootloaderCount, apps, &appCount);
+  trace_end(&span, bootloaderCount + appCount);
+  printf("Found %d bootloaders and %d applications\n", bootloaderCount, appCount);
+
+  for (i=0; i<bootloaderCount; i++)
+  {
+    device_path(bootloaders[i], label, sizeof(label));
+    if (selectedCount < FLASH_MAX_DEVICES && flash_claim(session, label))
+      selected[selectedCount++] = bootloaders[i];
+    else
+      libusb_unref_device(bootloaders[i]);
+  }
+
+  // Send the applications to their bootloaders together so the reattach waits overlap
+  reattach_begin(session);
+
+  int resetCount = 0;
+  trace_begin(&span, "app reset");
+  for (i=0; i<appCount; i++)
+  {
+    device_path(apps[i], label, sizeof(label));
+    libusb_device_handle *devHandle = NULL;
+    if (0 == libusb_open(apps[i], &devHandle))
+    {
+      reattach_expect(session, label);
+      if (reset_application(devHandle) >= 0)
+        resetCount++;
+      libusb_close(devHandle);
+    }
+    libusb_unref_device(apps[i]);
+  }
+  trace_end(&span, resetCount);
+
+  if (resetCount > 0)
+  {
+    printf(CL_YELLOW "Reset %d applications\n" CL_RESET, resetCount);
+
+    trace_begin(&span, "reattach");
+    reattach_wait(session);
+    trace_end(&span, 0);
+
+    // The bootloaders that came back on those ports are ours
+    device_selector_t any;
+    device_parseSelector(NULL, &any);
+
+    int arrived = 0;
+    _flash_findDevices(session, &any, BOOTLOADER_VID, BOOTLOADER_PID, bootloaders, &bootloaderCount, apps, &appCount);
+    for (i=0; i<bootloaderCount; i++)
+    {
+      device_path(bootloaders[i], label, sizeof(label));
+      if (selectedCount < FLASH_MAX_DEVICES && reattach_isExpected(session, label) && flash_claim(session, label))
+      {
+        selected[selectedCount++] = bootloaders[i];
+        arrived++;
+      }
+      else
+        libusb_unref_device(bootloaders[i]);
+    }
+    for (i=0; i<appCount; i++)
+      libusb_unref_device(apps[i]);
+
+    if (arrived < resetCount)
+      printf(CL_RED "Only %d of %d bootloaders attached after reset\n" CL_RESET, arrived, resetCount);
+  }
+  else
+  {
+    reattach_end(session);
+  }
+
+  pthread_mutex_unlock(&session->reattachLock);
+
+  // Flash in parallel from the shared image. Index it now, while nothing else reads it;
+  // the jobs only read it from here on.
+  //
+  if (prototype->image && NULL == prototype->image->pageIndex)
+    image_paginate(prototype->image, BOOTLOADER_DEFAULT_PAGESIZE);
+
+  for (i=0; i<selectedCount; i++)
+  {
+    flash_job_t *job = &jobs[i];
+    *job = *prototype;
+    job->session = session;
+    job->dev = selected[i];
+    job->lastProgress = -1;
+    device_path(job->dev, job->label, sizeof(job->label));
+
+    job->started = (0 == pthread_create(&job->thread, NULL, _flash_jobMain, job));
+    if (!job->started)
+    {
+      printf(CL_RED "[%s] Could not start thread\n" CL_RESET, job->label);
+      job->result = flash_result_openFailed;
+      libusb_unref_device(job->dev);
+      job->dev = NULL;
+      if (job->done)
+        job->done(job);
+    }
+  }
+
+  for (i=0; i<selectedCount; i++)
+  {
+    if (jobs[i].started)
+      pthread_join(jobs[i].thread, NULL);
+    flash_release(session, jobs[i].label);
+  }
+
+  return selectedCount;
+}
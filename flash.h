@@ -0,0 +1,210 @@
+//
+//  flash
+//
+//  Everything between a parsed input and a flashed board, for the xflash front
+//  end and for processes that flash in-process. A session holds what used to be
+//  process-wide: the libusb context, the options, and the bookkeeping for
+//  devices being reset and flashed. Sessions are independent of each other, and
+//  one session may run several flashes from different threads.
+//
+//  Nothing here exits the process: results are flash_result_t, other statuses
+//  are libusb's. (Running out of memory, arena or heap, fails the write with
+//  LIBUSB_ERROR_NO_MEM; flash_device checks the write buffers fit an arena before
+//  taking them.) Messages
+//  still go to stdout, at the level set by +verbose+, which like tracing
+//  (trace.h) is shared by the whole process.
+//
+//  Ownership: a flash_prep_t takes the ihex_t it's given; a job borrows its
+//  image, cache and hex; flash_device takes the transport; devices returned by
+//  flash_findDevices are referenced for the caller to unref.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdint.h>
+#include <pthread.h>
+#include <libusb.h>
+#include "ihex.h"
+#include "image.h"
+#include "cache.h"
+#include "transport.h"
+#include "bootloader.h"
+#include "trace.h"
+#include "arena.h"
+#include "policy.h"
+
+#ifndef flash_h
+#define flash_h
+
+#define FLASH_MAX_DEVICES 32
+#define DEVICE_LABEL_LEN  32    // Room for a bus and a full port chain
+#define FLASH_ID_ANY      (-1)  // Vendor or product ID left to the defaults
+
+// A write that fails on the way is started again from the erase, after a backoff
+// doubling from FLASH_RETRY_BACKOFF_MS
+#define FLASH_WRITE_ATTEMPTS       3
+#define FLASH_RETRY_BACKOFF_MS     10
+#define FLASH_RETRY_BACKOFF_MAX_MS 100
+
+extern int verbose;
+
+typedef struct flash_session_s flash_session_t;
+
+typedef struct {
+  int vendorID;             // Of the device to look for, or FLASH_ID_ANY for a
+  int productID;            // bootloader or a resettable MY_VID application
+  int queueDepth;           // Bulk transfers in flight
+  int pagesPerTransfer;     // Or BOOTLOADER_PAGES_AUTO
+  int skipIfCurrent;        // Leave devices that already hold the image alone
+  int checkBootCRC;         // Refuse boards whose boot section CRC isn't...
+  uint32_t expectedBootCRC; // ...this
+  int writeAttempts;        // Erase, write and verify cycles before giving up
+  int learnTimeouts;        // Shorten timeouts to what devices have shown (policy.h)
+} flash_options_t;
+
+void flash_defaultOptions(flash_options_t * options);
+
+// +usb+ is used if given, and left for the caller to exit; otherwise the session
+// makes its own context. Returns 0 or a libusb status.
+int flash_sessionNew(flash_session_t ** session, const flash_options_t * options, libusb_context * usb);
+void flash_sessionFree(flash_session_t * session);
+libusb_context * flash_sessionContext(flash_session_t * session);
+const flash_options_t * flash_sessionOptions(flash_session_t * session);
+
+// What transports in the session learn their timeouts with; NULL when they don't
+policy_t * flash_sessionPolicy(flash_session_t * session);
+
+// Which devices to consider. Empty fields match anything.
+typedef struct {
+  char path[DEVICE_LABEL_LEN];   // Bus and port chain, as device_path prints it
+  char serial[64];               // iSerialNumber
+} device_selector_t;
+
+// Where +dev+ is plugged in, as in sysfs: "1-2.3" is port 3 of the hub on port 2
+// of bus 1. Unlike the address, this survives a reset into the bootloader.
+void device_path(libusb_device * dev, char * path, size_t len);
+
+// NULL or "all" matches anything; "serial=<s>" a serial number; anything else a path
+void device_parseSelector(const char * string, device_selector_t * selector);
+
+// Every bootloader and resettable application matching +selector+, at most
+// FLASH_MAX_DEVICES of each. Returned devices are referenced.
+void flash_findDevices(flash_session_t * session, const device_selector_t * selector,
+                       libusb_device ** bootloaders, int * bootloaderCount, libusb_device ** apps, int * appCount);
+
+// Whether a flash in this session is using the device at +label+
+int flash_isBusy(flash_session_t * session, const char * label);
+
+typedef enum {
+  flash_result_ok = 0,
+  flash_result_openFailed,
+  flash_result_initFailed,
+  flash_result_tooLarge,
+  flash_result_eraseFailed,
+  flash_result_writeFailed,
+  flash_result_crcMismatch,
+  flash_result_current,
+  flash_result_bootMismatch,
+  flash_result_badInput,
+  flash_result_notFound,
+  flash_result_noReattach,
+  flash_result_cancelled,   // A machine freed before it was done
+} flash_result_t;
+
+const char * flash_resultStr(flash_result_t result);
+
+// Whether another erase, write and verify might succeed where one failed with
+// +result+ and libusb +status+: a lost or corrupted transfer, not a board that's gone
+int flash_isTransient(flash_result_t result, int status);
+
+// Host-side work run on its own thread while devices reset and reattach: parse
+// the input (or map it from the cache), index its pages and CRC its contents.
+// Once a device's info is in, only the padding for its memory size is left to do.
+typedef struct {
+  ihex_t * hex;             // Consumed
+  const char * cacheDir;
+  image_t * image;          // NULL if the input was malformed
+  cache_t * cache;
+  crc_t crcPrefix;          // See image_crcPrefix
+  int ready;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t didFinish;
+} flash_prep_t;
+
+// Takes ownership of +hex+. +cacheDir+ may be NULL.
+void flash_prepStart(flash_prep_t * prep, ihex_t * hex, const char * cacheDir);
+int flash_prepReady(flash_prep_t * prep);
+
+// The prepared image, or NULL if the input was malformed. Any number of threads may wait.
+image_t * flash_prepWait(flash_prep_t * prep);
+
+// Wait for the worker and release what it made
+void flash_prepFree(flash_prep_t * prep);
+
+typedef struct flash_job_s flash_job_t;
+
+// Observers for a job, called on its flashing thread. +percent+ moves in steps of ten.
+typedef void flash_progressCallback(flash_job_t * job, int percent);
+typedef void flash_phaseCallback(flash_job_t * job, const char * phase, int status, uint64_t micros);
+typedef void flash_doneCallback(flash_job_t * job);
+
+struct flash_job_s {
+  image_t * image;          // NULL to stream +hex+ instead, unless +prep+ is set
+  flash_prep_t * prep;      // Still being readied; supplies the image and cache
+  ihex_t * hex;
+  cache_t * cache;          // Remembers the image CRC per memsize; may be NULL
+  arena_t * arena;          // Write buffers, instead of the heap
+  const image_patch_t * patches;  // Written over the image for this unit only; the
+  int patchCount;                 // image and its cached CRC are left alone
+
+  flash_progressCallback * progress;
+  flash_phaseCallback * phase;
+  flash_doneCallback * done;
+  void * context;
+
+  // Filled in as the job runs
+  flash_session_t * session;
+  libusb_device * dev;
+  char label[DEVICE_LABEL_LEN];
+  pthread_t thread;
+  int started;
+  flash_result_t result;
+  uint64_t elapsed;         // Microseconds from open to result
+  int lastProgress;
+};
+
+// Erase, write and verify a device that is running its bootloader, then start the
+// application. Writes +job->image+, or streams +job->hex+ when there is no image.
+// Takes ownership of +transport+. The image is only read, so jobs on other threads
+// may share it as long as nothing changes it meanwhile, image_paginate included:
+// index a shared image before the first of them starts.
+flash_result_t flash_device(flash_session_t * session, transport_t * transport, flash_job_t * job);
+
+// Find the first device matching +match+, resetting it into its bootloader if it's
+// running the application, and flash it
+flash_result_t flash_one(flash_session_t * session, const device_selector_t * match, flash_job_t * job);
+
+// Reset the applications matching +match+ into their bootloaders, then flash them
+// and the matching bootloaders at once, one thread each. Devices another call is
+// flashing are left alone. Each job starts as a copy of +prototype+, whose image is
+// indexed before the threads start; returns how many of +jobs+ (room for
+// FLASH_MAX_DEVICES) were run, after all finish.
+int flash_devices(flash_session_t * session, const device_selector_t * match,
+                  const flash_job_t * prototype, flash_job_t * jobs);
+
+// For other ways of running a job (machine.h). A claim marks the device at +label+
+// as being flashed; it fails if it already is, or there's no room to track it.
+int flash_claim(flash_session_t * session, const char * label);
+void flash_release(flash_session_t * session, const char * label);
+
+// Ends +span+ and reports it to the job's phase callback
+void flash_phaseEnd(flash_job_t * job, trace_span_t * span, int status);
+
+// A bootloader_progressCallback turning bytes into the job's deciles; context is the job
+void flash_didProgress(bootloader_t * bootloader, uint32_t bytesWritten, uint32_t total, void * context);
+
+// The CRC the device reports once +image+ is written to +memsize+ bytes of flash,
+// from the cache or the job's prepared prefix when they have it
+uint32_t flash_imageCRC(flash_job_t * job, image_t * image, cache_t * cache, uint32_t memsize);
+
+#endif
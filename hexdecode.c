@@ -0,0 +1,173 @@
+//
+//  hexdecode
+//
+//  Converts ASCII hex pairs to bytes. Uses SSE2/AVX2 where the build and CPU
+//  allow it, and a table-driven scalar path everywhere else (e.g. the MIPS target).
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <string.h>
+
+#include "hexdecode.h"
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+  #define HEXDECODE_SSE2 1
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__) && (__GNUC__ >= 5)
+  #include <immintrin.h>
+  #define HEXDECODE_AVX2 1
+#endif
+
+#pragma mark - Scalar
+
+// Entries are stored +0x10 so that the zero-initialised remainder of the table
+// marks invalid characters; _nibble() returns 0x00-0x0F for hex digits and 0xF0
+// for anything else.
+static const uint8_t nibbleTable[256] = {
+  ['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+  ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+  ['A'] = 0x1A, ['B'] = 0x1B, ['C'] = 0x1C, ['D'] = 0x1D, ['E'] = 0x1E, ['F'] = 0x1F,
+  ['a'] = 0x1A, ['b'] = 0x1B, ['c'] = 0x1C, ['d'] = 0x1D, ['e'] = 0x1E, ['f'] = 0x1F,
+};
+static inline uint8_t _nibble(unsigned char c)
+{
+  return nibbleTable[c] - 0x10;
+}
+
+static int _hex_decodeScalar(uint8_t * dst, const char * src, size_t n)
+{
+  uint8_t bad = 0;
+  size_t i;
+  for (i=0; i<n; i++)
+  {
+    uint8_t hi = _nibble(src[2*i]);
+    uint8_t lo = _nibble(src[2*i + 1]);
+    bad |= (hi | lo) & 0xF0;
+    dst[i] = (hi << 4) | (lo & 0x0F);
+  }
+
+  return bad ? -1 : 0;
+}
+
+#pragma mark - SSE2
+
+#if HEXDECODE_SSE2
+
+// Map 16 characters to nibbles; +valid+ gets 0xFF in each lane holding a hex digit
+static inline __m128i _nibbles128(__m128i c, __m128i * valid)
+{
+  __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), c));
+  __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                _mm_cmpgt_epi8(_mm_set1_epi8('f' + 1), lower));
+  *valid = _mm_or_si128(digit, alpha);
+
+  __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+  __m128i a = _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10));
+  return _mm_or_si128(_mm_and_si128(digit, d), _mm_andnot_si128(digit, a));
+}
+
+static int _hex_decodeSSE2(uint8_t * dst, const char * src, size_t n)
+{
+  // 16 characters -> 8 bytes per iteration
+  for (; n >= 8; n -= 8, src += 16, dst += 8)
+  {
+    __m128i valid;
+    __m128i nib = _nibbles128(_mm_loadu_si128((const __m128i *)src), &valid);
+    if (_mm_movemask_epi8(valid) != 0xFFFF)
+      return -1;
+
+    // Each 16-bit lane holds (hi, lo) in memory order: byte = hi << 4 | lo
+    __m128i hi = _mm_and_si128(_mm_slli_epi16(nib, 4), _mm_set1_epi16(0x00F0));
+    __m128i lo = _mm_srli_epi16(nib, 8);
+    __m128i bytes = _mm_packus_epi16(_mm_or_si128(hi, lo), _mm_setzero_si128());
+    _mm_storel_epi64((__m128i *)dst, bytes);
+  }
+
+  return _hex_decodeScalar(dst, src, n);
+}
+
+#endif
+
+#pragma mark - AVX2
+
+#if HEXDECODE_AVX2
+
+__attribute__((target("avx2")))
+static int _hex_decodeAVX2(uint8_t * dst, const char * src, size_t n)
+{
+  // 32 characters -> 16 bytes per iteration
+  for (; n >= 16; n -= 16, src += 32, dst += 16)
+  {
+    __m256i c = _mm256_loadu_si256((const __m256i *)src);
+    __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+    __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+    if ((uint32_t)_mm256_movemask_epi8(_mm256_or_si256(digit, alpha)) != 0xFFFFFFFF)
+      return -1;
+
+    __m256i nib = _mm256_blendv_epi8(_mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10)),
+                                     _mm256_sub_epi8(c, _mm256_set1_epi8('0')),
+                                     digit);
+
+    __m256i hi = _mm256_and_si256(_mm256_slli_epi16(nib, 4), _mm256_set1_epi16(0x00F0));
+    __m256i lo = _mm256_srli_epi16(nib, 8);
+    __m256i packed = _mm256_packus_epi16(_mm256_or_si256(hi, lo), _mm256_setzero_si256());
+
+    // packus works per 128-bit lane; gather the two 8-byte halves
+    packed = _mm256_permute4x64_epi64(packed, 0x08);
+    _mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(packed));
+  }
+
+#if HEXDECODE_SSE2
+  return _hex_decodeSSE2(dst, src, n);
+#else
+  return _hex_decodeScalar(dst, src, n);
+#endif
+}
+
+#endif
+
+#pragma mark - Dispatch
+
+typedef int hex_decodeFunc(uint8_t *, const char *, size_t);
+static hex_decodeFunc * decodeFunc = NULL;
+static const char * decodeName = NULL;
+
+// Chosen before main, so threads decoding at once never see it half set
+__attribute__((constructor))
+static void _hex_selectKernel(void)
+{
+#if HEXDECODE_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    decodeName = "avx2";
+    decodeFunc = _hex_decodeAVX2;
+    return;
+  }
+#endif
+
+#if HEXDECODE_SSE2
+  decodeName = "sse2";
+  decodeFunc = _hex_decodeSSE2;
+#else
+  decodeName = "scalar";
+  decodeFunc = _hex_decodeScalar;
+#endif
+}
+
+int hex_decode(uint8_t * dst, const char * src, size_t n)
+{
+  return decodeFunc(dst, src, n);
+}
+
+const char * hex_decodeKernel(void)
+{
+  return decodeName;
+}
@@ -0,0 +1,22 @@
+//
+//  hexdecode
+//
+//  Converts ASCII hex pairs to bytes. Uses SSE2/AVX2 where the build and CPU
+//  allow it, and a table-driven scalar path everywhere else (e.g. the MIPS target).
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef hexdecode_h
+#define hexdecode_h
+
+// Decode +n+ bytes from the 2*n characters at +src+. Upper and lower case are
+// accepted. Returns 0 on success or -1 if any character is not a hex digit.
+int hex_decode(uint8_t * dst, const char * src, size_t n);
+
+// Name of the kernel hex_decode dispatches to ("avx2", "sse2" or "scalar")
+const char * hex_decodeKernel(void);
+
+#endif
@@ -10,8 +10,12 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "ihex.h"
+#include "loader.h"
+#include "hexdecode.h"
 #include "util.h"
 #include "colors.h"
 
@@ -24,7 +28,11 @@ ihex_t * ihex_fromPath(const char * path)
   ihex_init(hex);
   
   // Load file
-  ihex_loadFile(hex, path);
+  if (!ihex_loadFile(hex, path))
+  {
+    ihex_free(hex);
+    return NULL;
+  }
   
   return hex;
 }
@@ -35,342 +43,411 @@ void ihex_init(ihex_t * ihex)
   ihex->fd = -1;
 }
 
-void ihex_free(ihex_t *ihex)
+static void _ihex_unmap(ihex_t * ihex)
+{
+  if (NULL != ihex->map)
+  {
+    munmap((void *)ihex->map, ihex->mapLen);
+    ihex->map = NULL;
+    ihex->mapLen = 0;
+  }
+}
+
+void ihex_close(ihex_t *ihex)
 {
+  _ihex_unmap(ihex);
+
+  decompress_close(ihex->decompress);
+  ihex->decompress = NULL;
+
+  free(ihex->bytes);
+  ihex->bytes = NULL;
+  ihex->bytesLen = 0;
+
   if (ihex->fd != -1)
   {
     close(ihex->fd);
     ihex->fd = -1;
   }
+}
 
+void ihex_free(ihex_t *ihex)
+{
+  ihex_close(ihex);
   free(ihex);
 }
 
+// read(), repeated on EAGAIN and EINTR
+static ssize_t _ihex_readRaw(int fd, void * buf, size_t len)
+{
+  for(;;)
+  {
+    ssize_t n = read(fd, buf, len);
+    if ((n < 0) && (errno == EAGAIN || errno == EINTR))
+    {
+      if (verbose > 1)
+        printf(CL_YELLOW "Repeating Read: %s\n" CL_RESET, strerror(errno));
+      continue;
+    }
+    return n;
+  }
+}
+
+// Look for a compression magic. A pipe can only be read once, so the bytes taken
+// from one are kept for the first read.
+static size_t _ihex_detectFormat(ihex_t * ihex)
+{
+  ssize_t len = pread(ihex->fd, ihex->head, sizeof(ihex->head), 0);
+  if (len < 0 && ESPIPE == errno)
+  {
+    len = 0;
+    while (len < (ssize_t)sizeof(ihex->head))
+    {
+      ssize_t n = _ihex_readRaw(ihex->fd, ihex->head + len, sizeof(ihex->head) - len);
+      if (n <= 0)
+        break;
+      len += n;
+    }
+    ihex->headLen = len;
+  }
+
+  ihex->format = decompress_detect(ihex->head, MAX(len, 0));
+  if (decompress_none != ihex->format)
+    printf("-> Input is %s compressed\n", decompress_formatName(ihex->format));
+
+  return MAX(len, 0);
+}
+
 
 int ihex_loadFile(ihex_t * ihex, const char * path)
 {
   printf("-> Loading %s\n", path);
 
-  if (ihex->fd != -1)
-  {
-    close(ihex->fd);
-    ihex->fd = -1;
-  }
+  ihex_close(ihex);
+  ihex->headLen = 0;
+  ihex->wasRead = 0;
   
-  ihex->fd = open(path, O_RDONLY);
+  ihex->fd = (0 == strcmp(path, "-")) ? dup(STDIN_FILENO) : open(path, O_RDONLY);
   if (-1 == ihex->fd)
   {
     perror("Could not open file");
-    exit(2);
+    return 0;
   }
+
+  size_t headLen = _ihex_detectFormat(ihex);
+
+  // The magic of compressed input is the compressor's; only the name is left to go on
+  ihex->loader = loader_detect(path, (decompress_none == ihex->format) ? ihex->head : NULL, headLen);
+  if (&loader_ihex != ihex->loader)
+    printf("-> Reading %s\n", ihex->loader->name);
   
   return 1;
 }
 
 #pragma mark - Reading
 
-static inline uint8_t charToNibble(unsigned char byte)
+const char * ihex_invalid(ihex_t * hex, const char * msg, long offset, int * done)
 {
-  uint8_t nibble;
-  if (byte >= '0' && byte <= '9')
-    nibble = byte - '0';
-  else
-  if (byte >= 'A' && byte <= 'F')
-    nibble = (byte - 'A') + 0xA;
-  else
-  if (byte >= 'A' && byte <= 'F')
-    nibble = (byte - 'A') + 0xA;
-  else  
-  {
-    printf(CL_RED "Warning: Unknown nibble %c (0x%02x)\n" CL_RESET, byte, byte);
-    return 0x00;
-  }
-    
-  return nibble;
+  printf(CL_RED "%s at offset %ld\n" CL_RESET, msg, offset);
+  hex->error = msg;
+  hex->errorOffset = offset;
+  *done = 1;
+  return NULL;
 }
 
+struct _ihex_recordContext {
+  ihex_readCallback * callback;
+  void * context;
+};
 
-void ihex_read(ihex_t * hex, ihex_readCallback callback, void *context)
+// An ihex_textDecoder for Intel HEX records; *done is set after the EOF record
+static const char * _ihex_decodeRecords(ihex_t * hex, const char * ptr, const char * end, long offset, 
+                                        int final, void * context, int * done)
 {
-  // Rewind the file
-  lseek(hex->fd, 0, SEEK_SET);
-  
-  // Read chunks of the file
-  int binCount=-1; // Number of bytes in the current binBuf
-  int recordLen=0; // Length of the current record to go into binBuf
-  
-  unsigned char lastA=0x1b;      // Used in case a is the last character of +buf+, meaning we haven't read b
-  char    * buf = malloc(MAX_LINE );
-  char    * charPtr;
-  uint8_t * binBuf = malloc(MAX_BIN_LINE);
+  struct _ihex_recordContext * c = context;
+  const char * start = ptr;
+  uint8_t bin[IHEX_MAX_RECORD];
 
-  int len;
-  for(;;)
+  while (ptr < end)
   {
-    memset(buf, '\0', MAX_LINE);
+    // Skip line endings and anything else between records
+    const char * sor = memchr(ptr, ':', end - ptr);
+    if (NULL == sor)
+      return end;
+    ptr = sor;
+
+    // The length byte says how many characters the rest of the record needs
+    if (end - ptr < 3)
+      break;
+    if (hex_decode(bin, ptr + 1, 1) < 0)
+      return ihex_invalid(hex, "Invalid record length", offset + (ptr - start), done);
 
-    // Wrap read to catch EAGAIN
-    for(;;)
-    {
-      len = read(hex->fd, buf, MAX_LINE);
-      if ((len < 0) && (errno == EAGAIN || errno == EINTR))
-      {
-        if (verbose > 1)
-          printf(CL_YELLOW "Repeating Read: %s\n" CL_RESET, strerror(errno));
-        continue;
-      }
+    int count = 4 /*Header*/ + bin[0] + 1 /*Checksum*/;
+    if (end - ptr < 1 + 2*count)
       break;
+
+    if (hex_decode(bin, ptr + 1, count) < 0)
+      return ihex_invalid(hex, "Invalid hex digit in record", offset + (ptr - start), done);
+
+    // The bytes of a record, checksum included, sum to zero
+    uint8_t sum = 0;
+    int i;
+    for (i=0; i<count; i++)
+      sum += bin[i];
+    if (0 != sum)
+      return ihex_invalid(hex, "Record checksum mismatch", offset + (ptr - start), done);
+
+    ihex_record_t record;
+    _ihex_createRecord(&record, bin, count);
+
+    if (0 == hex->wasRead)
+    {
+      if (record.addr > hex->maxAddr)
+        hex->maxAddr = record.addr;
+
+      // Update hex byte size
+      hex->size += record.len;
     }
-    
-    if (len == 0)
+
+    c->callback(hex, &record, c->context);
+    ptr += 1 + 2*count;
+
+    if (hex->stopped)
     {
-      // Finished reading
-      if (verbose > 2)
-        printf("Finalizing Read\n");
-      goto finalize_read;
+      *done = 1;
+      return NULL;
     }
 
-    if (len < 0)
+    if (ihex_recordtype_EOF == record.recordType)
     {
-      printf(CL_RED "Read Error %d: \n" CL_RESET, len);
-      perror(CL_RED "Could not read" CL_RESET);
-      goto finalize_read;
+      *done = 1;
+      return ptr;
     }
+  }
+
+  if (final && ptr < end)
+    return ihex_invalid(hex, "Truncated record", offset + (ptr - start), done);
+
+  return ptr;
+}
+
+// Map a regular file so it can be decoded in place
+static int _ihex_map(ihex_t * hex)
+{
+  if (NULL != hex->map)
+    return 1;
+
+  struct stat st;
+  if (fstat(hex->fd, &st) != 0 || !S_ISREG(st.st_mode) || 0 == st.st_size)
+    return 0;
+
+  void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, hex->fd, 0);
+  if (MAP_FAILED == map)
+    return 0;
+
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  hex->map = map;
+  hex->mapLen = st.st_size;
+  return 1;
+}
 
+const char * ihex_contents(ihex_t * hex, size_t * len)
+{
+  if (!_ihex_map(hex))
+    return NULL;
+
+  *len = hex->mapLen;
+  return hex->map;
+}
+
+// The next block of text: what detection took from a pipe, then the file itself,
+// decoded when it's compressed
+static ssize_t _ihex_readBlock(ihex_t * hex, char * buf, size_t len)
+{
+  if (NULL != hex->decompress)
+    return decompress_read(hex->decompress, buf, len);
+
+  if (hex->headLen > 0)
+  {
+    size_t n = hex->headLen;
+    memcpy(buf, hex->head, n);
+    hex->headLen = 0;
+    return n;
+  }
+
+  return _ihex_readRaw(hex->fd, buf, len);
+}
+
+void ihex_readText(ihex_t * hex, ihex_textDecoder * decode, void * context)
+{
+  int done = 0;
+  hex->error = NULL;
+  hex->stopped = 0;
+
+  if (decompress_none == hex->format && _ihex_map(hex))
+  {
     if (verbose > 2)
-      printf("Read %d bytes; Current Bin count: %d\n", len, binCount);
-
-    charPtr = buf;
-    
-    // printHexStr((uint8_t*)buf, MAX_LINE);
-    
-      
-    // Scan through the current characters, then call the callback when 
-    // an entire line is parsed
-    //
-    
-    
-    // Convert char bytes into actual bytes and place them in the binBuf
-    //
-    int eor_found = 0;
-    uint8_t byte;
-    #define breakIfLen() if (charPtr>=charPtrEnd) break
-    // #define breakIfEnd(_b_) if () { printf("(EOR)\n"); eor_found = 1; break;}
-    #define breakUnlessValid(_b_) \
-      if (!((_b_ >= '0' && _b_<='9') || (_b_ >= 'A' && _b_ <= 'F'))) \
-        { printf(" Invalid byte at (buf %d/%d) (rec %d/%d): 0x%x (%c)\n", \
-          i, len, \
-          binCount, (4 /*Header*/ + recordLen + 1 /*Checksum*/), \
-          _b_, _b_); \
-        exit(3); }
-        
-    char *charPtrEnd = charPtr + len;
-    for(; charPtr < charPtrEnd;)
+      printf("Decoding %zu mapped bytes (%s)\n", hex->mapLen, hex_decodeKernel());
+
+    decode(hex, hex->map, hex->map + hex->mapLen, 0, 1, context, &done);
+    hex->wasRead = 1;
+    return;
+  }
+
+  // Not mappable (e.g. a pipe) or compressed; read large blocks, carrying a 
+  // partial record at the end of each block over to the next.
+  //
+  // Rewind for a second read. Pipes can only be read once.
+  if (hex->wasRead && lseek(hex->fd, 0, SEEK_SET) < 0)
+  {
+    perror(CL_RED "Could not rewind input" CL_RESET);
+    hex->error = "Rewind failed";
+    hex->errorOffset = 0;
+    return;
+  }
+
+  // A fresh decoder for each pass, starting with any bytes detection took
+  if (decompress_none != hex->format)
+  {
+    decompress_close(hex->decompress);
+    hex->decompress = decompress_open(hex->format, hex->fd, hex->head, hex->headLen);
+    hex->headLen = 0;
+    if (NULL == hex->decompress)
     {
-      for(;;)
-      {
-        breakIfLen();
-        if (binCount >= (4 /*Header*/ + recordLen  + 1/*+ 1 Checksum*/)) 
-        {
-          if (verbose > 2)
-            printf("-> Finished %d/%d bytes in record\n", 
-              binCount, (4 /*Header*/ + recordLen  + 1 /*Checksum*/));
-          
-          // Eat bytes until start of record
-          // while (charPtr < charPtrEnd && *charPtr != ':')
-          // {
-          //   printf("(EOR) Skipping 0x%02x\n", *charPtr);
-          //   charPtr++;
-          // }
-          
-          eor_found = 1;
-          break;
-        }
-
-        
-        // Expect start code as the start of each record
-        // 
-        if (-1 == binCount)
-        {
-          if (verbose > 1)
-            printf("\n");
-
-          // Eat bytes until start of record
-          while (charPtr < charPtrEnd && *charPtr != ':')
-          {
-           // printf("(SOR) Skipping 0x%02x\n", *charPtr);
-           charPtr++;
-          }          
-          
-          // If we stopped looking for SOF because charPtr is at end, break.
-          if (charPtr >= charPtrEnd)
-            break;
-          
-          if (*charPtr != ':') 
-          {
-            printf(CL_RED "Invalid Start of Frame Character\n" CL_RESET);
-            exit(3);
-          }
-          
-          // printf("SOR '%c'  ", *charPtr);
-          
-          charPtr++;
-          binCount++;
-        }
-        
-        if (charPtr >= charPtrEnd)
-        {
-          if (verbose > 3)
-            printf(CL_YELLOW "Buffer empty after SOF\n" CL_RESET);
-
-          break;
-        }
-        
-        
-        // Read two chars (one byte)
-        unsigned char a, b='0';
-
-        if (lastA != 0x1b)
-        { 
-          if (verbose > 3)
-            printf(CL_YELLOW "Resuming with nibble a=0x%02x\n" CL_RESET, lastA);
-          
-          a = lastA;
-          lastA = 0x1b;
-        }
-        else
-        {
-          a = *charPtr++;
-        }
-        
-        if (charPtr >= charPtrEnd)
-        {
-          // We have to read more characters before continuing
-          if (verbose > 3)
-            printf(CL_YELLOW "Caching nibble a (0x%02x) for buffer refresh\n" CL_RESET, a);
-          lastA = a;
-          break;
-        }
-
-        b = *charPtr++;
-
-        
-        // Convert char nibbles into a byte
-        byte = charToNibble(a) << 4;
-        byte |= charToNibble(b);
-
-        // Track record Length if appropriate
-        if (0 == binCount)
-        {
-          recordLen = byte;
-          // printf("Got Record Length %d\n", recordLen);
-        }
-
-        // Copy into binBuf
-        binBuf[binCount++] = byte;
-        
-        // Loop and check record length
-      }
-    
-      if (eor_found)
-      {
-        // BinBuf Complete
-        // Create Record
-        //
-        ihex_record_t record;
-        _ihex_createRecord(&record, binBuf, binCount);
-        
-        if (0 == hex->wasRead)
-        {
-          if (record.addr > hex->maxAddr)
-            hex->maxAddr = record.addr;
-          
-          // Update hex byte size
-          hex->size += record.len;
-        }
-        
-        // Call callback
-        // 
-        callback(hex, &record, context);
-
-        // Check for EOF
-        if (ihex_recordtype_EOF == record.recordType)
-          break;
-      
-        // Reset
-        eor_found = 0;
-        memset(binBuf, '\0', sizeof(*binBuf));
-        binCount = -1;
-        recordLen = 0;
-        continue;
-      } // End of record
-
-      if (verbose > 0) printf("\n");
+      hex->error = "Unsupported compression";
+      hex->errorOffset = 0;
+      return;
+    }
+  }
+
+  size_t mark = arena_mark(hex->arena);
+  char * buf = arena_malloc(hex->arena, IHEX_BLOCK_SIZE + IHEX_MAX_LINE);
+  if (NULL == buf)
+  {
+    hex->error = "Out of memory";
+    hex->errorOffset = 0;
+    return;
+  }
+  size_t pending = 0;
+  long offset = 0;
+
+  while (!done)
+  {
+    ssize_t len = _ihex_readBlock(hex, buf + pending, IHEX_BLOCK_SIZE);
+    if (len < 0)
+    {
+      // The decoder has already said why
+      if (NULL == hex->decompress)
+        perror(CL_RED "Could not read" CL_RESET);
+      hex->error = hex->decompress ? "Decompression failed" : "Read failed";
+      hex->errorOffset = offset + pending;
       break;
-    } // End of char buffer
-  } // End of file
+    }
 
-finalize_read:
+    if (verbose > 2)
+      printf("Read %zd bytes; %zu pending\n", len, pending);
+
+    const char * end  = buf + pending + len;
+    const char * next = decode(hex, buf, end, offset, 0 == len, context, &done);
+    if (NULL == next)
+      break;
 
-  if (verbose > 2)
-    printf("Freeing buf: %p ; binBuf: %p;\n", buf, binBuf);
+    offset += next - buf;
+    pending = end - next;
+    memmove(buf, next, pending);
+
+    if (0 == len)
+      break;
+  }
 
-  free(buf);
-  free(binBuf);
+  arena_free(hex->arena, buf);
+  arena_release(hex->arena, mark);
   
   hex->wasRead = 1;
 }
 
-static inline uint16_t _readUInt16(uint8_t* ptr)
+void ihex_read(ihex_t * hex, ihex_readCallback callback, void *context)
 {
-  uint16_t i=0;
-  i |= *ptr++ << 8; 
-  i |= *ptr++;
-  
-  return i;
+  struct _ihex_recordContext c = { callback, context };
+  ihex_readText(hex, _ihex_decodeRecords, &c);
 }
 
-void _ihex_createRecord(ihex_record_t * record, uint8_t * buf, int len)
+const uint8_t * ihex_bytes(ihex_t * hex, size_t * len)
 {
-  if (len < 4) { printf("Bad record\n"); return; }
-  
-  uint8_t * ptr = buf;
-  record->len  = *ptr++;
-  record->addr = _readUInt16(ptr); ptr+= 2;
-  record->recordType = *ptr++;
-  record->data = ptr;
-  record->checksum = buf[len-1];
-    
-  // Check record checksum here
-}
+  hex->error = NULL;
+  if (decompress_none == hex->format && _ihex_map(hex))
+  {
+    *len = hex->mapLen;
+    return (const uint8_t *)hex->map;
+  }
 
+  if (NULL != hex->bytes || hex->wasRead)
+  {
+    *len = hex->bytesLen;
+    if (NULL == hex->bytes)
+      hex->error = "Input can only be read once";
+    return hex->bytes;
+  }
 
-#pragma mark - CRC Calculation
+  // A pipe or compressed input, read whole. A heap-free build has no room for that.
+  if (NULL != hex->arena)
+  {
+    printf(CL_RED "This input must be an uncompressed regular file in this build\n" CL_RESET);
+    hex->error = "Input not mappable";
+    return NULL;
+  }
 
-struct crc_context {
-  int count; // Number of bytes processed so far
-  int ha;
-  int hb; 
-  int crc;
-};
+  if (decompress_none != hex->format)
+  {
+    hex->decompress = decompress_open(hex->format, hex->fd, hex->head, hex->headLen);
+    hex->headLen = 0;
+    if (NULL == hex->decompress)
+    {
+      hex->error = "Unsupported compression";
+      return NULL;
+    }
+  }
 
-#define CRC32_POLY 0x0080001BL
+  size_t capacity = IHEX_BLOCK_SIZE, used = 0;
+  uint8_t * bytes = malloc(capacity);
+  for (;;)
+  {
+    if (used == capacity)
+      bytes = realloc(bytes, capacity *= 2);
 
-static void _ihexCRC_updateContext(struct crc_context *c, uint16_t d)
-{
-  c->ha = c->crc << 1;
-  c->ha &= 0x00FFfffe;
-  c->hb = c->crc & (1 << 23);
-  if (c->hb > 0)
-    c->hb = 0x00FFffff;
-  
-  c->crc = (c->ha ^ d) ^ (c->hb & CRC32_POLY);
-  c->crc &= 0x00ffFFFF;
-  c->count++;
+    ssize_t n = _ihex_readBlock(hex, (char *)bytes + used, capacity - used);
+    if (n < 0)
+    {
+      if (NULL == hex->decompress)
+        perror(CL_RED "Could not read" CL_RESET);
+      hex->error = hex->decompress ? "Decompression failed" : "Read failed";
+      hex->errorOffset = used;
+      free(bytes);
+      hex->wasRead = 1;
+      return NULL;
+    }
+    if (0 == n)
+      break;
+    used += n;
+  }
+
+  hex->bytes = bytes;
+  hex->bytesLen = used;
+  hex->wasRead = 1;
+  *len = used;
+  return bytes;
 }
 
-static void ihex_didReadCRC(ihex_t * hex, ihex_record_t* rec, struct crc_context *c)
+struct _ihex_dataContext {
+  ihex_dataCallback * callback;
+  void * context;
+  uint32_t base;     // Set by extended segment/linear address records
+};
+
+static void _ihex_didReadRecord(ihex_t * hex, ihex_record_t * rec, void * context)
 {
+  struct _ihex_dataContext * c = context;
+
   // Dump
   //
   if (verbose > 1)
@@ -380,43 +457,158 @@ static void ihex_didReadCRC(ihex_t * hex, ihex_record_t* rec, struct crc_context
     printf("\e[;33m % 4d     \e[m", rec->len);
 
     printHexStr(rec->data, rec->len);
-    
+
     printf("\e[;33m%02x\e[m", rec->checksum);
     printf("\n");
   }
-  
-  if (ihex_recordtype_EOF == rec->recordType)
+
+  switch (rec->recordType)
   {
-    return;
+    case ihex_recordtype_data:
+      c->callback(hex, c->base + rec->addr, rec->data, rec->len, c->context);
+      break;
+
+    case ihex_recordtype_ext_seg:
+      if (rec->len >= 2)
+        c->base = ((rec->data[0] << 8) | rec->data[1]) << 4;
+      break;
+
+    case ihex_recordtype_ext_lin:
+      if (rec->len >= 2)
+        c->base = (uint32_t)((rec->data[0] << 8) | rec->data[1]) << 16;
+      break;
+
+    default:
+      break;
   }
-  
-  // Calculate CRC
-  //
-  uint8_t * ptr = rec->data;
-  uint8_t * dataEnd = ptr + rec->len;
-  
-  while (ptr < dataEnd)
+}
+
+static void _ihex_readData(ihex_t * hex, ihex_dataCallback callback, void * context)
+{
+  struct _ihex_dataContext c = { callback, context, 0 };
+  ihex_read(hex, _ihex_didReadRecord, &c);
+}
+
+const loader_t loader_ihex = {
+  .name     = "ihex",
+  .readData = _ihex_readData,
+};
+
+void ihex_readData(ihex_t * hex, ihex_dataCallback callback, void * context)
+{
+  const loader_t * loader = hex->loader ? hex->loader : &loader_ihex;
+  loader->readData(hex, callback, context);
+}
+
+#pragma mark - Dispatch
+
+struct _ihex_batcher {
+  const ihex_consumer_t * consumers;
+  int count;
+  ihex_batch_t batch;
+  uint8_t storage[IHEX_BATCH_BYTES];
+};
+
+static void _ihex_flushBatch(ihex_t * hex, struct _ihex_batcher * b)
+{
+  int i;
+  for (i=0; i<b->count && b->batch.count > 0 && !hex->stopped; i++)
   {
-    uint16_t d;
-    d  = *ptr++; 
-    d |= (ptr >= dataEnd ? 0xff : *ptr) << 8; ptr++; // Ensure ptr increments so the loop will terminate
+    int status = b->consumers[i].batch(hex, &b->batch, b->consumers[i].context);
+    if (status < 0)
+      hex->stopped = status;
+  }
 
-    _ihexCRC_updateContext(c, d);
+  b->batch.count = 0;
+  b->batch.bytes = 0;
+}
+
+static void _ihex_batchData(ihex_t * hex, uint32_t addr, const uint8_t * data, int len, void * context)
+{
+  struct _ihex_batcher * b = context;
+  ihex_batch_t * batch = &b->batch;
+
+  if (batch->count == IHEX_BATCH_SPANS || (len <= IHEX_MAX_RECORD && batch->bytes + len > IHEX_BATCH_BYTES))
+    _ihex_flushBatch(hex, b);
+
+  ihex_span_t * span = &batch->spans[batch->count++];
+  span->addr = addr;
+  span->len  = len;
+
+  // A record's data is gone once the decoder moves on; larger spans come from
+  // the input itself and go out on their own
+  if (len <= IHEX_MAX_RECORD)
+  {
+    memcpy(b->storage + batch->bytes, data, len);
+    span->data = b->storage + batch->bytes;
+    batch->bytes += len;
+  }
+  else
+  {
+    span->data = data;
+    _ihex_flushBatch(hex, b);
   }
 }
 
-void ihex_crc(ihex_t * ihex, int maxAddr, uint8_t pad)
+void ihex_dispatch(ihex_t * hex, const ihex_consumer_t * consumers, int count)
 {
-  struct crc_context context;
-  memset(&context, '\0', sizeof(context));
-  
-  // Process all bytes in the file
-  ihex_read(ihex, (ihex_readCallback*)ihex_didReadCRC, &context);
+  struct _ihex_batcher b;
+  b.consumers = consumers;
+  b.count = count;
+  b.batch.count = 0;
+  b.batch.bytes = 0;
+
+  hex->stopped = 0;
+  ihex_readData(hex, _ihex_batchData, &b);
+  _ihex_flushBatch(hex, &b);
+}
+
+static int _ihex_statsBatch(ihex_t * hex, const ihex_batch_t * batch, void * context)
+{
+  ihex_stats_t * stats = context;
+
+  int i;
+  for (i=0; i<batch->count; i++)
+  {
+    const ihex_span_t * span = &batch->spans[i];
+    if (0 == stats->spans)
+      stats->minAddr = span->addr;
+    else if (span->addr < stats->endAddr)
+      stats->unordered = 1;
+
+    stats->spans++;
+    stats->bytes += span->len;
+    stats->minAddr = MIN(stats->minAddr, span->addr);
+    stats->endAddr = MAX(stats->endAddr, span->addr + span->len);
+  }
+
+  return 0;
+}
+
+ihex_consumer_t ihex_statsConsumer(ihex_stats_t * stats)
+{
+  memset(stats, '\0', sizeof(*stats));
+  ihex_consumer_t consumer = { _ihex_statsBatch, stats };
+  return consumer;
+}
+
+static inline uint16_t _readUInt16(uint8_t* ptr)
+{
+  uint16_t i=0;
+  i |= *ptr++ << 8; 
+  i |= *ptr++;
   
-  // Pad to memory length
-  while(context.count <= maxAddr/2)
-    _ihexCRC_updateContext(&context, (pad | pad << 8));
+  return i;
+}
+
+void _ihex_createRecord(ihex_record_t * record, uint8_t * buf, int len)
+{
+  if (len < 4) { printf("Bad record\n"); return; }
   
-  // Save CRC
-  ihex->crc = context.crc;
+  uint8_t * ptr = buf;
+  record->len  = *ptr++;
+  record->addr = _readUInt16(ptr); ptr+= 2;
+  record->recordType = *ptr++;
+  record->data = ptr;
+  record->checksum = buf[len-1];
 }
@@ -5,19 +5,42 @@
 //  Copyright (c) 2013 Design Elements. All rights reserved.
 //
 #include <stdint.h>
+#include <stddef.h>
+#include "arena.h"
+#include "decompress.h"
 
 #ifndef ihex_h
 #define ihex_h
 
-#define MAX_LINE 128
-#define MAX_BIN_LINE (MAX_LINE/2)
+#define IHEX_BLOCK_SIZE (64*1024)               // read() size when the file can't be mapped
+#define IHEX_MAX_RECORD (4 + 255 + 1)           // Header, data, checksum
+#define IHEX_MAX_LINE   (1 + 2*IHEX_MAX_RECORD) // Start code and hex pairs
 
 typedef struct {
 	signed char wasRead:1;
   int fd;
+  const char * map;   // Mapped file contents, when the file is mappable
+  size_t mapLen;
   int maxAddr;
 	int size;
-  uint32_t crc;
+
+  // Set when decoding stops at a malformed record
+  const char * error;
+  long errorOffset;
+
+  int stopped;        // Status from the consumer that ended ihex_dispatch early
+
+  arena_t * arena;    // Read buffer for unmappable input comes from here when set
+
+  // Compressed input is decoded as it's read, never mapped
+  decompress_format_t format;
+  decompress_t * decompress;
+  uint8_t head[DECOMPRESS_MAGIC_LEN];   // Taken from a pipe to detect the format
+  size_t headLen;                       // and not yet read back
+
+  const struct loader_s * loader;       // The file format; NULL for Intel HEX
+  uint8_t * bytes;                      // See ihex_bytes
+  size_t bytesLen;
 } ihex_t;
 
 typedef enum {
@@ -40,17 +63,84 @@ typedef struct {
 
 typedef void ihex_readCallback(ihex_t *, ihex_record_t*, void *);
 
+// A +path+ of "-" reads standard input. Returns NULL if the file can't be opened.
+// The format (see loader.h) is chosen by content, or by name for raw binary.
 ihex_t * ihex_fromPath(const char * path);
 void ihex_init(ihex_t * ihex);
 void ihex_free(ihex_t * ihex);
+
+// Release the file of an ihex_t the caller owns, e.g. one on the stack
+void ihex_close(ihex_t * ihex);
 int ihex_loadFile(ihex_t * ihex, const char * path);
 
 // Reading hex
 void _ihex_createRecord(ihex_record_t * record, uint8_t * buf, int len);
 void ihex_read(ihex_t * hex, ihex_readCallback callback, void * context);
 
-// Atmel CRC
-void ihex_crc(ihex_t * ihex, int maxAddr, uint8_t pad);
+// The whole file, mapped. NULL when the input can't be mapped (e.g. a pipe).
+// Compressed input is returned as it is on disk.
+const char * ihex_contents(ihex_t * hex, size_t * len);
+
+// Data at absolute addresses, whatever the format: for Intel HEX, data records with
+// extended segment/linear addressing applied
+typedef void ihex_dataCallback(ihex_t *, uint32_t addr, const uint8_t * data, int len, void *);
+void ihex_readData(ihex_t * hex, ihex_dataCallback callback, void * context);
+
+// Batched dispatch: data is gathered into batches of spans and each batch is handed
+// to every consumer in turn, so one parse feeds the image, the device, the CRC and
+// so on. Spans are in file order; short ones (records) are copied into the batch,
+// longer ones (binary formats) point at the input and are valid for the call.
+#define IHEX_BATCH_SPANS  64
+#define IHEX_BATCH_BYTES  4096
+
+typedef struct {
+  uint32_t addr;
+  uint32_t len;
+  const uint8_t * data;
+} ihex_span_t;
+
+typedef struct {
+  int count;
+  uint32_t bytes;
+  ihex_span_t spans[IHEX_BATCH_SPANS];
+} ihex_batch_t;
+
+// Returns 0 to go on, or a negative status to stop reading the input (hex->stopped)
+typedef int ihex_batchCallback(ihex_t *, const ihex_batch_t *, void *);
+
+typedef struct {
+  ihex_batchCallback * batch;
+  void * context;
+} ihex_consumer_t;
+
+void ihex_dispatch(ihex_t * hex, const ihex_consumer_t * consumers, int count);
+
+// A consumer that summarizes what it's given
+typedef struct {
+  uint32_t spans;
+  uint32_t bytes;
+  uint32_t minAddr;
+  uint32_t endAddr;     // One past the highest byte
+  int unordered;        // Some span started below data already seen
+} ihex_stats_t;
+
+ihex_consumer_t ihex_statsConsumer(ihex_stats_t * stats);
+
+// For loaders of text formats: every block of the input is passed to a decoder,
+// which decodes the complete records in [ptr, end) and returns the first byte it
+// didn't consume, the start of a record continuing past +end+ unless +final+ is
+// set. +offset+ is the input offset of +ptr+. Set *done to stop early, and stop
+// after a callback leaves hex->stopped set.
+typedef const char * ihex_textDecoder(ihex_t * hex, const char * ptr, const char * end, long offset,
+                                      int final, void * context, int * done);
+void ihex_readText(ihex_t * hex, ihex_textDecoder * decode, void * context);
+
+// Stop decoding at a malformed record; returns NULL for the decoder to return
+const char * ihex_invalid(ihex_t * hex, const char * msg, long offset, int * done);
 
+// For loaders of binary formats: the whole input, decoded. The mapping for a plain
+// file; anything else is read into memory once, which a heap-free build refuses.
+// NULL, with hex->error set, on failure.
+const uint8_t * ihex_bytes(ihex_t * hex, size_t * len);
 
 #endif
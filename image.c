@@ -0,0 +1,545 @@
+//
+//  image
+//
+//  In-memory model of the flash contents described by a firmware file.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "image.h"
+#include "loader.h"
+#include "crc.h"
+#include "util.h"
+#include "colors.h"
+
+extern int verbose;
+
+image_t * image_new(void)
+{
+  image_t * image = malloc(sizeof(image_t));
+  memset(image, '\0', sizeof(*image));
+  return image;
+}
+
+void image_free(image_t * image)
+{
+  int i;
+  if (NULL == image)
+    return;
+
+  if (image->mapping)
+    munmap(image->mapping, image->mappingLen);
+  else
+    for (i=0; i<image->count; i++)
+      free(image->extents[i].data);
+
+  free(image->extents);
+  free(image->pageIndex);
+  free(image);
+}
+
+#pragma mark - Building
+
+static int _image_writeBatch(ihex_t * hex, const ihex_batch_t * batch, void * context)
+{
+  int i;
+  for (i=0; i<batch->count; i++)
+    image_write(context, batch->spans[i].addr, batch->spans[i].data, batch->spans[i].len);
+  return 0;
+}
+
+ihex_consumer_t image_consumer(image_t * image)
+{
+  ihex_consumer_t consumer = { _image_writeBatch, image };
+  return consumer;
+}
+
+// Hand the extents of an image that was never parsed to +consumers+, as batches
+static void _image_dispatchExtents(ihex_t * hex, image_t * image, const ihex_consumer_t * consumers, int count)
+{
+  ihex_batch_t batch;
+  int i, c;
+  for (i=0; i<image->count; i+=IHEX_BATCH_SPANS)
+  {
+    batch.count = MIN(image->count - i, IHEX_BATCH_SPANS);
+    batch.bytes = 0;
+
+    int j;
+    for (j=0; j<batch.count; j++)
+    {
+      batch.spans[j].addr = image->extents[i + j].addr;
+      batch.spans[j].len  = image->extents[i + j].len;
+      batch.spans[j].data = image->extents[i + j].data;
+    }
+
+    for (c=0; c<count; c++)
+      consumers[c].batch(hex, &batch, consumers[c].context);
+  }
+}
+
+image_t * image_fromHexWith(ihex_t * hex, const ihex_consumer_t * also, int count)
+{
+  image_t * image = NULL;
+  if (hex->loader && hex->loader->image)
+  {
+    hex->error = NULL;
+    image = hex->loader->image(hex);
+    if (NULL == image && hex->error)
+      return NULL;
+  }
+
+  if (image)
+    _image_dispatchExtents(hex, image, also, count);
+  else
+  {
+    image = image_new();
+
+    ihex_consumer_t consumers[1 + count];
+    consumers[0] = image_consumer(image);
+    memcpy(consumers + 1, also, count * sizeof(ihex_consumer_t));
+    ihex_dispatch(hex, consumers, 1 + count);
+  }
+
+  if (verbose > 1)
+    printf("Image: %d bytes in %d extents; ends at 0x%x\n", image->size, image->count, image->maxAddr);
+
+  return image;
+}
+
+image_t * image_fromHex(ihex_t * hex)
+{
+  return image_fromHexWith(hex, NULL, 0);
+}
+
+
+static void _image_reserveExtent(image_extent_t * e, uint32_t len)
+{
+  if (len <= e->capacity)
+    return;
+
+  uint32_t capacity = MAX(e->capacity * 2, 256);
+  while (capacity < len)
+    capacity *= 2;
+
+  e->data = realloc(e->data, capacity);
+  e->capacity = capacity;
+}
+
+// Index of the first extent that ends after +addr+, or image->count
+static int _image_findExtent(image_t * image, uint32_t addr)
+{
+  int lo = 0, hi = image->count;
+
+  if (image->pageIndex && image->pagesize)
+  {
+    uint32_t page = addr / image->pagesize;
+    if (page >= image->pageCount)
+      return image->count;
+    lo = image->pageIndex[page];
+  }
+
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    image_extent_t * e = &image->extents[mid];
+    if (e->addr + e->len <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+// Copy mapped extent data onto the heap so it can be modified
+static void _image_unmap(image_t * image)
+{
+  int i;
+  for (i=0; i<image->count; i++)
+  {
+    image_extent_t * e = &image->extents[i];
+    uint8_t * data = malloc(MAX(e->len, 1));
+    memcpy(data, e->data, e->len);
+    e->data = data;
+    e->capacity = e->len;
+  }
+
+  munmap(image->mapping, image->mappingLen);
+  image->mapping = NULL;
+  image->mappingLen = 0;
+}
+
+void image_write(image_t * image, uint32_t addr, const uint8_t * data, uint32_t len)
+{
+  if (0 == len)
+    return;
+
+  if (image->mapping)
+    _image_unmap(image);
+
+  uint32_t end = addr + len;
+  image_extent_t * last = image->count ? &image->extents[image->count - 1] : NULL;
+
+  // Any previously built page index is stale now
+  free(image->pageIndex);
+  image->pageIndex = NULL;
+  image->pageCount = 0;
+
+  // Records normally arrive in address order; extend the last extent
+  if (last && last->addr + last->len == addr)
+  {
+    _image_reserveExtent(last, last->len + len);
+    memcpy(last->data + last->len, data, len);
+    last->len += len;
+    image->size += len;
+    image->maxAddr = MAX(image->maxAddr, end);
+    return;
+  }
+
+  // Coalesce with every extent that overlaps or touches [addr, end)
+  int first = 0, hi = image->count;
+  while (first < hi)
+  {
+    int mid = (first + hi) / 2;
+    image_extent_t * e = &image->extents[mid];
+    if (e->addr + e->len < addr)
+      first = mid + 1;
+    else
+      hi = mid;
+  }
+
+  int stop = first;
+  uint32_t start = addr;
+  uint32_t stopAddr = end;
+  while (stop < image->count && image->extents[stop].addr <= end)
+  {
+    image_extent_t * e = &image->extents[stop];
+    start    = MIN(start, e->addr);
+    stopAddr = MAX(stopAddr, e->addr + e->len);
+    stop++;
+  }
+
+  image_extent_t merged = { start, stopAddr - start, 0, NULL };
+  _image_reserveExtent(&merged, merged.len);
+
+  int i;
+  for (i=first; i<stop; i++)
+  {
+    image_extent_t * e = &image->extents[i];
+    memcpy(merged.data + (e->addr - start), e->data, e->len);
+    image->size -= e->len;
+    free(e->data);
+  }
+  memcpy(merged.data + (addr - start), data, len);  // Later records win
+  image->size += merged.len;
+
+  // Replace extents [first, stop) with the merged extent
+  int removed = stop - first;
+  if (0 == removed)
+  {
+    if (image->count == image->capacity)
+    {
+      image->capacity = MAX(image->capacity * 2, 16);
+      image->extents = realloc(image->extents, image->capacity * sizeof(image_extent_t));
+    }
+    memmove(&image->extents[first + 1], &image->extents[first], (image->count - first) * sizeof(image_extent_t));
+    image->count++;
+  }
+  else if (removed > 1)
+  {
+    memmove(&image->extents[first + 1], &image->extents[stop], (image->count - stop) * sizeof(image_extent_t));
+    image->count -= removed - 1;
+  }
+  image->extents[first] = merged;
+
+  image->maxAddr = MAX(image->maxAddr, stopAddr);
+}
+
+#pragma mark - Pages
+
+void image_paginate(image_t * image, uint16_t pagesize)
+{
+  free(image->pageIndex);
+  image->pageIndex = NULL;
+  image->pagesize  = pagesize;
+  image->pageCount = 0;
+
+  if (0 == pagesize)
+    return;
+
+  image->pageCount = (image->maxAddr + pagesize - 1) / pagesize;
+  image->pageIndex = malloc(MAX(image->pageCount, 1) * sizeof(int));
+
+  uint32_t page;
+  int ext = 0;
+  for (page=0; page<image->pageCount; page++)
+  {
+    uint32_t pageAddr = page * pagesize;
+    while (ext < image->count && image->extents[ext].addr + image->extents[ext].len <= pageAddr)
+      ext++;
+    image->pageIndex[page] = ext;
+  }
+}
+
+void image_read(image_t * image, uint32_t addr, uint8_t * buf, uint32_t len)
+{
+  uint32_t end = addr + len;
+  memset(buf, IMAGE_FILL, len);
+
+  int i;
+  for (i=_image_findExtent(image, addr); i<image->count; i++)
+  {
+    image_extent_t * e = &image->extents[i];
+    if (e->addr >= end)
+      break;
+
+    uint32_t from = MAX(addr, e->addr);
+    uint32_t to   = MIN(end, e->addr + e->len);
+    memcpy(buf + (from - addr), e->data + (from - e->addr), to - from);
+  }
+}
+
+uint32_t image_changedPages(image_t * from, image_t * to, uint16_t pagesize)
+{
+  uint32_t end = MAX(from->maxAddr, to->maxAddr);
+  uint8_t * a = malloc(2 * pagesize);
+  uint8_t * b = a + pagesize;
+  uint32_t addr, changed = 0;
+
+  for (addr=0; addr<end; addr+=pagesize)
+  {
+    image_read(from, addr, a, pagesize);
+    image_read(to, addr, b, pagesize);
+    changed += (0 != memcmp(a, b, pagesize));
+  }
+
+  free(a);
+  return changed;
+}
+
+#pragma mark - CRC Calculation
+
+// CRC the extents below +limit+ (word aligned) into +context+, erased gaps
+// included. Returns the address reached, always word aligned.
+static uint32_t _image_crcExtents(image_t * image, uint32_t limit, crc_t * context)
+{
+  uint32_t addr  = 0;   // Always word aligned
+  uint16_t fill  = IMAGE_FILL | (IMAGE_FILL << 8);
+
+  int i;
+  for (i=0; i<image->count && addr < limit; i++)
+  {
+    image_extent_t * e = &image->extents[i];
+    uint32_t end = MIN(e->addr + e->len, limit);
+    if (e->addr >= limit)
+      break;
+
+    // Erased words before this extent
+    crc_pad(context, (e->addr & ~1U) / 2 - addr / 2, fill);
+    addr = e->addr & ~1U;
+
+    // Extent starts on an odd byte; its partner is erased
+    if (e->addr & 1)
+    {
+      crc_updateWord(context, IMAGE_FILL | (e->data[0] << 8));
+      addr += 2;
+    }
+
+    // Extents never touch, so an odd trailing byte is paired with erased flash
+    if (end > addr)
+    {
+      crc_update(context, e->data + (addr - e->addr), end - addr);
+      addr = (end + 1) & ~1U;
+    }
+  }
+
+  return addr;
+}
+
+uint32_t image_crc(image_t * image, int maxAddr, uint8_t pad)
+{
+  crc_t context;
+  crc_init(&context);
+
+  // The device CRCs every word of the application section, erased gaps included
+  uint32_t words = maxAddr/2 + 1;
+  uint32_t limit = words * 2;
+  uint32_t addr  = _image_crcExtents(image, limit, &context);
+
+  // Pad to memory length
+  if (addr < limit)
+    crc_pad(&context, (limit - addr) / 2, (pad | pad << 8));
+
+  return context.crc;
+}
+
+void image_crcPrefix(image_t * image, crc_t * prefix)
+{
+  crc_init(prefix);
+  _image_crcExtents(image, UINT32_MAX & ~1U, prefix);
+}
+
+static int _image_crcBatch(ihex_t * hex, const ihex_batch_t * batch, void * context)
+{
+  image_crcStream_t * s = context;
+  uint16_t fill = IMAGE_FILL | (IMAGE_FILL << 8);
+
+  int i;
+  for (i=0; i<batch->count && !s->unordered; i++)
+  {
+    const ihex_span_t * span = &batch->spans[i];
+    const uint8_t * data = span->data;
+    uint32_t len = span->len;
+
+    // image_write would let later data replace earlier; only the image can say how
+    if (span->addr < s->addr)
+    {
+      s->unordered = 1;
+      break;
+    }
+
+    if (span->addr > s->addr)
+    {
+      // Finish a half word with erased flash, then the erased words of the gap
+      if (s->addr & 1)
+      {
+        crc_updateWord(&s->crc, s->low | (IMAGE_FILL << 8));
+        s->addr++;
+      }
+      crc_pad(&s->crc, (span->addr & ~1U) / 2 - s->addr / 2, fill);
+      s->addr = span->addr;
+      s->low = IMAGE_FILL;
+    }
+
+    if ((s->addr & 1) && len > 0)
+    {
+      crc_updateWord(&s->crc, s->low | (data[0] << 8));
+      data++;
+      len--;
+    }
+
+    crc_update(&s->crc, data, len & ~1U);
+    if (len & 1)
+      s->low = data[len - 1];
+    s->addr = span->addr + span->len;
+  }
+
+  return 0;
+}
+
+ihex_consumer_t image_crcConsumer(image_crcStream_t * stream)
+{
+  memset(stream, '\0', sizeof(*stream));
+  crc_init(&stream->crc);
+  ihex_consumer_t consumer = { _image_crcBatch, stream };
+  return consumer;
+}
+
+int image_crcStreamFinish(image_crcStream_t * stream, crc_t * prefix)
+{
+  if (stream->unordered)
+    return 0;
+
+  *prefix = stream->crc;
+  if (stream->addr & 1)
+    crc_updateWord(prefix, stream->low | (IMAGE_FILL << 8));
+  return 1;
+}
+
+uint32_t image_crcFinish(image_t * image, const crc_t * prefix, int maxAddr, uint8_t pad)
+{
+  uint32_t words = maxAddr/2 + 1;
+
+  // An image running past the device is cut short, which the prefix can't be
+  if (prefix->count > words)
+    return image_crc(image, maxAddr, pad);
+
+  crc_t context = *prefix;
+  crc_pad(&context, words - context.count, (pad | pad << 8));
+  return context.crc;
+}
+
+#pragma mark - Patches
+
+void image_readPatched(image_t * image, const image_patch_t * patches, int count,
+                       uint32_t addr, uint8_t * buf, uint32_t len)
+{
+  image_read(image, addr, buf, len);
+
+  uint32_t end = addr + len;
+  int i;
+  for (i=0; i<count; i++)
+  {
+    const image_patch_t * p = &patches[i];
+    uint32_t from = MAX(addr, p->addr);
+    uint32_t to   = MIN(end, p->addr + p->len);
+    if (from < to)
+      memcpy(buf + (from - addr), p->data + (from - p->addr), to - from);
+  }
+}
+
+uint32_t image_patchedEnd(image_t * image, const image_patch_t * patches, int count)
+{
+  uint32_t end = image->maxAddr;
+  int i;
+  for (i=0; i<count; i++)
+    end = MAX(end, patches[i].addr + patches[i].len);
+  return end;
+}
+
+uint32_t image_patchCRC(image_t * image, const image_patch_t * patches, int count, uint32_t crc, int maxAddr, uint8_t pad)
+{
+  uint32_t limit = (maxAddr/2 + 1) * 2;   // The words image_crc covers
+
+  // Where image_crc pads with +pad+ rather than erased flash: after the last extent
+  // that starts below the limit
+  uint32_t padFrom = 0;
+  int last = _image_findExtent(image, limit);
+  if (last < image->count && image->extents[last].addr < limit)
+    padFrom = limit;
+  else if (last > 0)
+    padFrom = (image->extents[last-1].addr + image->extents[last-1].len + 1) & ~1U;
+
+  int i;
+  for (i=0; i<count; i++)
+  {
+    const image_patch_t * p = &patches[i];
+    if (0 == p->len || p->addr >= limit)
+      continue;
+
+    // A patch past the end makes the padding before it a gap, read as erased flash
+    uint32_t patchEnd = (p->addr + p->len + 1) & ~1U;
+    uint32_t start    = p->addr & ~1U;
+    uint32_t end      = MIN(patchEnd, limit);
+    if (pad != IMAGE_FILL && patchEnd > padFrom)
+      start = MIN(start, padFrom);
+
+    // The words around the patch before and after it, earlier patches included
+    uint32_t len = end - start;
+    uint8_t * before = malloc(2 * len);
+    uint8_t * after  = before + len;
+    uint32_t padded = MIN(MAX(padFrom, start), end);
+    image_readPatched(image, patches, i, start, before, len);
+    memset(before + (padded - start), pad, end - padded);
+
+    memcpy(after, before, len);
+    memset(after + (padded - start), IMAGE_FILL, end - padded);
+    memcpy(after + (p->addr - start), p->data, MIN(p->len, end - p->addr));
+
+    crc ^= crc_delta(before, after, len, (limit - end) / 2);
+    free(before);
+    padFrom = MAX(padFrom, patchEnd);
+  }
+  return crc;
+}
+
+uint32_t image_patch(image_t * image, const image_patch_t * patch, uint32_t crc, int maxAddr, uint8_t pad)
+{
+  crc = image_patchCRC(image, patch, 1, crc, maxAddr, pad);
+  image_write(image, patch->addr, patch->data, patch->len);
+  return crc;
+}
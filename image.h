@@ -0,0 +1,119 @@
+//
+//  image
+//
+//  In-memory model of the flash contents described by a firmware file.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdint.h>
+#include "ihex.h"
+#include "crc.h"
+
+#ifndef image_h
+#define image_h
+
+// Unprogrammed flash reads back as 0xFF; gaps in the image are filled with it
+#define IMAGE_FILL 0xff
+
+// A contiguous run of bytes starting at +addr+
+typedef struct {
+  uint32_t addr;
+  uint32_t len;
+  uint32_t capacity;
+  uint8_t * data;
+} image_extent_t;
+
+// Sparse flash image. Extents are kept sorted by address and never overlap or touch;
+// adjacent writes are coalesced into a single extent.
+typedef struct {
+  image_extent_t * extents;
+  int count;
+  int capacity;
+
+  uint32_t size;      // Number of payload bytes
+  uint32_t maxAddr;   // One past the last byte in the image
+
+  // Page index: pageIndex[n] is the first extent that ends after the start of page n
+  uint16_t pagesize;
+  uint32_t pageCount;
+  int * pageIndex;
+
+  // When set, extent data points into this read-only mapping (see cache.h), which 
+  // image_free unmaps. The first image_write copies the data out.
+  void * mapping;
+  size_t mappingLen;
+} image_t;
+
+image_t * image_new(void);
+void image_free(image_t * image);
+
+// Build an image from all the data in +hex+ in a single pass, whatever its format.
+// Raw binary is mapped rather than copied. Check hex->error after; the image is NULL
+// if the input's loader refused it outright.
+image_t * image_fromHex(ihex_t * hex);
+
+// The same, handing everything the image is built from to +also+ in that pass
+image_t * image_fromHexWith(ihex_t * hex, const ihex_consumer_t * also, int count);
+
+// A consumer that writes what it's given into +image+
+ihex_consumer_t image_consumer(image_t * image);
+
+// Store +len+ bytes at +addr+, replacing anything already there
+void image_write(image_t * image, uint32_t addr, const uint8_t * data, uint32_t len);
+
+// Pages
+void image_paginate(image_t * image, uint16_t pagesize);
+void image_read(image_t * image, uint32_t addr, uint8_t * buf, uint32_t len);
+
+// Atmel CRC over the image, padded out to +maxAddr+
+uint32_t image_crc(image_t * image, int maxAddr, uint8_t pad);
+
+// The same CRC in two steps: the image's own words, which don't depend on the part,
+// then padding for a device of +maxAddr+, which is O(log n)
+void image_crcPrefix(image_t * image, crc_t * prefix);
+uint32_t image_crcFinish(image_t * image, const crc_t * prefix, int maxAddr, uint8_t pad);
+
+// How many +pagesize+ pages read back differently from +from+ and +to+, gaps
+// included, e.g. between two builds of the same firmware
+uint32_t image_changedPages(image_t * from, image_t * to, uint16_t pagesize);
+
+// Bytes written over an image for one unit, such as a serial number or a
+// calibration block, so many units can share one parsed image
+typedef struct {
+  uint32_t addr;
+  uint32_t len;
+  const uint8_t * data;
+} image_patch_t;
+
+// image_crc for +maxAddr+ and +pad+ once +patches+ are written over the image, from
+// +crc+, its value without them. Each costs time in proportion to its length (plus
+// log maxAddr, and any padding it turns into a gap), not to the image. Later patches
+// win where they overlap; the image isn't changed.
+uint32_t image_patchCRC(image_t * image, const image_patch_t * patches, int count, uint32_t crc,
+                        int maxAddr, uint8_t pad);
+
+// Write +patch+ into the image and return +crc+ updated to match
+uint32_t image_patch(image_t * image, const image_patch_t * patch, uint32_t crc, int maxAddr, uint8_t pad);
+
+// image_read with +patches+ written over what it reads
+void image_readPatched(image_t * image, const image_patch_t * patches, int count,
+                       uint32_t addr, uint8_t * buf, uint32_t len);
+
+// One past the last byte of the image or any of +patches+
+uint32_t image_patchedEnd(image_t * image, const image_patch_t * patches, int count);
+
+// image_crcPrefix computed by a consumer while the input is parsed, which saves
+// a pass over the image. Only input in address order can be done this way.
+typedef struct {
+  crc_t crc;
+  uint32_t addr;      // Next byte; odd while +low+ holds half a word
+  uint8_t low;
+  int unordered;
+} image_crcStream_t;
+
+ihex_consumer_t image_crcConsumer(image_crcStream_t * stream);
+
+// Returns 0 when the input wasn't in address order and image_crcPrefix is needed
+int image_crcStreamFinish(image_crcStream_t * stream, crc_t * prefix);
+
+#endif
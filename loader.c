@@ -0,0 +1,142 @@
+//
+//  loader
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "loader.h"
+#include "util.h"
+#include "colors.h"
+
+extern int verbose;
+
+#pragma mark - Detection
+
+typedef struct {
+  const char * extension;
+  const loader_t * loader;
+} loader_extension_t;
+
+static const loader_extension_t loaderExtensions[] = {
+  { ".hex",  &loader_ihex },
+  { ".ihex", &loader_ihex },
+  { ".ihx",  &loader_ihex },
+  { ".srec", &loader_srec },
+  { ".s19",  &loader_srec },
+  { ".s28",  &loader_srec },
+  { ".s37",  &loader_srec },
+  { ".mot",  &loader_srec },
+  { ".elf",  &loader_elf },
+  { ".bin",  &loader_bin },
+};
+
+// Suffixes that name the compressor rather than the format
+static const char * loaderCompressedExtensions[] = { ".gz", ".xz", ".zst" };
+
+// The extension of +path+ that names its format, in +ext+
+static void _loader_extension(const char * path, char * ext, size_t len)
+{
+  ext[0] = '\0';
+  const char * base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+
+  char name[256];
+  snprintf(name, sizeof(name), "%s", base);
+
+  int i;
+  for (i=0; i<(int)(sizeof(loaderCompressedExtensions)/sizeof(loaderCompressedExtensions[0])); i++)
+  {
+    char * dot = strrchr(name, '.');
+    if (dot && 0 == strcasecmp(dot, loaderCompressedExtensions[i]))
+      *dot = '\0';
+  }
+
+  const char * dot = strrchr(name, '.');
+  if (dot)
+    snprintf(ext, len, "%s", dot);
+}
+
+const loader_t * loader_detect(const char * path, const uint8_t * head, size_t len)
+{
+  if (head && len >= 4 && 0 == memcmp(head, "\x7f" "ELF", 4))
+    return &loader_elf;
+
+  char ext[16];
+  _loader_extension(path, ext, sizeof(ext));
+
+  int i;
+  for (i=0; i<(int)(sizeof(loaderExtensions)/sizeof(loaderExtensions[0])); i++)
+    if (0 == strcasecmp(ext, loaderExtensions[i].extension))
+      return loaderExtensions[i].loader;
+
+  if (head && len >= 2 && 'S' == head[0] && head[1] >= '0' && head[1] <= '9')
+    return &loader_srec;
+
+  return &loader_ihex;
+}
+
+#pragma mark - Raw binary
+
+// The whole file is the image from address 0
+static void _loader_binReadData(ihex_t * input, ihex_dataCallback callback, void * context)
+{
+  size_t len;
+  const uint8_t * bytes = ihex_bytes(input, &len);
+  if (NULL == bytes)
+    return;
+
+  if (verbose > 1)
+    printf("Raw binary: %zu bytes\n", len);
+
+  if (len > 0)
+    callback(input, 0, bytes, len, context);
+}
+
+// Map the file again for the image to own, so nothing is decoded or copied
+static image_t * _loader_binImage(ihex_t * input)
+{
+  // A heap-free build streams instead; it has no room for the image's extents
+  if (NULL != input->arena)
+  {
+    printf(CL_RED "A raw binary can only be streamed in this build\n" CL_RESET);
+    input->error = "Raw binary must be streamed";
+    return NULL;
+  }
+
+  struct stat st;
+  if (decompress_none != input->format || 0 != fstat(input->fd, &st) || !S_ISREG(st.st_mode) || 0 == st.st_size)
+    return NULL;
+
+  void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, input->fd, 0);
+  if (MAP_FAILED == map)
+    return NULL;
+
+  image_t * image = image_new();
+  image->mapping    = map;
+  image->mappingLen = st.st_size;
+  image->extents    = malloc(sizeof(image_extent_t));
+  image->count      = 1;
+  image->capacity   = 1;
+  image->size       = st.st_size;
+  image->maxAddr    = st.st_size;
+
+  image_extent_t * e = &image->extents[0];
+  e->addr     = 0;
+  e->len      = st.st_size;
+  e->capacity = st.st_size;
+  e->data     = map;
+
+  return image;
+}
+
+const loader_t loader_bin = {
+  .name     = "raw binary",
+  .readData = _loader_binReadData,
+  .image    = _loader_binImage,
+};
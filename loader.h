@@ -0,0 +1,42 @@
+//
+//  loader
+//
+//  Firmware file formats. An input is opened as an ihex_t, which owns the
+//  descriptor, mapping and decompression whatever the format; its loader turns
+//  it into data at absolute addresses through ihex_readData, which is all that
+//  image building, streaming to a device and the CRC code consume.
+//
+//  Intel HEX (ihex.c), Motorola S-records (srec.c), ELF program segments
+//  (elf.c) and raw binary loaded at address 0 (loader.c).
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdint.h>
+#include <stddef.h>
+#include "ihex.h"
+#include "image.h"
+
+#ifndef loader_h
+#define loader_h
+
+typedef struct loader_s {
+  const char * name;
+
+  void (*readData)(ihex_t * input, ihex_dataCallback callback, void * context);
+
+  // Optional: an image that borrows the input's bytes rather than copying them,
+  // or NULL to fall back to readData. NULL with input->error set refuses the input.
+  image_t * (*image)(ihex_t * input);
+} loader_t;
+
+extern const loader_t loader_ihex;
+extern const loader_t loader_srec;
+extern const loader_t loader_elf;
+extern const loader_t loader_bin;
+
+// The loader for a file called +path+ whose first bytes are +head+ (NULL when
+// they're compressed). ELF is known by its magic; otherwise the extension decides,
+// then the first character. Raw binary has no magic, so it needs a .bin name.
+const loader_t * loader_detect(const char * path, const uint8_t * head, size_t len);
+
+#endif
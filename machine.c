@@ -0,0 +1,875 @@
+//
+//  machine
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "machine.h"
+#include "bootloader.h"
+#include "trace.h"
+#include "util.h"
+#include "colors.h"
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+  #define HAVE_HOTPLUG 1
+#endif
+
+#define MACHINE_REATTACH_TIMEOUT_MS 3000   // As for the blocking flash
+#define MACHINE_POLL_MS             20     // Device list scans and open retries
+#define MACHINE_PREP_POLL_MS        5      // Checks on the prep's worker
+#define MACHINE_CONTROL_TIMEOUT_MS  1000
+
+struct machine_s {
+  flash_session_t *session;
+  flash_job_t *job;
+  machine_state_t state;
+  flash_result_t result;        // To report once the device has been reset
+  int usb;                      // libusb underneath, rather than the simulator
+  int claimed;
+
+  // Reaching the bootloader
+  transport_t *appTransport;    // The application, while it's reset
+  libusb_device *dev;           // Its bootloader once found, referenced
+#if HAVE_HOTPLUG
+  int listening;
+  libusb_hotplug_callback_handle hotplug;
+#endif
+
+  // The control request on the active transport
+  bootloader_t bootloader;
+  int opened;                   // +bootloader+ owns its transport
+  transport_transfer_t *xfer;
+  transport_t *xferOwner;
+  int pending;                  // Submitted and not yet back
+  int replied;                  // Back, with +status+
+  int status;                   // Bytes received, or a libusb error
+  uint8_t reply[8];             // CRCs; REQ_INFO lands in bootloader.info
+
+  // Writing
+  bootloader_writer_t *writer;
+  image_t *image;
+  uint32_t fileCRC;
+  int erasing;
+  int erased;
+  int attempt;                  // Of erase, write and verify
+
+  uint64_t start;
+  uint64_t wakeAt;              // A retry or scan is due; 0 for none
+  uint64_t deadline;            // Of the reattach or retries; 0 for none
+  trace_span_t span;
+  int inSpan;
+};
+
+#pragma mark - Steps
+
+static transport_t * _machine_transport(machine_t *m)
+{
+  return m->opened ? m->bootloader.transport : m->appTransport;
+}
+
+static void _machine_didReply(transport_transfer_t *xfer)
+{
+  machine_t *m = xfer->context;
+  m->pending = 0;
+  m->replied = 1;
+  m->status = (xfer->status < 0) ? xfer->status : xfer->actualLength;
+}
+
+// Queue a control IN request on the active transport. A request that can't be
+// submitted comes back at once as a failed reply.
+static void _machine_send(machine_t *m, uint8_t request, uint8_t *buf, int len)
+{
+  transport_t *t = _machine_transport(m);
+  m->replied = 0;
+
+  if (m->xferOwner != t)
+  {
+    transport_freeTransfer(m->xferOwner, m->xfer);
+    m->xfer = transport_allocTransfer(t, NULL);
+    m->xferOwner = m->xfer ? t : NULL;
+  }
+
+  int s = LIBUSB_ERROR_NO_MEM;
+  if (m->xfer)
+  {
+    m->xfer->buf = buf ? buf : m->reply;
+    m->xfer->callback = _machine_didReply;
+    m->xfer->context = m;
+    s = transport_submitControlIn(t, m->xfer, request, 0, 0, len,
+                                  (REQ_INFO == request) ? BOOTLOADER_PROBE_TIMEOUT_MS : MACHINE_CONTROL_TIMEOUT_MS);
+  }
+
+  m->pending = (s >= 0);
+  if (s < 0)
+  {
+    m->replied = 1;
+    m->status = s;
+  }
+}
+
+static void _machine_enter(machine_t *m, machine_state_t state, const char *phase)
+{
+  m->state = state;
+  m->wakeAt = 0;
+  m->deadline = 0;
+  if (phase)
+  {
+    trace_begin(&m->span, phase);
+    m->inSpan = 1;
+  }
+}
+
+static void _machine_endPhase(machine_t *m, int status)
+{
+  if (m->inSpan)
+    flash_phaseEnd(m->job, &m->span, status);
+  m->inSpan = 0;
+}
+
+static void _machine_closeApp(machine_t *m)
+{
+  if (NULL == m->appTransport)
+    return;
+
+  if (m->xferOwner == m->appTransport)
+  {
+    transport_freeTransfer(m->appTransport, m->xfer);
+    m->xfer = NULL;
+    m->xferOwner = NULL;
+  }
+  transport_close(m->appTransport);
+  m->appTransport = NULL;
+}
+
+static void _machine_stopListening(machine_t *m)
+{
+#if HAVE_HOTPLUG
+  if (m->listening)
+    libusb_hotplug_deregister_callback(flash_sessionContext(m->session), m->hotplug);
+  m->listening = 0;
+#endif
+}
+
+static void _machine_finish(machine_t *m, flash_result_t result)
+{
+  flash_job_t *job = m->job;
+
+  _machine_endPhase(m, (flash_result_ok == result || flash_result_current == result) ? 0 : -1);
+  _machine_stopListening(m);
+  _machine_closeApp(m);
+
+  if (m->writer)
+    bootloader_writerClose(m->writer);
+  m->writer = NULL;
+
+  if (m->xfer)
+    transport_freeTransfer(m->xferOwner, m->xfer);
+  m->xfer = NULL;
+  m->xferOwner = NULL;
+
+  if (m->opened)
+    bootloader_free(&m->bootloader);
+  m->opened = 0;
+
+  if (m->dev)
+    libusb_unref_device(m->dev);
+  m->dev = NULL;
+
+  if (m->claimed)
+    flash_release(m->session, job->label);
+  m->claimed = 0;
+
+  m->state = machine_state_done;
+  job->result = result;
+  job->elapsed = nowMicros() - m->start;
+  if (job->done)
+    job->done(job);
+}
+
+#pragma mark - Reattach
+
+#if HAVE_HOTPLUG
+static int LIBUSB_CALL _machine_didArrive(libusb_context *context, libusb_device *device,
+                                          libusb_hotplug_event event, void *user_data)
+{
+  machine_t *m = user_data;
+  char path[DEVICE_LABEL_LEN];
+  device_path(device, path, sizeof(path));
+  if (NULL == m->dev && 0 == strcmp(path, m->job->label))
+    m->dev = libusb_ref_device(device);
+  return 0; // Stay registered; _machine_stopListening deregisters
+}
+#endif
+
+// Before the application is reset, so an early arrival can't be missed
+static void _machine_listen(machine_t *m)
+{
+#if HAVE_HOTPLUG
+  if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+  {
+    int s = libusb_hotplug_register_callback(flash_sessionContext(m->session), LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+                                             LIBUSB_HOTPLUG_NO_FLAGS, BOOTLOADER_VID, BOOTLOADER_PID,
+                                             LIBUSB_HOTPLUG_MATCH_ANY, _machine_didArrive, m, &m->hotplug);
+    m->listening = (LIBUSB_SUCCESS == s);
+  }
+#endif
+}
+
+static int _machine_isListening(machine_t *m)
+{
+#if HAVE_HOTPLUG
+  return m->listening;
+#else
+  return 0;
+#endif
+}
+
+// Without hotplug, the bootloader on our port is looked for every MACHINE_POLL_MS
+static libusb_device * _machine_scan(machine_t *m)
+{
+  libusb_device **list;
+  ssize_t cnt = libusb_get_device_list(flash_sessionContext(m->session), &list);
+  if (cnt < 0)
+    return NULL;
+
+  libusb_device *found = NULL;
+  ssize_t i;
+  for (i = 0; i < cnt && NULL == found; i++)
+  {
+    char path[DEVICE_LABEL_LEN];
+    device_path(list[i], path, sizeof(path));
+    if (0 != strcmp(path, m->job->label))
+      continue;
+
+    struct libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(list[i], &desc) >= 0 &&
+        desc.idVendor == BOOTLOADER_VID && desc.idProduct == BOOTLOADER_PID)
+      found = libusb_ref_device(list[i]);
+  }
+
+  libusb_free_device_list(list, 1);
+  return found;
+}
+
+#pragma mark - Bootloader
+
+// Take the open bootloader and ask it for its info
+static void _machine_open(machine_t *m, transport_t *transport)
+{
+  const flash_options_t *options = flash_sessionOptions(m->session);
+
+  _machine_enter(m, machine_state_info, "init");
+  transport_setPolicy(transport, flash_sessionPolicy(m->session));
+  int s = bootloader_open(&m->bootloader, transport);
+  m->opened = 1;
+  if (0 != s)
+  {
+    _machine_finish(m, flash_result_initFailed);
+    return;
+  }
+
+  m->bootloader.queueDepth = options->queueDepth;
+  m->bootloader.pagesPerTransfer = options->pagesPerTransfer;
+  m->bootloader.arena = m->job->arena;
+  m->bootloader.patches = m->job->patches;
+  m->bootloader.patchCount = m->job->patchCount;
+  if (m->job->progress)
+  {
+    m->job->lastProgress = -1;
+    m->bootloader.progress = flash_didProgress;
+    m->bootloader.progressContext = m->job;
+  }
+
+  // A bootloader that has only just attached may not answer yet
+  m->deadline = nowMicros() + BOOTLOADER_READY_TIMEOUT_MS * 1000;
+  _machine_send(m, REQ_INFO, (uint8_t *)&m->bootloader.info, 64);
+}
+
+static void _machine_erase(machine_t *m)
+{
+  _machine_enter(m, machine_state_erase, "erase");
+  _machine_send(m, REQ_ERASE, NULL, 0);
+}
+
+static void _machine_startWrite(machine_t *m)
+{
+  printf(CL_GREEN "-> Writing %d bytes\n" CL_RESET, m->image->size);
+  _machine_enter(m, machine_state_startWrite, "write");
+  _machine_send(m, REQ_START_WRITE, NULL, 0);
+}
+
+// The image is in: check it fits, then skip, erase or write
+static void _machine_prepared(machine_t *m)
+{
+  const flash_options_t *options = flash_sessionOptions(m->session);
+  flash_job_t *job = m->job;
+  trace_span_t span;
+
+  m->image = job->prep ? job->prep->image : job->image;
+  if (NULL == m->image)
+  {
+    if (job->prep)
+      printf(CL_RED "Input file is invalid; not writing%s\n" CL_RESET, m->erased ? " (already erased)" : "");
+    else
+      printf(CL_RED "Streamed input needs flash_device; a machine writes an image\n" CL_RESET);
+    _machine_finish(m, flash_result_badInput);
+    return;
+  }
+
+  if (image_patchedEnd(m->image, job->patches, job->patchCount) > m->bootloader.info.memsize + 1)
+  {
+    printf(CL_RED "Input file size exceeds max device memory\n" CL_RESET);
+    _machine_finish(m, flash_result_tooLarge);
+    return;
+  }
+
+  trace_begin(&span, "image crc");
+  m->fileCRC = flash_imageCRC(job, m->image, job->prep ? job->prep->cache : job->cache, m->bootloader.info.memsize);
+  m->fileCRC = image_patchCRC(m->image, job->patches, job->patchCount, m->fileCRC, m->bootloader.info.memsize, 0xff);
+  flash_phaseEnd(job, &span, 0);
+
+  if (options->skipIfCurrent)
+  {
+    _machine_enter(m, machine_state_check, "check");
+    _machine_send(m, REQ_CRC_APP, m->reply, 4);
+  }
+  else if (m->erased)
+    _machine_startWrite(m);
+  else
+    _machine_erase(m);
+}
+
+// After a failure flash_isTransient allows, erase again once a backoff has passed,
+// as flash_device does. Returns 0 if the machine should finish with +result+ instead.
+static int _machine_retry(machine_t *m, flash_result_t result, int status)
+{
+  int attempts = MAX(flash_sessionOptions(m->session)->writeAttempts, 1);
+  if (m->attempt >= attempts || !flash_isTransient(result, status))
+    return 0;
+
+  int backoff = MIN(FLASH_RETRY_BACKOFF_MS << (m->attempt - 1), FLASH_RETRY_BACKOFF_MAX_MS);
+  printf(CL_YELLOW "Attempt %d of %d failed: %d; erasing again in %d ms\n" CL_RESET, m->attempt, attempts, status, backoff);
+  trace_retry("erase");
+
+  m->attempt++;
+  m->erased = 0;
+  m->replied = 0;
+  _machine_enter(m, machine_state_erase, NULL);
+  m->wakeAt = nowMicros() + backoff * 1000;
+  return 1;
+}
+
+static uint32_t _machine_replyCRC(machine_t *m)
+{
+  uint32_t crc = 0;
+  memcpy(&crc, m->reply, sizeof(crc));
+  return crc;
+}
+
+// Advance one state if what it waits for has happened. Returns 1 to try the next.
+static int _machine_step(machine_t *m)
+{
+  const flash_options_t *options = flash_sessionOptions(m->session);
+  flash_job_t *job = m->job;
+  uint64_t now = nowMicros();
+  int s;
+
+  switch (m->state)
+  {
+    case machine_state_appReset:
+      if (!m->replied)
+        return 0;
+
+      // The application drops off the bus as it goes, so a failed reply is usual
+      if (m->status < 0 && verbose > 1)
+        printf(CL_YELLOW "[%s] REQ_APP_RESET: %d\n" CL_RESET, job->label, m->status);
+      _machine_closeApp(m);
+      _machine_endPhase(m, 0);
+
+      _machine_enter(m, machine_state_reattach, "reattach");
+      m->deadline = now + MACHINE_REATTACH_TIMEOUT_MS * 1000;
+      m->wakeAt = _machine_isListening(m) ? 0 : now + MACHINE_POLL_MS * 1000;
+      return 1;
+
+    case machine_state_reattach:
+      if (NULL == m->dev && m->wakeAt && now >= m->wakeAt)
+      {
+        m->dev = _machine_scan(m);
+        m->wakeAt = now + MACHINE_POLL_MS * 1000;
+      }
+
+      if (m->dev)
+      {
+        _machine_stopListening(m);
+        _machine_endPhase(m, 0);
+        _machine_enter(m, machine_state_open, "open");
+        m->deadline = now + MACHINE_REATTACH_TIMEOUT_MS * 1000;
+        return 1;
+      }
+
+      if (now >= m->deadline)
+      {
+        printf(CL_RED "[%s] Unable to locate device after reset\n" CL_RESET, job->label);
+        _machine_finish(m, flash_result_noReattach);
+      }
+      return 0;
+
+    case machine_state_open:
+    {
+      if (now < m->wakeAt)
+        return 0;
+
+      // A freshly attached device can refuse to open until udev has finished with it
+      libusb_device_handle *devHandle = NULL;
+      s = libusb_open(m->dev, &devHandle);
+      if (0 != s)
+      {
+        if (now < m->deadline &&
+           (LIBUSB_ERROR_ACCESS == s || LIBUSB_ERROR_BUSY == s || LIBUSB_ERROR_NOT_FOUND == s))
+        {
+          trace_retry("libusb_open");
+          m->wakeAt = now + MACHINE_POLL_MS * 1000;
+          return 0;
+        }
+
+        printf(CL_RED "[%s] Could not open device: error %d\n" CL_RESET, job->label, s);
+        _machine_finish(m, flash_result_openFailed);
+        return 0;
+      }
+
+      libusb_unref_device(m->dev);
+      m->dev = NULL;
+      _machine_endPhase(m, 0);
+      _machine_open(m, transport_usbFromHandle(flash_sessionContext(m->session), devHandle));
+      return 1;
+    }
+
+    case machine_state_info:
+      if (m->pending)
+        return 0;
+
+      if (m->replied && m->status >= 0)
+      {
+        if (verbose > 0)
+          printf("Bootloader ready after %d ms\n", (int)((now - m->span.start) / 1000));
+        bootloader_printInfo(&m->bootloader);
+        _machine_endPhase(m, 0);
+        transport_setPolicyKey(m->bootloader.transport, m->bootloader.info.memsize);
+
+        if (job->arena && bootloader_arenaSize(&m->bootloader) > job->arena->size - job->arena->used)
+        {
+          printf(CL_RED "Arena has %zu bytes free; %d byte pages need %zu. Lower -q or -t.\n" CL_RESET,
+            job->arena->size - job->arena->used, m->bootloader.info.pagesize, bootloader_arenaSize(&m->bootloader));
+          _machine_finish(m, flash_result_initFailed);
+          return 0;
+        }
+
+        if (options->checkBootCRC)
+        {
+          _machine_enter(m, machine_state_bootCheck, NULL);
+          _machine_send(m, REQ_CRC_BOOT, m->reply, 4);
+        }
+        else
+        {
+          _machine_enter(m, machine_state_prepare, NULL);
+        }
+        return 1;
+      }
+
+      if (m->replied)
+      {
+        m->replied = 0;
+        if (LIBUSB_ERROR_NO_DEVICE != m->status && now < m->deadline)
+        {
+          if (verbose > 1)
+            printf(CL_YELLOW "Info request failed: %d; retrying\n" CL_RESET, m->status);
+          trace_retry("REQ_INFO");
+          m->wakeAt = now + BOOTLOADER_PROBE_INTERVAL_MS * 1000;
+          return 0;
+        }
+
+        printf(CL_RED "Info request failed: %d\n" CL_RESET, m->status);
+        _machine_finish(m, flash_result_initFailed);
+        return 0;
+      }
+
+      if (now < m->wakeAt)
+        return 0;
+      m->wakeAt = 0;
+      memset(&m->bootloader.info, '\0', sizeof(m->bootloader.info));
+      _machine_send(m, REQ_INFO, (uint8_t *)&m->bootloader.info, 64);
+      return 1;
+
+    case machine_state_bootCheck:
+      if (!m->replied)
+        return 0;
+
+      if (m->status < 0 || _machine_replyCRC(m) != options->expectedBootCRC)
+      {
+        printf(CL_RED "Boot CRC: 0x%04x; expected 0x%04x\n" CL_RESET, _machine_replyCRC(m), options->expectedBootCRC);
+        _machine_finish(m, flash_result_bootMismatch);
+        return 0;
+      }
+      _machine_enter(m, machine_state_prepare, NULL);
+      return 1;
+
+    case machine_state_prepare:
+      if (m->erasing)
+      {
+        if (!m->replied)
+          return 0;
+
+        m->erasing = 0;
+        _machine_endPhase(m, m->status);
+        if (m->status < 0)
+        {
+          printf(CL_RED "Erase failed: %d\n" CL_RESET, m->status);
+          _machine_finish(m, flash_result_eraseFailed);
+          return 0;
+        }
+        m->erased = 1;
+      }
+
+      if (job->prep && !flash_prepReady(job->prep))
+      {
+        // Still parsing: erase meanwhile rather than wait, as flash_device does
+        if (!options->skipIfCurrent && !m->erased)
+        {
+          m->erasing = 1;
+          trace_begin(&m->span, "erase");
+          m->inSpan = 1;
+          _machine_send(m, REQ_ERASE, NULL, 0);
+          return 1;
+        }
+
+        m->wakeAt = now + MACHINE_PREP_POLL_MS * 1000;
+        return 0;
+      }
+
+      _machine_prepared(m);
+      return 1;
+
+    case machine_state_check:
+      if (!m->replied)
+        return 0;
+
+      _machine_endPhase(m, m->status);
+      if (m->status >= 0 && _machine_replyCRC(m) == m->fileCRC)
+      {
+        printf(CL_GREEN "App CRC 0x%04x matches; already current\n" CL_RESET, _machine_replyCRC(m));
+        m->result = flash_result_current;
+        _machine_enter(m, machine_state_reset, NULL);
+        _machine_send(m, REQ_RESET, NULL, 0);
+      }
+      else if (m->erased)
+        _machine_startWrite(m);
+      else
+        _machine_erase(m);
+      return 1;
+
+    case machine_state_erase:
+      if (m->wakeAt)
+      {
+        // Retrying, once the backoff has passed
+        if (now < m->wakeAt)
+          return 0;
+        m->wakeAt = 0;
+        trace_begin(&m->span, "erase");
+        m->inSpan = 1;
+        _machine_send(m, REQ_ERASE, NULL, 0);
+        return 1;
+      }
+      if (!m->replied)
+        return 0;
+
+      _machine_endPhase(m, m->status);
+      if (m->status < 0)
+      {
+        printf(CL_RED "Erase failed: %d\n" CL_RESET, m->status);
+        _machine_finish(m, flash_result_eraseFailed);
+        return 0;
+      }
+      m->erased = 1;
+      _machine_startWrite(m);
+      return 1;
+
+    case machine_state_startWrite:
+      if (!m->replied)
+        return 0;
+
+      if (m->status < 0)
+      {
+        printf(CL_RED "Could not start write\n" CL_RESET);
+        _machine_finish(m, flash_result_writeFailed);
+        return 0;
+      }
+      m->writer = bootloader_writerOpen(&m->bootloader, m->image);
+      if (NULL == m->writer)
+      {
+        printf(CL_RED "\nWrite failed: %d\n" CL_RESET, LIBUSB_ERROR_NO_MEM);
+        _machine_finish(m, flash_result_writeFailed);
+        return 0;
+      }
+      m->state = machine_state_write;
+      return 1;
+
+    case machine_state_write:
+      s = bootloader_writerPump(m->writer);
+      if (0 == s)
+        return 0;
+
+      s = bootloader_writerClose(m->writer);
+      m->writer = NULL;
+      _machine_endPhase(m, s);
+      if (s < 0)
+      {
+        printf(CL_RED "\nWrite failed: %d\n" CL_RESET, s);
+        flash_result_t result = (LIBUSB_ERROR_OVERFLOW == s) ? flash_result_tooLarge : flash_result_writeFailed;
+        if (_machine_retry(m, result, s))
+          return 1;
+        _machine_finish(m, result);
+        return 0;
+      }
+      printf(CL_GREEN "\nDone\n" CL_RESET);
+
+      _machine_enter(m, machine_state_verify, "verify");
+      _machine_send(m, REQ_CRC_APP, m->reply, 4);
+      return 1;
+
+    case machine_state_verify:
+      if (!m->replied)
+        return 0;
+
+      _machine_endPhase(m, m->status);
+      if (m->status < 0)
+      {
+        printf(CL_RED "Could not read App CRC: %d\n" CL_RESET, m->status);
+        if (_machine_retry(m, flash_result_writeFailed, m->status))
+          return 1;
+        _machine_finish(m, flash_result_writeFailed);
+        return 0;
+      }
+      printf("File CRC:0x%04x\n", m->fileCRC);
+      printf("App CRC: 0x%04x\n", _machine_replyCRC(m));
+      if (_machine_replyCRC(m) != m->fileCRC)
+      {
+        printf(CL_RED "CRC Mismatch\n" CL_RESET);
+        if (_machine_retry(m, flash_result_crcMismatch, m->status))
+          return 1;
+        _machine_finish(m, flash_result_crcMismatch);
+        return 0;
+      }
+
+      printf(CL_GREEN "CRC Matches\n" CL_RESET);
+      m->result = flash_result_ok;
+      _machine_enter(m, machine_state_reset, "reset");
+      _machine_send(m, REQ_RESET, NULL, 0);
+      return 1;
+
+    case machine_state_reset:
+      if (!m->replied)
+        return 0;
+
+      _machine_endPhase(m, m->status);
+      if (m->status != 0)
+        printf(CL_RED "Could not reset target: %d\n" CL_RESET, m->status);
+      _machine_finish(m, m->result);
+      return 0;
+
+    case machine_state_done:
+      return 0;
+  }
+  return 0;
+}
+
+#pragma mark - Driving
+
+static machine_t * _machine_alloc(flash_session_t *session, flash_job_t *job)
+{
+  machine_t *m = malloc(sizeof(machine_t));
+  memset(m, '\0', sizeof(*m));
+  m->session = session;
+  m->job = job;
+  m->start = nowMicros();
+  m->attempt = 1;
+
+  job->session = session;
+  job->lastProgress = -1;
+  return m;
+}
+
+machine_t * machine_new(flash_session_t *session, flash_job_t *job, libusb_device *dev)
+{
+  machine_t *m = _machine_alloc(session, job);
+  m->usb = 1;
+
+  device_path(dev, job->label, sizeof(job->label));
+  if (!flash_claim(session, job->label))
+  {
+    printf(CL_RED "[%s] Already being flashed\n" CL_RESET, job->label);
+    _machine_finish(m, flash_result_openFailed);
+    return m;
+  }
+  m->claimed = 1;
+
+  struct libusb_device_descriptor desc;
+  if (libusb_get_device_descriptor(dev, &desc) < 0)
+  {
+    printf("-> Failed to get device descriptor\n");
+    _machine_finish(m, flash_result_openFailed);
+    return m;
+  }
+
+  // Already a bootloader
+  if (!(desc.idVendor != BOOTLOADER_VID && desc.idProduct != BOOTLOADER_PID))
+  {
+    m->dev = libusb_ref_device(dev);
+    _machine_enter(m, machine_state_open, "open");
+    m->deadline = nowMicros() + MACHINE_REATTACH_TIMEOUT_MS * 1000;
+    return m;
+  }
+
+  // An application: send it to its bootloader, which comes back on the same port
+  printf(CL_YELLOW "[%s] Resetting application\n" CL_RESET, job->label);
+
+  libusb_device_handle *devHandle = NULL;
+  int s = libusb_open(dev, &devHandle);
+  if (0 != s)
+  {
+    printf(CL_RED "[%s] Could not open device: error %d\n" CL_RESET, job->label, s);
+    _machine_finish(m, flash_result_openFailed);
+    return m;
+  }
+
+  s = libusb_set_configuration(devHandle, 1);
+  if (s != 0)
+    printf(CL_RED "libusb_set_configuration error %d\n" CL_RESET, s);
+
+  m->appTransport = transport_usbFromHandle(flash_sessionContext(session), devHandle);
+  _machine_listen(m);
+  _machine_enter(m, machine_state_appReset, "app reset");
+  _machine_send(m, REQ_APP_RESET, NULL, 0);
+  return m;
+}
+
+machine_t * machine_newWithTransport(flash_session_t *session, flash_job_t *job, transport_t *transport)
+{
+  machine_t *m = _machine_alloc(session, job);
+  _machine_open(m, transport);
+  return m;
+}
+
+int machine_pollfds(machine_t *m, struct pollfd *fds, int max)
+{
+  if (!m->usb || machine_state_done == m->state)
+    return 0;
+
+  const struct libusb_pollfd **list = libusb_get_pollfds(flash_sessionContext(m->session));
+  if (NULL == list)
+    return 0;
+
+  int n;
+  for (n=0; list[n] && n < max; n++)
+  {
+    fds[n].fd = list[n]->fd;
+    fds[n].events = list[n]->events;
+    fds[n].revents = 0;
+  }
+  libusb_free_pollfds(list);
+  return n;
+}
+
+int machine_timeout(machine_t *m)
+{
+  if (machine_state_done == m->state)
+    return 0;
+
+  uint64_t now = nowMicros();
+  uint64_t wait = UINT64_MAX;
+  uint64_t micros;
+
+  if (m->wakeAt)
+    wait = (m->wakeAt > now) ? m->wakeAt - now : 0;
+  if (machine_state_reattach == m->state)
+    wait = MIN(wait, (m->deadline > now) ? m->deadline - now : 0);
+
+  // libusb's own timeouts, for transfers that never come back
+  transport_t *t = _machine_transport(m);
+  if (t && 1 == transport_nextTimeout(t, &micros))
+    wait = MIN(wait, micros);
+
+  if (UINT64_MAX == wait)
+    return -1;
+  return (int)MIN((wait + 999) / 1000, (uint64_t)INT_MAX);
+}
+
+int machine_handleEvents(machine_t *m)
+{
+  if (machine_state_done == m->state)
+    return 1;
+
+  // Completions only set flags; the steps act on them
+  transport_t *t = _machine_transport(m);
+  if (t)
+  {
+    transport_pollEvents(t);
+  }
+  else if (m->usb)
+  {
+    struct timeval zero = { 0, 0 };
+    libusb_handle_events_timeout_completed(flash_sessionContext(m->session), &zero, NULL);
+  }
+
+  while (machine_state_done != m->state && _machine_step(m))
+    ;
+  return machine_state_done == m->state;
+}
+
+machine_state_t machine_state(machine_t *m)
+{
+  return m->state;
+}
+
+const char * machine_stateStr(machine_state_t state)
+{
+  switch (state)
+  {
+    case machine_state_appReset:   return "app reset";
+    case machine_state_reattach:   return "reattach";
+    case machine_state_open:       return "open";
+    case machine_state_info:       return "info";
+    case machine_state_bootCheck:  return "boot check";
+    case machine_state_prepare:    return "prepare";
+    case machine_state_check:      return "check";
+    case machine_state_erase:      return "erase";
+    case machine_state_startWrite: return "start write";
+    case machine_state_write:      return "write";
+    case machine_state_verify:     return "verify";
+    case machine_state_reset:      return "reset";
+    case machine_state_done:       return "done";
+  }
+  return "unknown";
+}
+
+void machine_free(machine_t *m)
+{
+  if (NULL == m)
+    return;
+
+  if (machine_state_done != m->state)
+  {
+    // The writer drains its own transfers when closed
+    if (m->pending)
+    {
+      transport_cancel(m->xferOwner, m->xfer);
+      while (m->pending)
+        transport_handleEvents(m->xferOwner, NULL);
+    }
+    _machine_finish(m, flash_result_cancelled);
+  }
+  free(m);
+}
@@ -0,0 +1,83 @@
+//
+//  machine
+//
+//  A flash as a state machine for programs with their own event loop: reset the
+//  application, wait for its bootloader to reattach, read its info, erase, write,
+//  check the CRC and start the new application, without blocking the thread.
+//  Every transfer is queued; the machine advances when its descriptors are
+//  ready or its timeout passes:
+//
+//    machine_t *m = machine_new(session, &job, dev);
+//    while (!machine_handleEvents(m))
+//    {
+//      int n = machine_pollfds(m, fds, MAX_FDS);
+//      poll(fds, n, machine_timeout(m));
+//    }
+//    machine_free(m);      // job.result says how it went
+//
+//  The descriptors are libusb's, so they're shared by every machine in a session
+//  and the loop can wait on them once for all of them; poll them for readability
+//  and writability as libusb asks. Any number of machines can be driven from one
+//  thread this way, alongside anything else that loop waits on.
+//
+//  A few steps still don't wait on the device and run inline: opening it and
+//  setting its configuration, and CRCing the image for its memory size. The job
+//  needs an image (or a prep to wait for); a streamed hex would block on its
+//  input. Devices are kept apart by their port claims (flash_claim) rather than
+//  the session's reattach lock, which would block.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <poll.h>
+#include <libusb.h>
+#include "flash.h"
+#include "transport.h"
+
+#ifndef machine_h
+#define machine_h
+
+typedef enum {
+  machine_state_appReset = 0, // Sending the application to its bootloader
+  machine_state_reattach,     // Waiting for the bootloader on the same port
+  machine_state_open,         // Opening it, retried while udev has it
+  machine_state_info,         // REQ_INFO, retried until the bootloader answers
+  machine_state_bootCheck,    // REQ_CRC_BOOT, when the session checks it
+  machine_state_prepare,      // Waiting for the prep, erasing meanwhile
+  machine_state_check,        // REQ_CRC_APP, to skip devices already current
+  machine_state_erase,
+  machine_state_startWrite,
+  machine_state_write,
+  machine_state_verify,       // REQ_CRC_APP
+  machine_state_reset,        // REQ_RESET
+  machine_state_done,         // job->result is set and job->done has been called
+} machine_state_t;
+
+typedef struct machine_s machine_t;
+
+// Flash +dev+, an application or a bootloader, with +job+, which must outlive the
+// machine. The caller keeps its reference to +dev+.
+machine_t * machine_new(flash_session_t * session, flash_job_t * job, libusb_device * dev);
+
+// Flash a bootloader that's already open; takes ownership of +transport+
+machine_t * machine_newWithTransport(flash_session_t * session, flash_job_t * job, transport_t * transport);
+
+// Up to +max+ descriptors to wait on; returns how many. The simulator has none,
+// only timeouts.
+int machine_pollfds(machine_t * m, struct pollfd * fds, int max);
+
+// Milliseconds until machine_handleEvents is due whatever the descriptors say, or
+// -1 for no limit
+int machine_timeout(machine_t * m);
+
+// Handle whatever is ready and advance as far as possible without waiting.
+// Returns 1 once the machine is done.
+int machine_handleEvents(machine_t * m);
+
+machine_state_t machine_state(machine_t * m);
+const char * machine_stateStr(machine_state_t state);
+
+// A machine that isn't done yet is cancelled first, which waits for libusb to hand
+// back anything in flight
+void machine_free(machine_t * m);
+
+#endif
@@ -0,0 +1,129 @@
+//
+//  policy
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <string.h>
+#include <math.h>
+#include <libusb.h>
+
+#include "policy.h"
+#include "util.h"
+
+void policy_init(policy_t * policy)
+{
+  memset(policy, '\0', sizeof(*policy));
+  pthread_mutex_init(&policy->lock, NULL);
+}
+
+void policy_destroy(policy_t * policy)
+{
+  pthread_mutex_destroy(&policy->lock);
+}
+
+#pragma mark - Learning
+
+// The stats for parts of kind +key+, made on first use. Call with the lock held.
+static policy_kind_t * _policy_kind(policy_t * policy, uint32_t key)
+{
+  int i;
+  for (i=0; i<POLICY_MAX_KEYS; i++)
+  {
+    policy_kind_t * kind = &policy->kinds[i];
+    if (!kind->used)
+    {
+      kind->used = 1;
+      kind->key = key;
+      return kind;
+    }
+    if (kind->key == key)
+      return kind;
+  }
+  return NULL;
+}
+
+// Gains of 1/8 and 1/4, as in RFC 6298. The first sample starts the deviation at
+// half the mean, so one observation already gives a generous timeout.
+static void _policy_sample(policy_stat_t * stat, int status, double sample)
+{
+  if (LIBUSB_ERROR_TIMEOUT == status)
+  {
+    stat->backoff = MIN(stat->backoff + 1, POLICY_MAX_BACKOFF);
+    return;
+  }
+  if (status < 0)
+    return;
+
+  if (0 == stat->samples)
+  {
+    stat->mean = sample;
+    stat->deviation = sample / 2;
+  }
+  else
+  {
+    stat->deviation += (fabs(sample - stat->mean) - stat->deviation) / 4;
+    stat->mean += (sample - stat->mean) / 8;
+  }
+  stat->samples++;
+  stat->backoff = 0;
+}
+
+void policy_didControl(policy_t * policy, uint32_t key, uint8_t request, int status, uint64_t micros)
+{
+  if (NULL == policy)
+    return;
+
+  pthread_mutex_lock(&policy->lock);
+  policy_kind_t * kind = _policy_kind(policy, key);
+  if (kind)
+    _policy_sample(&kind->control[request & 0x0f], status, micros);
+  pthread_mutex_unlock(&policy->lock);
+}
+
+void policy_didBulk(policy_t * policy, uint32_t key, int length, int status, uint64_t micros)
+{
+  if (NULL == policy || length <= 0)
+    return;
+
+  pthread_mutex_lock(&policy->lock);
+  policy_kind_t * kind = _policy_kind(policy, key);
+  if (kind)
+    _policy_sample(&kind->bulk, status, (double)micros * 1024 / length);
+  pthread_mutex_unlock(&policy->lock);
+}
+
+#pragma mark - Timeouts
+
+static unsigned int _policy_timeout(policy_stat_t * stat, double scale, unsigned int limit)
+{
+  if (NULL == stat || 0 == stat->samples)
+    return limit;
+
+  double ms = POLICY_MULTIPLIER * (stat->mean + 4 * stat->deviation) * scale / 1000;
+  ms = MAX(ms, POLICY_MIN_TIMEOUT_MS) * (1 << stat->backoff);
+  return (ms < limit) ? (unsigned int)ceil(ms) : limit;
+}
+
+unsigned int policy_controlTimeout(policy_t * policy, uint32_t key, uint8_t request, unsigned int limit)
+{
+  if (NULL == policy)
+    return limit;
+
+  pthread_mutex_lock(&policy->lock);
+  policy_kind_t * kind = _policy_kind(policy, key);
+  unsigned int timeout = _policy_timeout(kind ? &kind->control[request & 0x0f] : NULL, 1, limit);
+  pthread_mutex_unlock(&policy->lock);
+  return timeout;
+}
+
+unsigned int policy_bulkTimeout(policy_t * policy, uint32_t key, int length, unsigned int limit)
+{
+  if (NULL == policy)
+    return limit;
+
+  pthread_mutex_lock(&policy->lock);
+  policy_kind_t * kind = _policy_kind(policy, key);
+  unsigned int timeout = _policy_timeout(kind ? &kind->bulk : NULL, (double)length / 1024, limit);
+  pthread_mutex_unlock(&policy->lock);
+  return timeout;
+}
@@ -0,0 +1,65 @@
+//
+//  policy
+//
+//  Transfer timeouts learned from the device instead of a fixed second. Each
+//  control request, and bulk data per KB, keeps a running mean and mean
+//  deviation of its latency (as TCP does for round trips); the timeout is
+//  POLICY_MULTIPLIER times mean + 4 deviations (RFC 6298's estimator, not a
+//  percentile), and no less than POLICY_MIN_TIMEOUT_MS. Until a request
+//  has been seen, and never above it, the caller's own timeout applies.
+//
+//  A session shares one policy between its transports, so what one board teaches
+//  holds for the next of the same kind. Kinds are told apart by a key, the memory
+//  size, since a larger part takes longer over an erase or a CRC. Only successful
+//  transfers are learned from; each timeout doubles the next one (as TCP backs off
+//  its retransmissions), until a transfer of that kind succeeds again.
+//
+//  Bulk latencies are per KB of data the transfer waited for, its own and whatever
+//  was queued ahead of it, so depths 1 and 8 learn and time out alike.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdint.h>
+#include <pthread.h>
+
+#ifndef policy_h
+#define policy_h
+
+#define POLICY_MULTIPLIER     2
+#define POLICY_MIN_TIMEOUT_MS 20
+#define POLICY_MAX_BACKOFF    6    // Doublings after consecutive timeouts
+#define POLICY_MAX_KEYS       8    // Kinds of part; any more use the callers' timeouts
+
+typedef struct {
+  double mean;           // Microseconds; per KB for bulk
+  double deviation;
+  int samples;
+  int backoff;           // Timeouts since the last success
+} policy_stat_t;
+
+typedef struct {
+  uint32_t key;
+  int used;
+  policy_stat_t control[16];   // By the low nibble of the request, 0xB0-0xBB
+  policy_stat_t bulk;
+} policy_kind_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  policy_kind_t kinds[POLICY_MAX_KEYS];
+} policy_t;
+
+void policy_init(policy_t * policy);
+void policy_destroy(policy_t * policy);
+
+// The timeout for a request to a part of kind +key+, at most +limit+ ms. For bulk,
+// +length+ counts the bytes queued ahead too. A NULL policy returns +limit+.
+unsigned int policy_controlTimeout(policy_t * policy, uint32_t key, uint8_t request, unsigned int limit);
+unsigned int policy_bulkTimeout(policy_t * policy, uint32_t key, int length, unsigned int limit);
+
+// How a transfer ended (a libusb status) and how long it took from submission.
+// Statuses other than success and LIBUSB_ERROR_TIMEOUT say nothing about latency.
+void policy_didControl(policy_t * policy, uint32_t key, uint8_t request, int status, uint64_t micros);
+void policy_didBulk(policy_t * policy, uint32_t key, int length, int status, uint64_t micros);
+
+#endif
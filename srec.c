@@ -0,0 +1,116 @@
+//
+//  srec
+//
+//  Motorola S-records: "S", a type digit, then hex pairs for a byte count, an
+//  address of 2 (S1), 3 (S2) or 4 (S3) bytes, data and a checksum that makes
+//  the bytes after the type sum to 0xff. S7/S8/S9 end the file; S0 (header)
+//  and S5/S6 (record counts) carry nothing to flash.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdio.h>
+#include <string.h>
+
+#include "loader.h"
+#include "hexdecode.h"
+#include "colors.h"
+
+extern int verbose;
+
+#define SREC_MAX_RECORD (1 + 255)   // Count, then address, data and checksum
+
+struct _srec_context {
+  ihex_dataCallback * callback;
+  void * context;
+};
+
+// Address bytes for each record type; 0 for types that don't exist
+static const uint8_t srecAddressLen[10] = { 2, 2, 3, 4, 0, 2, 3, 4, 3, 2 };
+
+static const char * _srec_decodeRecords(ihex_t * hex, const char * ptr, const char * end, long offset,
+                                        int final, void * context, int * done)
+{
+  struct _srec_context * c = context;
+  const char * start = ptr;
+  uint8_t bin[SREC_MAX_RECORD];
+
+  while (ptr < end)
+  {
+    // Skip line endings; hex digits never include an S
+    const char * sor = memchr(ptr, 'S', end - ptr);
+    if (NULL == sor)
+      return end;
+    ptr = sor;
+
+    if (end - ptr < 4)
+      break;
+
+    int type = ptr[1] - '0';
+    if (type < 0 || type > 9 || 0 == srecAddressLen[type])
+      return ihex_invalid(hex, "Invalid S-record type", offset + (ptr - start), done);
+
+    if (hex_decode(bin, ptr + 2, 1) < 0)
+      return ihex_invalid(hex, "Invalid record length", offset + (ptr - start), done);
+
+    int count = 1 + bin[0];
+    if (end - ptr < 2 + 2*count)
+      break;
+
+    if (hex_decode(bin, ptr + 2, count) < 0)
+      return ihex_invalid(hex, "Invalid hex digit in record", offset + (ptr - start), done);
+
+    int addrLen = srecAddressLen[type];
+    if (bin[0] < addrLen + 1)
+      return ihex_invalid(hex, "Record too short for its address", offset + (ptr - start), done);
+
+    uint8_t sum = 0;
+    int i;
+    for (i=0; i<count; i++)
+      sum += bin[i];
+    if (0xff != sum)
+      return ihex_invalid(hex, "Record checksum mismatch", offset + (ptr - start), done);
+
+    uint32_t addr = 0;
+    for (i=0; i<addrLen; i++)
+      addr = (addr << 8) | bin[1 + i];
+
+    const uint8_t * data = bin + 1 + addrLen;
+    int len = bin[0] - addrLen - 1;
+
+    if (verbose > 1)
+      printf("\e[;33m S%d %08x % 4d\e[m\n", type, addr, len);
+
+    ptr += 2 + 2*count;
+
+    if (type >= 1 && type <= 3 && len > 0)
+      c->callback(hex, addr, data, len, c->context);
+
+    if (hex->stopped)
+    {
+      *done = 1;
+      return NULL;
+    }
+
+    if (type >= 7)
+    {
+      *done = 1;
+      return ptr;
+    }
+  }
+
+  if (final && ptr < end)
+    return ihex_invalid(hex, "Truncated record", offset + (ptr - start), done);
+
+  return ptr;
+}
+
+static void _srec_readData(ihex_t * input, ihex_dataCallback callback, void * context)
+{
+  struct _srec_context c = { callback, context };
+  ihex_readText(input, _srec_decodeRecords, &c);
+}
+
+const loader_t loader_srec = {
+  .name     = "S-records",
+  .readData = _srec_readData,
+};
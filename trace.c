@@ -0,0 +1,357 @@
+//
+//  trace
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "bootloader.h"
+#include "util.h"
+#include "colors.h"
+
+#define TRACE_MAX_THREADS   64
+#define TRACE_HIST_BUCKETS  22    // Powers of two from 1 us to ~4 s
+
+typedef struct {
+  trace_kind_t kind;
+  const char * name;
+  int tid;
+  uint8_t request;
+  int length;
+  int actual;
+  int status;
+  uint64_t start;
+  uint64_t end;
+} trace_event_t;
+
+int traceEnabled = 0;
+
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static const char * tracePath;
+static uint64_t traceEpoch;
+
+static trace_event_t * events;
+static int eventCount;
+static int eventCapacity;
+
+static pthread_t threads[TRACE_MAX_THREADS];
+static char * threadNames[TRACE_MAX_THREADS];
+static int threadCount;
+
+#pragma mark - Recording
+
+// Small stable id for the calling thread. Called with traceLock held.
+static int _trace_tid(void)
+{
+  pthread_t self = pthread_self();
+
+  int i;
+  for (i=0; i<threadCount; i++)
+    if (pthread_equal(threads[i], self))
+      return i;
+
+  if (threadCount == TRACE_MAX_THREADS)
+    return TRACE_MAX_THREADS - 1;
+
+  threads[threadCount] = self;
+  return threadCount++;
+}
+
+static void _trace_record(trace_event_t * e)
+{
+  pthread_mutex_lock(&traceLock);
+
+  if (eventCount == eventCapacity)
+  {
+    eventCapacity = MAX(eventCapacity * 2, 256);
+    events = realloc(events, eventCapacity * sizeof(trace_event_t));
+  }
+
+  e->tid = _trace_tid();
+  events[eventCount++] = *e;
+
+  pthread_mutex_unlock(&traceLock);
+}
+
+void trace_start(const char * jsonPath)
+{
+  tracePath = jsonPath;
+  traceEpoch = nowMicros();
+  traceEnabled = 1;
+  trace_setThreadName("main");
+}
+
+void trace_setThreadName(const char * name)
+{
+  if (!traceEnabled)
+    return;
+
+  pthread_mutex_lock(&traceLock);
+  int tid = _trace_tid();
+  free(threadNames[tid]);
+  threadNames[tid] = strdup(name);
+  pthread_mutex_unlock(&traceLock);
+}
+
+void trace_begin(trace_span_t * span, const char * name)
+{
+  span->name = name;
+  span->start = nowMicros();
+}
+
+void trace_end(trace_span_t * span, int status)
+{
+  if (!traceEnabled)
+    return;
+
+  trace_event_t e = { trace_kind_phase, span->name };
+  e.status = status;
+  e.start = span->start;
+  e.end = nowMicros();
+  _trace_record(&e);
+}
+
+void trace_transfer(trace_kind_t kind, uint8_t request, int length, int actual, int status,
+                    uint64_t start, uint64_t end)
+{
+  if (!traceEnabled)
+    return;
+
+  trace_event_t e = { kind, NULL };
+  e.request = request;
+  e.length = length;
+  e.actual = actual;
+  e.status = status;
+  e.start = start;
+  e.end = end;
+  _trace_record(&e);
+}
+
+void trace_retry(const char * name)
+{
+  if (!traceEnabled)
+    return;
+
+  trace_event_t e = { trace_kind_retry, name };
+  e.start = e.end = nowMicros();
+  _trace_record(&e);
+}
+
+#pragma mark - Reporting
+
+static const char * _trace_requestName(uint8_t request)
+{
+  switch (request)
+  {
+    case REQ_APP_RESET:   return "REQ_APP_RESET";
+    case REQ_INFO:        return "REQ_INFO";
+    case REQ_ERASE:       return "REQ_ERASE";
+    case REQ_START_WRITE: return "REQ_START_WRITE";
+    case REQ_CRC_APP:     return "REQ_CRC_APP";
+    case REQ_CRC_BOOT:    return "REQ_CRC_BOOT";
+    case REQ_RESET:       return "REQ_RESET";
+  }
+  return "REQ_?";
+}
+
+static const char * _trace_eventName(trace_event_t * e)
+{
+  switch (e->kind)
+  {
+    case trace_kind_control: return _trace_requestName(e->request);
+    case trace_kind_bulk:    return "bulk out";
+    default:                 return e->name;
+  }
+}
+
+static int _trace_compareDuration(const void * a, const void * b)
+{
+  uint64_t da = *(const uint64_t *)a, db = *(const uint64_t *)b;
+  return (da > db) - (da < db);
+}
+
+// One summary row for every event of +kind+ called +name+
+static void _trace_summarize(trace_kind_t kind, const char * name, uint64_t * scratch)
+{
+  int i, n = 0, errors = 0;
+  uint64_t total = 0, bytes = 0;
+
+  for (i=0; i<eventCount; i++)
+  {
+    trace_event_t * e = &events[i];
+    if (e->kind != kind || 0 != strcmp(_trace_eventName(e), name))
+      continue;
+
+    scratch[n++] = e->end - e->start;
+    total += e->end - e->start;
+    bytes += MAX(e->actual, 0);
+    if (e->status < 0)
+      errors++;
+  }
+
+  if (trace_kind_retry == kind)
+  {
+    printf("  %-18s %6d\n", name, n);
+    return;
+  }
+
+  qsort(scratch, n, sizeof(uint64_t), _trace_compareDuration);
+  printf("  %-18s %6d %10.2f %9.2f %9.2f %9.2f %9.2f %10llu %6d\n", name, n,
+    total / 1000.0, total / 1000.0 / n, scratch[n/2] / 1000.0, scratch[(n*99)/100] / 1000.0,
+    scratch[n-1] / 1000.0, (unsigned long long)bytes, errors);
+}
+
+// Summarize each distinct name of +kind+ in the order first seen
+static void _trace_summarizeKind(trace_kind_t kind, uint64_t * scratch)
+{
+  int i, j;
+  for (i=0; i<eventCount; i++)
+  {
+    if (events[i].kind != kind)
+      continue;
+
+    const char * name = _trace_eventName(&events[i]);
+    for (j=0; j<i; j++)
+      if (events[j].kind == kind && 0 == strcmp(_trace_eventName(&events[j]), name))
+        break;
+
+    if (j == i)
+      _trace_summarize(kind, name, scratch);
+  }
+}
+
+static int _trace_has(trace_kind_t kind)
+{
+  int i;
+  for (i=0; i<eventCount; i++)
+    if (events[i].kind == kind)
+      return 1;
+  return 0;
+}
+
+static void _trace_histogram(trace_kind_t kind, const char * title)
+{
+  int buckets[TRACE_HIST_BUCKETS] = { 0 };
+  int i, n = 0, most = 0;
+
+  for (i=0; i<eventCount; i++)
+  {
+    if (events[i].kind != kind)
+      continue;
+
+    uint64_t us = events[i].end - events[i].start;
+    int b = 0;
+    while (us > 1 && b < TRACE_HIST_BUCKETS - 1) { us >>= 1; b++; }
+
+    most = MAX(most, ++buckets[b]);
+    n++;
+  }
+
+  if (0 == n)
+    return;
+
+  int lo = 0, hi = TRACE_HIST_BUCKETS - 1;
+  while (0 == buckets[lo]) lo++;
+  while (0 == buckets[hi]) hi--;
+
+  printf("\n%s latency (%d transfers)\n", title, n);
+  for (i=lo; i<=hi; i++)
+  {
+    char bar[41];
+    int len = (buckets[i] * 40 + most - 1) / most;
+    memset(bar, '#', len);
+    bar[len] = '\0';
+    printf("  %8.3f ms  %6d  %s\n", (1ULL << i) / 1000.0, buckets[i], bar);
+  }
+}
+
+static void _trace_writeJSON(const char * path)
+{
+  FILE * f = fopen(path, "w");
+  if (NULL == f)
+  {
+    perror(CL_RED "Could not write trace" CL_RESET);
+    return;
+  }
+
+  fprintf(f, "{\"traceEvents\":[\n");
+
+  int i;
+  for (i=0; i<threadCount; i++)
+  {
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+      i, threadNames[i] ? threadNames[i] : "thread");
+  }
+
+  for (i=0; i<eventCount; i++)
+  {
+    trace_event_t * e = &events[i];
+    const char * cat = (trace_kind_phase == e->kind) ? "phase" :
+                       (trace_kind_retry == e->kind) ? "retry" : "usb";
+
+    if (trace_kind_retry == e->kind)
+      fprintf(f, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":1,\"tid\":%d}",
+        _trace_eventName(e), cat, (unsigned long long)(e->start - traceEpoch), e->tid);
+    else
+      fprintf(f, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":%d,"
+                 "\"args\":{\"length\":%d,\"actual\":%d,\"status\":%d}}",
+        _trace_eventName(e), cat, (unsigned long long)(e->start - traceEpoch),
+        (unsigned long long)(e->end - e->start), e->tid, e->length, e->actual, e->status);
+
+    fprintf(f, "%s\n", (i < eventCount - 1) ? "," : "");
+  }
+
+  fprintf(f, "]}\n");
+  fclose(f);
+
+  printf("Trace written to %s (%d events)\n", path, eventCount);
+}
+
+void trace_finish(void)
+{
+  if (!traceEnabled)
+    return;
+
+  pthread_mutex_lock(&traceLock);
+
+  uint64_t * scratch = malloc(MAX(eventCount, 1) * sizeof(uint64_t));
+
+  printf("\n  %-18s %6s %10s %9s %9s %9s %9s %10s %6s\n",
+    "", "count", "total ms", "mean", "p50", "p99", "max", "bytes", "errors");
+  printf("Phases\n");
+  _trace_summarizeKind(trace_kind_phase, scratch);
+  printf("Transfers\n");
+  _trace_summarizeKind(trace_kind_control, scratch);
+  _trace_summarizeKind(trace_kind_bulk, scratch);
+  printf("Retries\n");
+  _trace_summarizeKind(trace_kind_retry, scratch);
+  if (!_trace_has(trace_kind_retry))
+    printf("  none\n");
+
+  _trace_histogram(trace_kind_control, "Control");
+  _trace_histogram(trace_kind_bulk, "Bulk");
+
+  free(scratch);
+
+  if (tracePath)
+    _trace_writeJSON(tracePath);
+
+  traceEnabled = 0;
+  free(events);
+  events = NULL;
+  eventCount = eventCapacity = 0;
+
+  int i;
+  for (i=0; i<threadCount; i++)
+  {
+    free(threadNames[i]);
+    threadNames[i] = NULL;
+  }
+  threadCount = 0;
+
+  pthread_mutex_unlock(&traceLock);
+}
@@ -0,0 +1,52 @@
+//
+//  trace
+//
+//  Timing for the phases of a flash (enumerate, reattach, erase, write...) and
+//  every control and bulk transfer. Recording is off unless trace_start has been
+//  called; callers test traceEnabled before timing a transfer, so a disabled
+//  trace costs a branch. Phase spans are always stamped so their duration can
+//  be reported elsewhere.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdint.h>
+
+#ifndef trace_h
+#define trace_h
+
+typedef enum {
+  trace_kind_phase = 0,
+  trace_kind_control,
+  trace_kind_bulk,
+  trace_kind_retry,
+} trace_kind_t;
+
+typedef struct {
+  const char * name;
+  uint64_t start;
+} trace_span_t;
+
+extern int traceEnabled;
+
+// Start recording. With a +jsonPath+, trace_finish also writes Chrome
+// trace-event JSON there (load it in chrome://tracing or Perfetto).
+void trace_start(const char * jsonPath);
+
+// Print the summary and histogram, write the trace file and stop recording
+void trace_finish(void);
+
+// Name the calling thread in the trace, e.g. after the device it is flashing
+void trace_setThreadName(const char * name);
+
+// Phases. +name+ must outlive the trace; string literals are expected.
+void trace_begin(trace_span_t * span, const char * name);
+void trace_end(trace_span_t * span, int status);
+
+// A completed transfer. +request+ is the vendor request for control transfers.
+void trace_transfer(trace_kind_t kind, uint8_t request, int length, int actual, int status,
+                    uint64_t start, uint64_t end);
+
+// Something was attempted again, e.g. a REQ_INFO probe or libusb_open
+void trace_retry(const char * name);
+
+#endif
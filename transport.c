@@ -0,0 +1,185 @@
+//
+//  transport
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdlib.h>
+#include <string.h>
+
+#include "transport.h"
+#include "trace.h"
+#include "util.h"
+
+int transport_open(transport_t * t)
+{
+  return t->ops->open(t);
+}
+
+void transport_close(transport_t * t)
+{
+  t->ops->close(t);
+  t->ops->free(t);
+}
+
+void transport_setPolicy(transport_t * t, policy_t * policy)
+{
+  t->policy = policy;
+}
+
+void transport_setPolicyKey(transport_t * t, uint32_t key)
+{
+  t->policyKey = key;
+}
+
+// Report a finished control request to the trace and the policy
+static void _transport_didControl(transport_t * t, uint8_t request, uint16_t len, int status, uint64_t start)
+{
+  if (!traceEnabled && NULL == t->policy)
+    return;
+
+  uint64_t end = nowMicros();
+  if (traceEnabled)
+    trace_transfer(trace_kind_control, request, len, MAX(status, 0), MIN(status, 0), start, end);
+  policy_didControl(t->policy, t->policyKey, request, status, end - start);
+}
+
+int transport_controlIn(transport_t * t, uint8_t request, uint16_t value, uint16_t index,
+                        uint8_t * data, uint16_t len, unsigned int timeout)
+{
+  uint64_t start = (traceEnabled || t->policy) ? nowMicros() : 0;
+  timeout = policy_controlTimeout(t->policy, t->policyKey, request, timeout);
+  int status = t->ops->controlIn(t, request, value, index, data, len, timeout);
+
+  _transport_didControl(t, request, len, status, start);
+  return status;
+}
+
+int transport_controlOut(transport_t * t, uint8_t request, uint16_t value, uint16_t index,
+                         uint8_t * data, uint16_t len, unsigned int timeout)
+{
+  uint64_t start = (traceEnabled || t->policy) ? nowMicros() : 0;
+  timeout = policy_controlTimeout(t->policy, t->policyKey, request, timeout);
+  int status = t->ops->controlOut(t, request, value, index, data, len, timeout);
+
+  _transport_didControl(t, request, len, status, start);
+  return status;
+}
+
+int transport_bulkOut(transport_t * t, uint8_t * data, int len, int * transferred, unsigned int timeout)
+{
+  uint64_t start = (traceEnabled || t->policy) ? nowMicros() : 0;
+  timeout = policy_bulkTimeout(t->policy, t->policyKey, len, timeout);
+  *transferred = 0;
+  int status = t->ops->bulkOut(t, data, len, transferred, timeout);
+
+  if (traceEnabled)
+    trace_transfer(trace_kind_bulk, 0, len, *transferred, status, start, nowMicros());
+  if (t->policy)
+    policy_didBulk(t->policy, t->policyKey, len, status, nowMicros() - start);
+  return status;
+}
+
+transport_transfer_t * transport_allocTransfer(transport_t * t, arena_t * arena)
+{
+  transport_transfer_t * xfer = arena_malloc(arena, sizeof(transport_transfer_t));
+  if (NULL == xfer)
+    return NULL;
+  memset(xfer, '\0', sizeof(*xfer));
+  xfer->arena = arena;
+  xfer->transport = t;
+
+  if (t->ops->allocTransfer(t, xfer) < 0)
+  {
+    arena_free(arena, xfer);
+    return NULL;
+  }
+  return xfer;
+}
+
+size_t transport_transferArenaSize(transport_t * t)
+{
+  return ARENA_SIZEOF(sizeof(transport_transfer_t)) + t->ops->transferSize;
+}
+
+void transport_freeTransfer(transport_t * t, transport_transfer_t * xfer)
+{
+  if (NULL == xfer)
+    return;
+
+  t->ops->freeTransfer(t, xfer);
+  arena_free(xfer->arena, xfer);
+}
+
+// A queued transfer waits for everything ahead of it, so its timeout and latency
+// are for all the bytes in flight. Completions can run on whichever thread is
+// handling the session's libusb events, hence the atomics.
+int transport_submit(transport_t * t, transport_transfer_t * xfer)
+{
+  xfer->control = 0;
+  xfer->status = 0;
+  xfer->actualLength = 0;
+  xfer->queuedBytes = __sync_add_and_fetch(&t->bulkQueued, xfer->length);
+  xfer->timeout = policy_bulkTimeout(t->policy, t->policyKey, xfer->queuedBytes, xfer->timeout);
+  xfer->submitted = (traceEnabled || t->policy) ? nowMicros() : 0;
+
+  int status = t->ops->submit(t, xfer);
+  if (status < 0)
+    __sync_sub_and_fetch(&t->bulkQueued, xfer->length);
+  return status;
+}
+
+int transport_submitControlIn(transport_t * t, transport_transfer_t * xfer, uint8_t request,
+                              uint16_t value, uint16_t index, int len, unsigned int timeout)
+{
+  xfer->control = 1;
+  xfer->request = request;
+  xfer->value = value;
+  xfer->index = index;
+  xfer->length = len;
+  xfer->timeout = policy_controlTimeout(t->policy, t->policyKey, request, timeout);
+  xfer->status = 0;
+  xfer->actualLength = 0;
+  xfer->submitted = (traceEnabled || t->policy) ? nowMicros() : 0;
+  return t->ops->submitControl(t, xfer);
+}
+
+void transport_complete(transport_transfer_t * xfer)
+{
+  transport_t * t = xfer->transport;
+  if (!xfer->control)
+    __sync_sub_and_fetch(&t->bulkQueued, xfer->length);
+
+  if (t->policy && xfer->control)
+    policy_didControl(t->policy, t->policyKey, xfer->request, xfer->status, nowMicros() - xfer->submitted);
+  else if (t->policy)
+    policy_didBulk(t->policy, t->policyKey, xfer->queuedBytes, xfer->status, nowMicros() - xfer->submitted);
+
+  if (traceEnabled && xfer->control)
+    trace_transfer(trace_kind_control, xfer->request, xfer->length, xfer->actualLength, xfer->status,
+                   xfer->submitted, nowMicros());
+  else if (traceEnabled)
+    trace_transfer(trace_kind_bulk, 0, xfer->length, xfer->actualLength, xfer->status, 
+                   xfer->submitted, nowMicros());
+
+  xfer->callback(xfer);
+}
+
+int transport_cancel(transport_t * t, transport_transfer_t * xfer)
+{
+  return t->ops->cancel(t, xfer);
+}
+
+int transport_handleEvents(transport_t * t, int * completed)
+{
+  return t->ops->handleEvents(t, completed);
+}
+
+int transport_pollEvents(transport_t * t)
+{
+  return t->ops->pollEvents(t);
+}
+
+int transport_nextTimeout(transport_t * t, uint64_t * micros)
+{
+  return t->ops->nextTimeout(t, micros);
+}
@@ -0,0 +1,134 @@
+//
+//  transport
+//
+//  What the bootloader code needs from the wire: vendor control requests, bulk
+//  OUT (blocking or queued) and an event loop for queued transfers. Backends are
+//  libusb (transport_usb.c) and an in-process simulated XMEGA (transport_sim.c).
+//
+//  Status codes are libusb's (0 or a positive byte count on success, a negative
+//  LIBUSB_ERROR_* on failure) whichever backend is in use.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdint.h>
+#include <libusb.h>
+#include "arena.h"
+#include "policy.h"
+
+#ifndef transport_h
+#define transport_h
+
+typedef struct transport_s transport_t;
+typedef struct transport_transfer_s transport_transfer_t;
+
+typedef void transport_callback(transport_transfer_t *);
+
+// A queued bulk OUT transfer
+struct transport_transfer_s {
+  uint8_t * buf;
+  int length;
+  unsigned int timeout;
+  transport_callback * callback;
+  void * context;
+
+  // Set before the callback runs
+  int status;
+  int actualLength;
+
+  // Set for a vendor control IN request (transport_submitControlIn); the reply
+  // goes to buf, at most length bytes
+  int control;
+  uint8_t request;
+  uint16_t value;
+  uint16_t index;
+
+  void * backend;
+  uint64_t submitted;   // For tracing and the policy
+  int queuedBytes;      // Bulk bytes in flight when submitted, this transfer's included
+  transport_t * transport;
+  arena_t * arena;      // Where this was allocated; NULL for the heap
+
+};
+
+typedef struct {
+  const char * name;
+
+  int  (*open)(transport_t *);
+  void (*close)(transport_t *);
+
+  int  (*controlIn)(transport_t *, uint8_t request, uint16_t value, uint16_t index,
+                    uint8_t * data, uint16_t len, unsigned int timeout);
+  int  (*controlOut)(transport_t *, uint8_t request, uint16_t value, uint16_t index,
+                     uint8_t * data, uint16_t len, unsigned int timeout);
+  int  (*bulkOut)(transport_t *, uint8_t * data, int len, int * transferred, unsigned int timeout);
+
+  int  (*allocTransfer)(transport_t *, transport_transfer_t *);
+  void (*freeTransfer)(transport_t *, transport_transfer_t *);
+  int  (*submit)(transport_t *, transport_transfer_t *);
+  int  (*cancel)(transport_t *, transport_transfer_t *);
+  int  (*handleEvents)(transport_t *, int * completed);
+  int  (*submitControl)(transport_t *, transport_transfer_t *);
+  int  (*pollEvents)(transport_t *);
+  int  (*nextTimeout)(transport_t *, uint64_t * micros);
+
+  void (*free)(transport_t *);
+
+  size_t transferSize;  // Arena bytes allocTransfer takes, for the backend's own state
+} transport_ops_t;
+
+struct transport_s {
+  const transport_ops_t * ops;
+  void * priv;
+  policy_t * policy;    // NULL for the callers' timeouts as given
+  uint32_t policyKey;
+  int bulkQueued;       // Bytes submitted and not yet completed
+};
+
+// Backends
+transport_t * transport_usbFromHandle(libusb_context * usbContext, libusb_device_handle * devHandle);
+transport_t * transport_simNew(const char * config);
+
+// Learn timeouts with +policy+ (policy.h), which must outlive the transport. The
+// timeouts callers pass become upper limits.
+void transport_setPolicy(transport_t * t, policy_t * policy);
+
+// What kind of part this is for the policy; the memory size, once it's known
+void transport_setPolicyKey(transport_t * t, uint32_t key);
+
+// Claim / release the device. transport_close also frees the transport.
+int  transport_open(transport_t * t);
+void transport_close(transport_t * t);
+
+// Vendor requests on the default control pipe
+int transport_controlIn(transport_t * t, uint8_t request, uint16_t value, uint16_t index,
+                        uint8_t * data, uint16_t len, unsigned int timeout);
+int transport_controlOut(transport_t * t, uint8_t request, uint16_t value, uint16_t index,
+                         uint8_t * data, uint16_t len, unsigned int timeout);
+
+// Bulk OUT on the bootloader's data endpoint
+int transport_bulkOut(transport_t * t, uint8_t * data, int len, int * transferred, unsigned int timeout);
+
+// Queued bulk OUT. Callbacks run from transport_handleEvents, which blocks until
+// at least one event has been handled or *completed is set.
+// From +arena+ when given, or NULL when it's full; transport_transferArenaSize
+// is what each takes from it
+transport_transfer_t * transport_allocTransfer(transport_t * t, arena_t * arena);
+size_t transport_transferArenaSize(transport_t * t);
+void transport_freeTransfer(transport_t * t, transport_transfer_t * xfer);
+int  transport_submit(transport_t * t, transport_transfer_t * xfer);
+int  transport_cancel(transport_t * t, transport_transfer_t * xfer);
+int  transport_handleEvents(transport_t * t, int * completed);
+
+// For callers running their own event loop (see machine.h): a control IN request
+// queued like a bulk transfer, event handling that never blocks, and how long until
+// the backend next needs transport_pollEvents regardless of its descriptors.
+// transport_nextTimeout returns 1 with *micros set, or 0 if nothing is pending.
+int  transport_submitControlIn(transport_t * t, transport_transfer_t * xfer, uint8_t request,
+                               uint16_t value, uint16_t index, int len, unsigned int timeout);
+int  transport_pollEvents(transport_t * t);
+int  transport_nextTimeout(transport_t * t, uint64_t * micros);
+
+// For backends: report a queued transfer's status and actualLength to its owner
+void transport_complete(transport_transfer_t * xfer);
+
+#endif
@@ -0,0 +1,574 @@
+//
+//  transport_sim
+//
+//  A software XMEGA bootloader behind transport_t, for running and timing the
+//  flash path without hardware. It answers REQ_INFO, REQ_ERASE, REQ_START_WRITE,
+//  REQ_CRC_APP, REQ_CRC_BOOT and REQ_RESET against an emulated flash array, and
+//  delays each request according to a simple latency/throughput model.
+//
+//  The config string is a part name optionally followed by settings:
+//
+//    128a4u,ctl=0.2,latency=1,kbps=500,erase=30,page=256
+//
+//    ctl      Milliseconds per control request
+//    latency  Milliseconds of turnaround per bulk transfer. Overlaps with the
+//             previous transfer's data phase when transfers are queued.
+//    kbps     Bulk throughput in KB/s, page programming included
+//    erase    Milliseconds for REQ_ERASE
+//    page     Page size override
+//    load     Hex file the application section holds at power-up
+//    glitch   Lose bulk transfer n (counting from 1), once: it times out
+//    hang     Stop answering anything after bulk transfer n, as a dead board
+//
+//  Timeouts are enforced against the model: a request or transfer the device
+//  would take longer over than its timeout, counted from submission as libusb
+//  does, fails with LIBUSB_ERROR_TIMEOUT and changes nothing.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "transport.h"
+#include "bootloader.h"
+#include "crc.h"
+#include "image.h"
+#include "util.h"
+#include "colors.h"
+
+extern int verbose;
+
+#define SIM_BOOT_SIZE   (8*1024)
+#define SIM_MAX_QUEUED  64
+
+typedef struct {
+  const char * name;
+  uint8_t part[4];
+  uint32_t appSize;
+} sim_part_t;
+
+static const sim_part_t simParts[] = {
+  { "16a4u",  { 0x1e, 0x94, 0x41, 0 },  16*1024 },
+  { "32a4u",  { 0x1e, 0x95, 0x41, 0 },  32*1024 },
+  { "64a4u",  { 0x1e, 0x96, 0x46, 0 },  64*1024 },
+  { "128a4u", { 0x1e, 0x97, 0x46, 0 }, 128*1024 },
+};
+
+typedef struct {
+  bootloader_info_t info;
+  uint8_t * flash;
+  uint8_t boot[SIM_BOOT_SIZE];
+  uint32_t appSize;
+  int reset;          // The device has left the bus
+
+  // Write stream
+  uint32_t writeAddr;
+
+  // Timing model
+  double controlMs;
+  double latencyMs;
+  double kbps;
+  double eraseMs;
+  uint64_t busyUntil;  // When the bulk pipe finishes what it has been given
+
+  // Faults
+  int glitchAt;
+  int hangAfter;
+  int hung;
+  int bulkSubmitted;
+
+  // Queued transfers, completed as they fall due
+  transport_transfer_t * queue[SIM_MAX_QUEUED];
+  uint64_t due[SIM_MAX_QUEUED];
+  int lost[SIM_MAX_QUEUED];   // Times out at +due+ instead of completing
+  int queued;
+
+  // Stats
+  uint32_t bytesWritten;
+  int controlRequests;
+  int bulkTransfers;
+} sim_priv_t;
+
+static void _sim_sleepUntil(uint64_t when)
+{
+  uint64_t now = nowMicros();
+  if (when > now)
+    usleep(when - now);
+}
+
+static void _sim_delay(double ms)
+{
+  if (ms > 0)
+    usleep((useconds_t)(ms * 1000));
+}
+
+#pragma mark - Device
+
+// A word at a time, as the NVM controller does it, rather than through the tables
+// the flasher uses, so the two are checked against each other on every flash
+static uint32_t _sim_crc(const uint8_t * data, uint32_t len)
+{
+  crc_t c;
+  crc_init(&c);
+
+  uint32_t i;
+  for (i=0; i+1<len; i+=2)
+    crc_updateWord(&c, data[i] | data[i+1] << 8);
+  return c.crc;
+}
+
+// Answer a request, without the delay
+static int _sim_answer(sim_priv_t * p, uint8_t request, uint16_t value, uint16_t index,
+                       uint8_t * data, uint16_t len)
+{
+  uint32_t crc;
+
+  if (p->reset)
+    return LIBUSB_ERROR_NO_DEVICE;
+
+  switch (request)
+  {
+    case REQ_INFO:
+      len = MIN(len, (uint16_t)sizeof(p->info));
+      memcpy(data, &p->info, len);
+      return len;
+
+    case REQ_ERASE:
+      memset(p->flash, 0xff, p->appSize);
+      return 0;
+
+    case REQ_START_WRITE:
+      p->writeAddr = index * p->info.pagesize;
+      return 0;
+
+    case REQ_CRC_APP:
+    case REQ_CRC_BOOT:
+      crc = (REQ_CRC_APP == request) ? _sim_crc(p->flash, p->appSize) : _sim_crc(p->boot, SIM_BOOT_SIZE);
+      len = MIN(len, 4);
+      memcpy(data, &crc, len);
+      return len;
+
+    case REQ_RESET:
+      p->reset = 1;
+      return 0;
+
+    default:
+      return LIBUSB_ERROR_PIPE;
+  }
+}
+
+// How long the device takes over +request+
+static double _sim_requestMs(sim_priv_t * p, uint8_t request)
+{
+  return p->controlMs + ((REQ_ERASE == request) ? p->eraseMs : 0);
+}
+
+static int _sim_request(transport_t * t, uint8_t request, uint16_t value, uint16_t index,
+                        uint8_t * data, uint16_t len, unsigned int timeout)
+{
+  sim_priv_t * p = t->priv;
+
+  if (p->reset)
+    return LIBUSB_ERROR_NO_DEVICE;
+  if (p->hung)
+  {
+    _sim_delay(timeout);
+    return LIBUSB_ERROR_TIMEOUT;
+  }
+
+  p->controlRequests++;
+  if (timeout && _sim_requestMs(p, request) > timeout)
+  {
+    _sim_delay(timeout);
+    return LIBUSB_ERROR_TIMEOUT;
+  }
+  _sim_delay(_sim_requestMs(p, request));
+  return _sim_answer(p, request, value, index, data, len);
+}
+
+// Program received bytes. Like real flash, writing can only clear bits.
+static int _sim_program(sim_priv_t * p, const uint8_t * data, int len)
+{
+  if (p->reset)
+    return LIBUSB_ERROR_NO_DEVICE;
+
+  if (p->writeAddr + len > p->appSize)
+    return LIBUSB_ERROR_OVERFLOW;
+
+  int i;
+  for (i=0; i<len; i++)
+    p->flash[p->writeAddr + i] &= data[i];
+
+  p->writeAddr += len;
+  p->bytesWritten += len;
+  p->bulkTransfers++;
+  return 0;
+}
+
+// Whether the next bulk transfer is lost to an injected fault
+static int _sim_loseBulk(sim_priv_t * p)
+{
+  p->bulkSubmitted++;
+  int lost = p->hung || p->bulkSubmitted == p->glitchAt;
+  if (p->bulkSubmitted == p->hangAfter)
+    p->hung = 1;
+  return lost;
+}
+
+// When a bulk transfer of +len+ bytes submitted now would finish. One that would
+// outlast +timeout+ ms is cut off at its deadline: *timedOut is set and the pipe
+// is only busy until then.
+static uint64_t _sim_schedule(sim_priv_t * p, int len, unsigned int timeout, int * timedOut)
+{
+  uint64_t now = nowMicros();
+  uint64_t start = MAX(now + (uint64_t)(p->latencyMs * 1000), p->busyUntil);
+  uint64_t done = start + (uint64_t)(len / (p->kbps * 1024) * 1e6);
+
+  *timedOut = (timeout && done > now + timeout * 1000ULL);
+  if (*timedOut)
+    done = now + timeout * 1000ULL;
+  p->busyUntil = MAX(p->busyUntil, done);
+  return done;
+}
+
+#pragma mark - Transport
+
+static int _sim_open(transport_t * t)
+{
+  return 0;
+}
+
+static void _sim_close(transport_t * t)
+{
+  sim_priv_t * p = t->priv;
+
+  if (verbose > 0)
+    printf("Simulator: %d control requests, %d bulk transfers, %d bytes programmed\n",
+      p->controlRequests, p->bulkTransfers, p->bytesWritten);
+}
+
+static int _sim_controlIn(transport_t * t, uint8_t request, uint16_t value, uint16_t index,
+                          uint8_t * data, uint16_t len, unsigned int timeout)
+{
+  return _sim_request(t, request, value, index, data, len, timeout);
+}
+
+static int _sim_controlOut(transport_t * t, uint8_t request, uint16_t value, uint16_t index,
+                           uint8_t * data, uint16_t len, unsigned int timeout)
+{
+  return _sim_request(t, request, value, index, data, len, timeout);
+}
+
+static int _sim_bulkOut(transport_t * t, uint8_t * data, int len, int * transferred, unsigned int timeout)
+{
+  sim_priv_t * p = t->priv;
+
+  if (_sim_loseBulk(p))
+  {
+    _sim_delay(timeout);
+    *transferred = 0;
+    return LIBUSB_ERROR_TIMEOUT;
+  }
+
+  int timedOut;
+  _sim_sleepUntil(_sim_schedule(p, len, timeout, &timedOut));
+  if (timedOut)
+  {
+    *transferred = 0;
+    return LIBUSB_ERROR_TIMEOUT;
+  }
+
+  int status = _sim_program(p, data, len);
+  *transferred = (status < 0) ? 0 : len;
+  return status;
+}
+
+static int _sim_allocTransfer(transport_t * t, transport_transfer_t * xfer)
+{
+  return 0;
+}
+
+static void _sim_freeTransfer(transport_t * t, transport_transfer_t * xfer)
+{
+}
+
+static int _sim_submit(transport_t * t, transport_transfer_t * xfer)
+{
+  sim_priv_t * p = t->priv;
+
+  if (p->reset)
+    return LIBUSB_ERROR_NO_DEVICE;
+  if (p->queued == SIM_MAX_QUEUED)
+    return LIBUSB_ERROR_BUSY;
+
+  // A lost transfer holds up the ones behind it until it times out
+  int timedOut = 1;
+  if (_sim_loseBulk(p))
+    p->due[p->queued] = nowMicros() + xfer->timeout * 1000ULL;
+  else
+    p->due[p->queued] = _sim_schedule(p, xfer->length, xfer->timeout, &timedOut);
+  p->lost[p->queued] = timedOut;
+  p->queue[p->queued++] = xfer;
+  return 0;
+}
+
+// Take queued transfer +i+ off the queue and report +status+, programming its data if it succeeded
+static void _sim_complete(sim_priv_t * p, int i, int status)
+{
+  transport_transfer_t * xfer = p->queue[i];
+  if (0 == status && p->lost[i])
+    status = LIBUSB_ERROR_TIMEOUT;
+
+  p->queued--;
+  memmove(&p->queue[i], &p->queue[i+1], (p->queued - i) * sizeof(p->queue[0]));
+  memmove(&p->due[i], &p->due[i+1], (p->queued - i) * sizeof(p->due[0]));
+  memmove(&p->lost[i], &p->lost[i+1], (p->queued - i) * sizeof(p->lost[0]));
+
+  if (xfer->control)
+  {
+    if (0 == status)
+      status = _sim_answer(p, xfer->request, xfer->value, xfer->index, xfer->buf, xfer->length);
+    xfer->status = MIN(status, 0);
+    xfer->actualLength = MAX(status, 0);
+    transport_complete(xfer);
+    return;
+  }
+
+  if (0 == status)
+    status = _sim_program(p, xfer->buf, xfer->length);
+
+  xfer->status = status;
+  xfer->actualLength = (status < 0) ? 0 : xfer->length;
+  transport_complete(xfer);
+}
+
+static int _sim_cancel(transport_t * t, transport_transfer_t * xfer)
+{
+  sim_priv_t * p = t->priv;
+
+  int i;
+  for (i=0; i<p->queued; i++)
+  {
+    if (p->queue[i] == xfer)
+    {
+      _sim_complete(p, i, LIBUSB_ERROR_INTERRUPTED);
+      return 0;
+    }
+  }
+  return LIBUSB_ERROR_NOT_FOUND;
+}
+
+// When the next queued transfer falls due. A timeout can fire before transfers 
+// queued ahead of it finish.
+static uint64_t _sim_nextDue(sim_priv_t * p)
+{
+  uint64_t due = p->due[0];
+  int i;
+  for (i=1; i<p->queued; i++)
+    due = MIN(due, p->due[i]);
+  return due;
+}
+
+// Complete everything that is due, in submission order
+static void _sim_completeDue(sim_priv_t * p)
+{
+  uint64_t now = nowMicros();
+  int i = 0;
+  while (i < p->queued)
+  {
+    if (p->due[i] <= now)
+      _sim_complete(p, i, 0);
+    else
+      i++;
+  }
+}
+
+static int _sim_handleEvents(transport_t * t, int * completed)
+{
+  sim_priv_t * p = t->priv;
+
+  if (0 == p->queued)
+    return 0;
+
+  _sim_sleepUntil(_sim_nextDue(p));
+  _sim_completeDue(p);
+  return 0;
+}
+
+// Control requests queue behind bulk data, as they would on the device
+static int _sim_submitControl(transport_t * t, transport_transfer_t * xfer)
+{
+  sim_priv_t * p = t->priv;
+
+  if (p->reset)
+    return LIBUSB_ERROR_NO_DEVICE;
+  if (p->queued == SIM_MAX_QUEUED)
+    return LIBUSB_ERROR_BUSY;
+
+  p->controlRequests++;
+  uint64_t now = nowMicros();
+  uint64_t deadline = now + xfer->timeout * 1000ULL;
+  uint64_t done = MAX(now, p->busyUntil) + (uint64_t)(_sim_requestMs(p, xfer->request) * 1000);
+
+  p->lost[p->queued] = p->hung || (xfer->timeout && done > deadline);
+  if (p->lost[p->queued])
+  {
+    p->due[p->queued] = deadline;
+  }
+  else
+  {
+    p->busyUntil = done;
+    p->due[p->queued] = done;
+  }
+  p->queue[p->queued++] = xfer;
+  return 0;
+}
+
+static int _sim_pollEvents(transport_t * t)
+{
+  sim_priv_t * p = t->priv;
+
+  _sim_completeDue(p);
+  return 0;
+}
+
+static int _sim_nextTimeout(transport_t * t, uint64_t * micros)
+{
+  sim_priv_t * p = t->priv;
+
+  if (0 == p->queued)
+    return 0;
+
+  uint64_t now = nowMicros();
+  uint64_t due = _sim_nextDue(p);
+  *micros = (due > now) ? due - now : 0;
+  return 1;
+}
+
+static void _sim_free(transport_t * t)
+{
+  sim_priv_t * p = t->priv;
+  free(p->flash);
+  free(p);
+  free(t);
+}
+
+static const transport_ops_t simOps = {
+  "sim",
+  _sim_open,
+  _sim_close,
+  _sim_controlIn,
+  _sim_controlOut,
+  _sim_bulkOut,
+  _sim_allocTransfer,
+  _sim_freeTransfer,
+  _sim_submit,
+  _sim_cancel,
+  _sim_handleEvents,
+  _sim_submitControl,
+  _sim_pollEvents,
+  _sim_nextTimeout,
+  _sim_free,
+  0,
+};
+
+#pragma mark - Setup
+
+transport_t * transport_simNew(const char * config)
+{
+  char * copy = strdup(config ? config : "");
+  char * save = NULL;
+  char * name = strtok_r(copy, ",", &save);
+
+  const sim_part_t * part = &simParts[3];
+  if (name && *name)
+  {
+    if (0 == strncasecmp(name, "atxmega", 7))
+      name += 7;
+
+    int i;
+    part = NULL;
+    for (i=0; i<(int)(sizeof(simParts)/sizeof(simParts[0])); i++)
+      if (0 == strcasecmp(name, simParts[i].name))
+        part = &simParts[i];
+
+    if (NULL == part)
+    {
+      printf(CL_RED "Unknown simulated part %s\n" CL_RESET, name);
+      free(copy);
+      return NULL;
+    }
+  }
+
+  sim_priv_t * p = malloc(sizeof(sim_priv_t));
+  memset(p, '\0', sizeof(*p));
+  p->controlMs = 0.2;
+  p->latencyMs = 1.0;
+  p->kbps      = 500;
+  p->eraseMs   = 30;
+
+  memcpy(p->info.magic, "XSIM", 4);
+  p->info.version  = 1;
+  memcpy(p->info.part, part->part, 4);
+  p->info.pagesize = BOOTLOADER_DEFAULT_PAGESIZE;
+  p->info.memsize  = part->appSize - 1;
+  p->info.jumpaddr = part->appSize;
+  strncpy((char *)p->info.hw_prod, "xflash-sim", sizeof(p->info.hw_prod) - 1);
+  strncpy((char *)p->info.hw_ver, "1", sizeof(p->info.hw_ver) - 1);
+
+  // Settings
+  char * load = NULL;
+  char * opt;
+  while ((opt = strtok_r(NULL, ",", &save)))
+  {
+    char * value = strchr(opt, '=');
+    if (NULL == value)
+      continue;
+    *value++ = '\0';
+
+    if      (0 == strcmp(opt, "ctl"))     p->controlMs = atof(value);
+    else if (0 == strcmp(opt, "latency")) p->latencyMs = atof(value);
+    else if (0 == strcmp(opt, "kbps"))    p->kbps      = MAX(atof(value), 1);
+    else if (0 == strcmp(opt, "erase"))   p->eraseMs   = atof(value);
+    else if (0 == strcmp(opt, "page"))    p->info.pagesize = atoi(value);
+    else if (0 == strcmp(opt, "load"))    load = value;
+    else if (0 == strcmp(opt, "glitch"))  p->glitchAt  = atoi(value);
+    else if (0 == strcmp(opt, "hang"))    p->hangAfter = atoi(value);
+    else
+      printf(CL_YELLOW "Ignoring simulator setting %s\n" CL_RESET, opt);
+  }
+
+  p->appSize = part->appSize;
+  p->flash = malloc(p->appSize);
+  memset(p->flash, 0xff, p->appSize);
+  memset(p->boot, 0xff, sizeof(p->boot));
+
+  if (load)
+  {
+    ihex_t * hex = ihex_fromPath(load);
+    if (hex)
+    {
+      image_t * image = image_fromHex(hex);
+      if (image)
+        image_read(image, 0, p->flash, p->appSize);
+      image_free(image);
+      ihex_free(hex);
+    }
+  }
+  free(copy);
+
+  if (verbose > 0)
+    printf("Simulating %s: %d byte pages; ctl %.2f ms, bulk %.2f ms + %.0f KB/s, erase %.0f ms\n",
+      part->name, p->info.pagesize, p->controlMs, p->latencyMs, p->kbps, p->eraseMs);
+
+  transport_t * t = malloc(sizeof(transport_t));
+  t->ops = &simOps;
+  t->priv = p;
+  t->policy = NULL;
+  t->policyKey = 0;
+  t->bulkQueued = 0;
+  return t;
+}
@@ -0,0 +1,236 @@
+//
+//  transport_usb
+//
+//  libusb backend for transport_t.
+//
+//  A queued transfer's state, control setup buffer included, comes from its
+//  arena, so nothing here allocates per request. libusb itself still does:
+//  libusb_alloc_transfer takes its transfer from the heap, and so does every
+//  synchronous libusb_control_transfer and libusb_bulk_transfer internally.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "transport.h"
+#include "util.h"
+#include "colors.h"
+
+extern int verbose;
+
+#define BULK_OUT_EP (LIBUSB_ENDPOINT_OUT | 0x01)
+#define USB_CONTROL_MAX 64    // The longest reply the bootloader sends (REQ_INFO)
+
+typedef struct {
+  libusb_context * usbContext;
+  libusb_device_handle * devHandle;
+  int claimed;
+} usb_priv_t;
+
+static int _usb_open(transport_t * t)
+{
+  usb_priv_t * p = t->priv;
+  int status;
+
+  // Set Configuration
+  status = libusb_set_configuration(p->devHandle, 1);
+  if (status != 0)
+    printf(CL_RED "libusb_set_configuration failed: %d\n" CL_RESET, status);
+
+  // Claim the bulk interface
+  status = libusb_claim_interface(p->devHandle, 0);
+  if (status != 0)
+  {
+    printf(CL_RED "libusb_claim_interface failed: %d\n" CL_RESET, status);
+    return status;
+  }
+
+  p->claimed = 1;
+  return 0;
+}
+
+static void _usb_close(transport_t * t)
+{
+  usb_priv_t * p = t->priv;
+
+  if (p->claimed)
+    libusb_release_interface(p->devHandle, 0);
+  p->claimed = 0;
+
+  libusb_close(p->devHandle);
+  p->devHandle = NULL;
+}
+
+static int _usb_controlIn(transport_t * t, uint8_t request, uint16_t value, uint16_t index,
+                          uint8_t * data, uint16_t len, unsigned int timeout)
+{
+  usb_priv_t * p = t->priv;
+  return libusb_control_transfer(p->devHandle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN,
+                                 request, value, index, data, len, timeout);
+}
+
+static int _usb_controlOut(transport_t * t, uint8_t request, uint16_t value, uint16_t index,
+                           uint8_t * data, uint16_t len, unsigned int timeout)
+{
+  usb_priv_t * p = t->priv;
+  return libusb_control_transfer(p->devHandle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT,
+                                 request, value, index, data, len, timeout);
+}
+
+static int _usb_bulkOut(transport_t * t, uint8_t * data, int len, int * transferred, unsigned int timeout)
+{
+  usb_priv_t * p = t->priv;
+  return libusb_bulk_transfer(p->devHandle, BULK_OUT_EP, data, len, transferred, timeout);
+}
+
+#pragma mark - Queued transfers
+
+// Behind transport_transfer_t.backend
+typedef struct {
+  struct libusb_transfer * transfer;
+  uint8_t control[LIBUSB_CONTROL_SETUP_SIZE + USB_CONTROL_MAX];
+} usb_transfer_t;
+
+static void LIBUSB_CALL _usb_didTransfer(struct libusb_transfer * transfer)
+{
+  transport_transfer_t * xfer = transfer->user_data;
+
+  switch (transfer->status)
+  {
+    case LIBUSB_TRANSFER_COMPLETED: xfer->status = 0;                         break;
+    case LIBUSB_TRANSFER_TIMED_OUT: xfer->status = LIBUSB_ERROR_TIMEOUT;      break;
+    case LIBUSB_TRANSFER_STALL:     xfer->status = LIBUSB_ERROR_PIPE;         break;
+    case LIBUSB_TRANSFER_NO_DEVICE: xfer->status = LIBUSB_ERROR_NO_DEVICE;    break;
+    case LIBUSB_TRANSFER_OVERFLOW:  xfer->status = LIBUSB_ERROR_OVERFLOW;     break;
+    case LIBUSB_TRANSFER_CANCELLED: xfer->status = LIBUSB_ERROR_INTERRUPTED;  break;
+    default:                        xfer->status = LIBUSB_ERROR_IO;           break;
+  }
+  xfer->actualLength = transfer->actual_length;
+
+  // Control replies follow the setup packet
+  if (xfer->control)
+  {
+    memcpy(xfer->buf, libusb_control_transfer_get_data(transfer), MIN(xfer->actualLength, xfer->length));
+  }
+
+  transport_complete(xfer);
+}
+
+static int _usb_allocTransfer(transport_t * t, transport_transfer_t * xfer)
+{
+  usb_transfer_t * ut = arena_malloc(xfer->arena, sizeof(usb_transfer_t));
+  if (NULL == ut)
+    return LIBUSB_ERROR_NO_MEM;
+
+  ut->transfer = libusb_alloc_transfer(0);
+  if (NULL == ut->transfer)
+  {
+    arena_free(xfer->arena, ut);
+    return LIBUSB_ERROR_NO_MEM;
+  }
+  xfer->backend = ut;
+  return 0;
+}
+
+static void _usb_freeTransfer(transport_t * t, transport_transfer_t * xfer)
+{
+  usb_transfer_t * ut = xfer->backend;
+  libusb_free_transfer(ut->transfer);
+  arena_free(xfer->arena, ut);
+  xfer->backend = NULL;
+}
+
+static int _usb_submit(transport_t * t, transport_transfer_t * xfer)
+{
+  usb_priv_t * p = t->priv;
+  usb_transfer_t * ut = xfer->backend;
+  libusb_fill_bulk_transfer(ut->transfer, p->devHandle, BULK_OUT_EP, xfer->buf, xfer->length,
+                            _usb_didTransfer, xfer, xfer->timeout);
+  return libusb_submit_transfer(ut->transfer);
+}
+
+static int _usb_cancel(transport_t * t, transport_transfer_t * xfer)
+{
+  usb_transfer_t * ut = xfer->backend;
+  return libusb_cancel_transfer(ut->transfer);
+}
+
+static int _usb_handleEvents(transport_t * t, int * completed)
+{
+  usb_priv_t * p = t->priv;
+  return libusb_handle_events_completed(p->usbContext, completed);
+}
+
+static int _usb_submitControl(transport_t * t, transport_transfer_t * xfer)
+{
+  usb_priv_t * p = t->priv;
+  usb_transfer_t * ut = xfer->backend;
+  if (xfer->length > USB_CONTROL_MAX)
+    return LIBUSB_ERROR_INVALID_PARAM;
+
+  libusb_fill_control_setup(ut->control, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN, xfer->request,
+                            xfer->value, xfer->index, xfer->length);
+  libusb_fill_control_transfer(ut->transfer, p->devHandle, ut->control, _usb_didTransfer, xfer, xfer->timeout);
+  return libusb_submit_transfer(ut->transfer);
+}
+
+// libusb's descriptors are the caller's to poll; this only handles what's ready
+static int _usb_pollEvents(transport_t * t)
+{
+  usb_priv_t * p = t->priv;
+  struct timeval zero = { 0, 0 };
+  return libusb_handle_events_timeout_completed(p->usbContext, &zero, NULL);
+}
+
+static int _usb_nextTimeout(transport_t * t, uint64_t * micros)
+{
+  usb_priv_t * p = t->priv;
+  struct timeval tv;
+  int status = libusb_get_next_timeout(p->usbContext, &tv);
+  if (1 == status)
+    *micros = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+  return MAX(status, 0);
+}
+
+static void _usb_free(transport_t * t)
+{
+  free(t->priv);
+  free(t);
+}
+
+static const transport_ops_t usbOps = {
+  "usb",
+  _usb_open,
+  _usb_close,
+  _usb_controlIn,
+  _usb_controlOut,
+  _usb_bulkOut,
+  _usb_allocTransfer,
+  _usb_freeTransfer,
+  _usb_submit,
+  _usb_cancel,
+  _usb_handleEvents,
+  _usb_submitControl,
+  _usb_pollEvents,
+  _usb_nextTimeout,
+  _usb_free,
+  ARENA_SIZEOF(sizeof(usb_transfer_t)),
+};
+
+transport_t * transport_usbFromHandle(libusb_context * usbContext, libusb_device_handle * devHandle)
+{
+  usb_priv_t * p = malloc(sizeof(usb_priv_t));
+  memset(p, '\0', sizeof(*p));
+  p->usbContext = usbContext;
+  p->devHandle = devHandle;
+
+  transport_t * t = malloc(sizeof(transport_t));
+  t->ops = &usbOps;
+  t->priv = p;
+  t->policy = NULL;
+  t->policyKey = 0;
+  t->bulkQueued = 0;
+  return t;
+}
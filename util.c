@@ -1,5 +1,6 @@
 #include "util.h"
 #include <stdio.h>
+#include <time.h>
 
 
 void printHexStr(uint8_t * buffer, int len)
@@ -13,3 +14,10 @@ void printHexStr(uint8_t * buffer, int len)
       printf("\n");
   }
 }
+
+uint64_t nowMicros(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -24,5 +24,8 @@
 
 void printHexStr(uint8_t * buffer, int len);
 
+// Monotonic clock
+uint64_t nowMicros(void);
+
 
 #endif 
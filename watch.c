@@ -0,0 +1,164 @@
+//
+//  watch
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+  #include <sys/inotify.h>
+  #define HAVE_INOTIFY 1
+#endif
+
+#include "watch.h"
+#include "util.h"
+
+struct watch_s {
+  char * path;
+  char * name;       // Within its directory, for matching inotify events
+  int fd;            // inotify, or -1 to poll
+  struct stat last;  // What polling compares against
+};
+
+static int _watch_stat(const char * path, struct stat * st)
+{
+  if (0 != stat(path, st))
+    memset(st, '\0', sizeof(*st));
+  return st->st_size > 0;
+}
+
+static int _watch_differs(const struct stat * a, const struct stat * b)
+{
+  return a->st_size != b->st_size || a->st_mtime != b->st_mtime || a->st_ino != b->st_ino
+#if defined(__linux__)
+      || a->st_mtim.tv_nsec != b->st_mtim.tv_nsec
+#endif
+      ;
+}
+
+watch_t * watch_open(const char * path)
+{
+  watch_t * watch = malloc(sizeof(watch_t));
+  memset(watch, '\0', sizeof(*watch));
+  watch->path = strdup(path);
+  watch->fd = -1;
+  _watch_stat(path, &watch->last);
+
+  char * copy = strdup(path);
+  watch->name = strdup(basename(copy));
+  free(copy);
+
+#if HAVE_INOTIFY
+  copy = strdup(path);
+  watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watch->fd >= 0 &&
+      inotify_add_watch(watch->fd, dirname(copy), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MODIFY) < 0)
+  {
+    close(watch->fd);
+    watch->fd = -1;
+  }
+  free(copy);
+#endif
+
+  return watch;
+}
+
+void watch_close(watch_t * watch)
+{
+  if (NULL == watch)
+    return;
+
+  if (watch->fd >= 0)
+    close(watch->fd);
+  free(watch->path);
+  free(watch->name);
+  free(watch);
+}
+
+#pragma mark - Waiting
+
+#if HAVE_INOTIFY
+// Read whatever events are queued; returns 1 if any was for our file
+static int _watch_drain(watch_t * watch)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int matched = 0;
+  ssize_t len;
+
+  while ((len = read(watch->fd, buf, sizeof(buf))) > 0)
+  {
+    char * p;
+    for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+    {
+      struct inotify_event * event = (struct inotify_event *)p;
+      if (event->len && 0 == strcmp(event->name, watch->name))
+        matched = 1;
+    }
+  }
+  return matched;
+}
+
+static int _watch_waitInotify(watch_t * watch, uint64_t * changedAt)
+{
+  struct pollfd pfd = { watch->fd, POLLIN, 0 };
+  int changed = 0;
+
+  for (;;)
+  {
+    // Until something happens, then until it has been quiet for WATCH_SETTLE_MS
+    int s = poll(&pfd, 1, changed ? WATCH_SETTLE_MS : -1);
+    if (s < 0 && EINTR != errno)
+      return -errno;
+
+    if (s > 0 && _watch_drain(watch))
+    {
+      changed = 1;
+      *changedAt = nowMicros();
+    }
+    else if (0 == s && changed && _watch_stat(watch->path, &watch->last))
+    {
+      return 0;
+    }
+  }
+}
+#endif
+
+static int _watch_waitPolling(watch_t * watch, uint64_t * changedAt)
+{
+  struct stat st;
+
+  for (;;)
+  {
+    usleep(WATCH_POLL_MS * 1000);
+    if (!_watch_stat(watch->path, &st) || !_watch_differs(&st, &watch->last))
+      continue;
+
+    // Changed; wait for it to stop changing
+    *changedAt = nowMicros();
+    do
+    {
+      watch->last = st;
+      usleep(WATCH_SETTLE_MS * 1000);
+      _watch_stat(watch->path, &st);
+    } while (_watch_differs(&st, &watch->last));
+
+    if (st.st_size > 0)
+      return 0;
+  }
+}
+
+int watch_wait(watch_t * watch, uint64_t * changedAt)
+{
+#if HAVE_INOTIFY
+  if (watch->fd >= 0)
+    return _watch_waitInotify(watch, changedAt);
+#endif
+  return _watch_waitPolling(watch, changedAt);
+}
@@ -0,0 +1,32 @@
+//
+//  watch
+//
+//  Waits for a firmware file to be rebuilt. On Linux the file's directory is
+//  watched with inotify, so a file replaced by a rename (as linkers and objcopy
+//  often do) is seen as well as one written in place; elsewhere its size and
+//  modification time are polled every WATCH_POLL_MS.
+//
+//  A build touches its output several times, so a change only counts once the
+//  file has been left alone for WATCH_SETTLE_MS.
+//
+//  Copyright (c) 2013 Design Elements. All rights reserved.
+//
+#include <stdint.h>
+
+#ifndef watch_h
+#define watch_h
+
+#define WATCH_SETTLE_MS 30
+#define WATCH_POLL_MS   100
+
+typedef struct watch_s watch_t;
+
+// NULL if +path+ can't be watched
+watch_t * watch_open(const char * path);
+void watch_close(watch_t * watch);
+
+// Block until the file has changed and settled. Returns 0 with *changedAt set to
+// when it was last written (nowMicros), or a negative errno.
+int watch_wait(watch_t * watch, uint64_t * changedAt);
+
+#endif
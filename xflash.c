@@ -10,114 +10,831 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <libusb.h>
 
 #include "util.h"
+#include "flash.h"
 #include "bootloader.h"
 #include "ihex.h"
+#include "image.h"
+#include "transport.h"
+#include "trace.h"
+#include "cache.h"
 #include "colors.h"
+#include "hexdecode.h"
+#include "watch.h"
+#include "machine.h"
 
+// The front end to flash.c: options, the summary for -a, and the daemon
 
-  
-static libusb_context *ctx = NULL;
-static int forceProductID = 0xffffFFFF;
-static int forceVendorID  = 0xFFFFffff;
+static flash_session_t *session = NULL;
+static device_selector_t deviceSelector;   // From -P and -s
+
+#if XFLASH_ARENA
+  // Heap-free build: a single device is flashed by streaming the hex out of this
+  #ifndef XFLASH_ARENA_SIZE
+    #define XFLASH_ARENA_SIZE (160*1024)
+  #endif
+static uint8_t arenaBuffer[XFLASH_ARENA_SIZE] __attribute__((aligned(ARENA_ALIGN)));
+static arena_t arena;
+static ihex_t arenaHex;
+#endif
 
 
-int verbose=0;
+#pragma mark - Front End
 
-libusb_device * find_device(void)
+// Process exit status for a single-device flash
+static int flash_exitStatus(flash_result_t result)
 {
-  ssize_t i = 0;
-  printf("Searching for devices...\n");
+  switch (result)
+  {
+    case flash_result_ok:          return 0;
+    case flash_result_current:     return 0;
+    case flash_result_crcMismatch: return 5;
+    case flash_result_tooLarge:    return 4;
+    case flash_result_notFound:    return 1;
+    case flash_result_openFailed:  return 2;
+    case flash_result_noReattach:  return 2;
+    default:                       return 3;
+  }
+}
 
-  libusb_device **list;
-  ssize_t cnt = libusb_get_device_list(ctx, &list);
+#define FLASH_MAX_PATCHES 16
 
-  if (cnt < 0)
+// A patch from "<addr>=<hex bytes>" or "<addr>=@<file>", e.g. a serial number or a
+// calibration block for one unit. Returns 0, or prints why not and returns -1.
+static int flash_parsePatch(const char *spec, image_patch_t *patch)
+{
+  char *value;
+  unsigned long addr = strtoul(spec, &value, 0);
+  memset(patch, '\0', sizeof(*patch));
+
+  if (value == spec || '=' != *value)
   {
-    return NULL;
+    printf(CL_RED "Patch %s isn't <addr>=<hex> or <addr>=@<file>\n" CL_RESET, spec);
+    return -1;
   }
+  value++;
 
-  uint16_t searchProductID = (0xFFFFffff != forceProductID) ? forceProductID : BOOTLOADER_PID;
-  uint16_t searchVendorID  = (0xFFFFffff != forceVendorID)  ? forceVendorID  : BOOTLOADER_VID;
-  
-  printf("Searching for Vendor ID:  %04x\n", searchProductID);
-  printf("Searching for Product ID: %04x\n", searchVendorID);
-  
+  uint8_t *data = NULL;
+  size_t len = 0;
+  if ('@' == *value)
+  {
+    FILE *f = fopen(value + 1, "rb");
+    if (f && 0 == fseek(f, 0, SEEK_END) && ftell(f) > 0)
+    {
+      len = ftell(f);
+      data = malloc(len);
+      rewind(f);
+      if (len != fread(data, 1, len, f))
+        len = 0;
+    }
+    if (f)
+      fclose(f);
+  }
+  else if (strlen(value) % 2 == 0)
+  {
+    len = strlen(value) / 2;
+    data = malloc(MAX(len, (size_t)1));
+    if (hex_decode(data, value, len) < 0)
+      len = 0;
+  }
 
-  libusb_device *device = NULL;
-  libusb_device *preferredDevice = NULL;
-  for (i = 0; i < cnt; i++) 
+  if (0 == len)
   {
-       device = list[i];
-      
-      // printf("-> Found device %p\n", device);
+    printf(CL_RED "Patch %s has no data\n" CL_RESET, spec);
+    free(data);
+    return -1;
+  }
 
-      // Determine if device is interesting
-      //
-      struct libusb_device_descriptor desc;
-      int status = libusb_get_device_descriptor(device, &desc);
-      if (status < 0) 
-      {
-        printf("---> Failed to get device descriptor\n");
-        continue;
-      }
-      
-      if (verbose > 2)
-        printf("-> Checking %04x:%04x: ", desc.idVendor, desc.idProduct);
-      
-      
-      // Is this a bootloader?
-      if (desc.idVendor == searchVendorID && desc.idProduct == searchProductID)
-      {
-        if (verbose > 2)
-          printf( CL_GREEN " <=\n" CL_RESET);
+  patch->addr = addr;
+  patch->len = len;
+  patch->data = data;
+  return 0;
+}
 
-        preferredDevice = device;
-        break; // Use first bootloader available
-      }
+static void flash_freePatches(image_patch_t *patches, int count)
+{
+  int i;
+  for (i=0; i<count; i++)
+    free((void *)patches[i].data);
+}
+
+// Release what main set up for a single-device flash
+static void flash_cleanup(flash_prep_t *prep, ihex_t *hex)
+{
+  if (prep)
+    flash_prepFree(prep);
+#if XFLASH_ARENA
+  if (hex)
+    ihex_close(hex);   // Static storage
+  printf("Arena: %zu of %zu bytes at peak\n", arena.peak, arena.size);
+#else
+  if (hex)
+    ihex_free(hex);
+#endif
+}
+
+// Print deciles, for flashing several devices from the command line
+static void _flash_printProgress(flash_job_t *job, int percent)
+{
+  printf("[%s] %3d%%\n", job->label, percent);
+}
+
+// Reset every application into its bootloader, then flash every bootloader at once
+static int flash_allDevices(flash_prep_t *prep, const image_patch_t *patches, int patchCount)
+{
+  flash_job_t prototype, jobs[FLASH_MAX_DEVICES];
+  memset(&prototype, '\0', sizeof(prototype));
+  prototype.prep = prep;
+  prototype.patches = patches;
+  prototype.patchCount = patchCount;
+  prototype.progress = _flash_printProgress;
+
+  int count = flash_devices(session, &deviceSelector, &prototype, jobs);
+  if (0 == count)
+  {
+    printf("Could not locate device\n");
+    return 1;
+  }
+
+  int i, failures = 0;
+  printf("-----------------------\n");
+  for (i=0; i<count; i++)
+  {
+    flash_job_t *job = &jobs[i];
+    int succeeded = (flash_result_ok == job->result || flash_result_current == job->result);
+    if (!succeeded)
+      failures++;
+
+    printf("  %-8s %s%s\n" CL_RESET, job->label,
+      succeeded ? CL_GREEN : CL_RED, flash_resultStr(job->result));
+  }
+  printf("-----------------------\n");
+  printf("%d of %d devices flashed\n", count - failures, count);
+
+  return failures ? 3 : 0;
+}
+
+// Flash one device through a machine (machine.h) driven by a poll loop, as a
+// program with its own event loop would. +sim+ takes the place of a device.
+static flash_result_t flash_polled(flash_job_t *job, transport_t *sim)
+{
+  machine_t *m = NULL;
+  if (sim)
+  {
+    m = machine_newWithTransport(session, job, sim);
+  }
+  else
+  {
+    libusb_device *bootloaders[FLASH_MAX_DEVICES], *apps[FLASH_MAX_DEVICES];
+    int bootloaderCount = 0, appCount = 0, i;
+    flash_findDevices(session, &deviceSelector, bootloaders, &bootloaderCount, apps, &appCount);
+
+    if (bootloaderCount || appCount)
+      m = machine_new(session, job, bootloaderCount ? bootloaders[0] : apps[0]);
+    for (i=0; i<bootloaderCount; i++)
+      libusb_unref_device(bootloaders[i]);
+    for (i=0; i<appCount; i++)
+      libusb_unref_device(apps[i]);
+
+    if (NULL == m)
+    {
+      printf("Could not locate device\n");
+      return flash_result_notFound;
+    }
+  }
+
+  struct pollfd fds[16];
+  while (!machine_handleEvents(m))
+  {
+    int n = machine_pollfds(m, fds, 16);
+    if (poll(fds, n, machine_timeout(m)) < 0 && EINTR != errno)
+      break;
+  }
+
+  machine_free(m);
+  return job->result;
+}
+
+// The first device matching -P or -s, or the simulator, through a machine if +polled+
+static flash_result_t flash_single(flash_job_t *job, const char *simConfig, int polled)
+{
+  transport_t *sim = simConfig ? transport_simNew(simConfig) : NULL;
+  if (simConfig && NULL == sim)
+    return flash_result_notFound;
+
+  if (polled)
+    return flash_polled(job, sim);
+  if (sim)
+    return flash_device(session, sim, job);
+  return flash_one(session, &deviceSelector, job);
+}
+
+#pragma mark - Watch
+
+#if !XFLASH_ARENA
+// Flash +path+, then flash it again each time it's rebuilt, keeping the session 
+// (libusb, learned timeouts) in between. Each build is diffed page by page against 
+// the last one flashed, and one that changes nothing isn't flashed.
+static int flash_watch(const char *path, const char *cacheDir, const char *simConfig, int polled, 
+                       int allDevices, const image_patch_t *patches, int patchCount)
+{
+  watch_t *watch = watch_open(path);
+  flash_prep_t preps[2], *flashed = NULL;
+  int next = 0;
+  uint64_t changedAt = nowMicros();
+
+  for (;;)
+  {
+    ihex_t *hex = ihex_fromPath(path);
+    flash_prep_t *prep = hex ? &preps[next] : NULL;
+    image_t *image = NULL;
+    if (prep)
+    {
+      flash_prepStart(prep, hex, cacheDir);
+      image = flash_prepWait(prep);
+    }
+
+    uint32_t changed = 1;
+    if (image && image->size && flashed)
+    {
+      changed = image_changedPages(flashed->image, image, BOOTLOADER_DEFAULT_PAGESIZE);
+      printf("-> %u of %u pages changed\n", changed,
+        (MAX(image->maxAddr, flashed->image->maxAddr) + BOOTLOADER_DEFAULT_PAGESIZE - 1) / BOOTLOADER_DEFAULT_PAGESIZE);
+    }
+
+    int succeeded = 0;
+    if (NULL == image || 0 == image->size)
+    {
+      printf(CL_RED "Input file is invalid or empty; waiting for the next build\n" CL_RESET);
+    }
+    else if (0 == changed)
+    {
+      printf(CL_GREEN "Already flashed\n" CL_RESET);
+    }
+    else if (allDevices)
+    {
+      succeeded = (0 == flash_allDevices(prep, patches, patchCount));
+    }
+    else
+    {
+      flash_job_t job;
+      memset(&job, '\0', sizeof(job));
+      job.prep = prep;
+      job.patches = patches;
+      job.patchCount = patchCount;
+      flash_result_t result = flash_single(&job, simConfig, polled);
+      succeeded = (flash_result_ok == result || flash_result_current == result);
+    }
+
+    // Later builds are compared with what the devices now hold
+    if (succeeded)
+    {
+      printf(CL_GREEN "Running %.0f ms after the change\n" CL_RESET, (nowMicros() - changedAt) / 1000.0);
+      if (flashed)
+        flash_prepFree(flashed);
+      flashed = prep;
+      next ^= 1;
+    }
+    else if (prep)
+    {
+      flash_prepFree(prep);
+    }
+
+    printf("Watching %s\n", path);
+    fflush(stdout);
+    int s = watch_wait(watch, &changedAt);
+    if (s < 0)
+    {
+      printf(CL_RED "Could not watch %s: %s\n" CL_RESET, path, strerror(-s));
+      break;
+    }
+  }
+
+  if (flashed)
+    flash_prepFree(flashed);
+  watch_close(watch);
+  return 2;
+}
+#endif
+
+#pragma mark - Daemon
+
+// A long-running xflash keeps the libusb context and parsed images between
+// flashes and takes jobs over a Unix socket, one command per line:
+//
+//   load <id> <path>        Parse a firmware file and keep it as <id>
+//   unload <id>
+//   images
+//   devices
+//   flash <id> [port|serial=<serial>|all]
+//                           Flash an image; progress is streamed as it happens
+//   quit                    Close this connection
+//   shutdown                Stop the daemon once running flashes finish
+//
+// Every command ends with a line starting "ok" or "error". Jobs for different
+// devices run concurrently; images with the same contents are parsed once.
+
+#define DAEMON_SOCKET     "/tmp/xflash.sock"
+#define DAEMON_MAX_IMAGES 64
+#define DAEMON_MAX_LINE   1024
+
+// A parsed image, shared by every id loaded with the same contents
+typedef struct daemon_blob_s {
+  uint64_t hash;
+  image_t *image;        // NULL if parsing failed
+  cache_t *cache;
+  int refs;              // Ids, running flashes and loads waiting for it
+  int ready;             // Parsed, or given up on
+  struct daemon_blob_s *nextLoading;
+} daemon_blob_t;
 
-      // Is this a resettable application?
-      if (0xFFFFffff == forceVendorID  && desc.idVendor == MY_VID &&          // Only search for MY_VID if vendor unset
-         (0xFFFFffff == forceProductID || desc.idProduct == searchProductID)) // Search for forceProductID if given 
+typedef struct {
+  char id[64];
+  daemon_blob_t *blob;
+} daemon_image_t;
+
+typedef struct {
+  int fd;
+  pthread_mutex_t writeLock;  // Job threads report on the same connection
+} daemon_client_t;
+
+static pthread_mutex_t imagesLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t imagesReady = PTHREAD_COND_INITIALIZER;
+static daemon_image_t daemonImages[DAEMON_MAX_IMAGES];
+static int daemonImageCount = 0;
+static daemon_blob_t *daemonLoading = NULL;   // Being parsed, not yet given an id
+static const char *daemonCacheDir = NULL;
+
+static pthread_mutex_t activeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t activeDone = PTHREAD_COND_INITIALIZER;
+static int daemonActive = 0;      // Flashes in progress
+static int daemonListenFd = -1;
+static volatile int daemonStopping = 0;
+
+static void daemon_reply(daemon_client_t *client, const char *format, ...)
+{
+  char line[DAEMON_MAX_LINE];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(line, sizeof(line) - 1, format, args);
+  va_end(args);
+
+  len = MIN(len, (int)sizeof(line) - 2);
+  line[len++] = '\n';
+
+  // A client that hung up loses the rest of its output; the job carries on
+  pthread_mutex_lock(&client->writeLock);
+  const char *p = line;
+  while (len > 0)
+  {
+    ssize_t n = write(client->fd, p, len);
+    if (n < 0 && EINTR == errno)
+      continue;
+    if (n <= 0)
+      break;
+    p += n;
+    len -= n;
+  }
+  pthread_mutex_unlock(&client->writeLock);
+}
+
+static void daemon_blobRelease(daemon_blob_t *blob)
+{
+  if (--blob->refs > 0)
+    return;
+
+  image_free(blob->image);
+  cache_close(blob->cache);
+  free(blob);
+}
+
+// Called with imagesLock held
+static daemon_image_t * daemon_findImage(const char *id)
+{
+  int i;
+  for (i=0; i<daemonImageCount; i++)
+    if (0 == strcmp(daemonImages[i].id, id))
+      return &daemonImages[i];
+  return NULL;
+}
+
+// Called with imagesLock held. The blob may still be loading.
+static daemon_blob_t * daemon_findBlob(uint64_t hash)
+{
+  daemon_blob_t *blob;
+  int i;
+  for (i=0; i<daemonImageCount; i++)
+    if (daemonImages[i].blob->hash == hash)
+      return daemonImages[i].blob;
+  for (blob=daemonLoading; blob; blob=blob->nextLoading)
+    if (blob->hash == hash)
+      return blob;
+  return NULL;
+}
+
+// Called with imagesLock held
+static void daemon_didLoad(daemon_blob_t *blob)
+{
+  daemon_blob_t **link = &daemonLoading;
+  while (*link != blob)
+    link = &(*link)->nextLoading;
+  *link = blob->nextLoading;
+
+  blob->ready = 1;
+  pthread_cond_broadcast(&imagesReady);
+}
+
+static void daemon_load(daemon_client_t *client, const char *id, const char *path)
+{
+  if (0 != access(path, R_OK))
+  {
+    daemon_reply(client, "error could not open %s: %s", path, strerror(errno));
+    return;
+  }
+
+  ihex_t *hex = ihex_fromPath(path);
+  if (NULL == hex)
+  {
+    daemon_reply(client, "error could not open %s", path);
+    return;
+  }
+
+  size_t len;
+  const char *contents = ihex_contents(hex, &len);
+  if (NULL == contents)
+  {
+    daemon_reply(client, "error %s is not a regular file", path);
+    ihex_free(hex);
+    return;
+  }
+
+  uint64_t start = nowMicros();
+  uint64_t hash = cache_hash(contents, len);
+
+  // Parsing is done outside the lock so one large file doesn't hold up other clients.
+  // The blob is published first, so a load of the same contents meanwhile waits for
+  // it rather than parsing it again; if it fails, the next load tries for itself.
+  pthread_mutex_lock(&imagesLock);
+  daemon_blob_t *blob;
+  while ((blob = daemon_findBlob(hash)))
+  {
+    blob->refs++;
+    while (!blob->ready)
+      pthread_cond_wait(&imagesReady, &imagesLock);
+    if (blob->image)
+      break;
+    daemon_blobRelease(blob);
+  }
+
+  int shared = (NULL != blob);
+  if (NULL == blob)
+  {
+    blob = malloc(sizeof(daemon_blob_t));
+    memset(blob, '\0', sizeof(*blob));
+    blob->hash = hash;
+    blob->refs = 1;
+    blob->nextLoading = daemonLoading;
+    daemonLoading = blob;
+  }
+  pthread_mutex_unlock(&imagesLock);
+
+  if (!shared)
+  {
+    if (daemonCacheDir)
+    {
+      blob->cache = cache_open(daemonCacheDir, hex);
+      blob->image = cache_image(blob->cache);
+    }
+
+    if (NULL == blob->image)
+    {
+      blob->image = image_fromHex(hex);
+      if (hex->error)
       {
-        printf(":");
-        
-        if (verbose > 2)
-          printf(CL_RED " <=\n" CL_RESET);
+        daemon_reply(client, "error %s at offset %ld", hex->error, hex->errorOffset);
+        ihex_free(hex);
 
-        preferredDevice = device; // Possibly use this application device, unless we find a bootloader
+        pthread_mutex_lock(&imagesLock);
+        image_free(blob->image);
+        blob->image = NULL;
+        daemon_didLoad(blob);
+        daemon_blobRelease(blob);
+        pthread_mutex_unlock(&imagesLock);
+        return;
       }
+      cache_store(blob->cache, blob->image);
+    }
+
+    image_paginate(blob->image, BOOTLOADER_DEFAULT_PAGESIZE);
+  }
+  ihex_free(hex);
+
+  pthread_mutex_lock(&imagesLock);
+  if (!shared)
+    daemon_didLoad(blob);
+
+  daemon_image_t *entry = daemon_findImage(id);
+  if (NULL == entry && daemonImageCount < DAEMON_MAX_IMAGES)
+  {
+    entry = &daemonImages[daemonImageCount++];
+    snprintf(entry->id, sizeof(entry->id), "%s", id);
+    entry->blob = NULL;
+  }
 
-      if (verbose > 2)
-        printf("\n");
+  // Once the lock is dropped another client may unload the id and free the image
+  uint32_t size = blob->image->size;
+  daemon_blob_t *replaced = NULL;
+  if (entry)
+  {
+    replaced = entry->blob;
+    entry->blob = blob;
+  }
+  else
+  {
+    daemon_blobRelease(blob);
+  }
+
+  if (replaced)
+    daemon_blobRelease(replaced);
+  pthread_mutex_unlock(&imagesLock);
+
+  if (NULL == entry)
+    daemon_reply(client, "error too many images");
+  else
+    daemon_reply(client, "ok %s %u bytes %016llx %s %u us", id, size,
+      (unsigned long long)hash, shared ? "shared" : "parsed", (unsigned)(nowMicros() - start));
+}
+
+static void daemon_unload(daemon_client_t *client, const char *id)
+{
+  pthread_mutex_lock(&imagesLock);
+  daemon_image_t *entry = daemon_findImage(id);
+  if (entry)
+  {
+    daemon_blobRelease(entry->blob);
+    *entry = daemonImages[--daemonImageCount];
+  }
+  pthread_mutex_unlock(&imagesLock);
+
+  if (entry)
+    daemon_reply(client, "ok");
+  else
+    daemon_reply(client, "error no image %s", id);
+}
+
+static void daemon_images(daemon_client_t *client)
+{
+  pthread_mutex_lock(&imagesLock);
+  int i;
+  for (i=0; i<daemonImageCount; i++)
+  {
+    daemon_blob_t *blob = daemonImages[i].blob;
+    daemon_reply(client, "image %s %d bytes %016llx", daemonImages[i].id, blob->image->size,
+      (unsigned long long)blob->hash);
   }
+  daemon_reply(client, "ok %d", daemonImageCount);
+  pthread_mutex_unlock(&imagesLock);
+}
 
-  if (NULL != preferredDevice)
+static void daemon_devices(daemon_client_t *client)
+{
+  libusb_device *bootloaders[FLASH_MAX_DEVICES], *apps[FLASH_MAX_DEVICES];
+  int bootloaderCount, appCount, i;
+  char label[DEVICE_LABEL_LEN];
+
+  device_selector_t any;
+  device_parseSelector(NULL, &any);
+
+  flash_findDevices(session, &any, bootloaders, &bootloaderCount, apps, &appCount);
+
+  for (i=0; i<bootloaderCount; i++)
+  {
+    device_path(bootloaders[i], label, sizeof(label));
+    daemon_reply(client, "device %s bootloader%s", label, flash_isBusy(session, label) ? " busy" : "");
+    libusb_unref_device(bootloaders[i]);
+  }
+  for (i=0; i<appCount; i++)
   {
-    libusb_ref_device(preferredDevice); 
+    device_path(apps[i], label, sizeof(label));
+    daemon_reply(client, "device %s application", label);
+    libusb_unref_device(apps[i]);
   }
+  daemon_reply(client, "ok %d", bootloaderCount + appCount);
+}
+
+static void _daemon_didProgress(flash_job_t *job, int percent)
+{
+  daemon_reply(job->context, "progress %s %d", job->label, percent);
+}
 
-  libusb_free_device_list(list, 1);
-  return preferredDevice;
+static void _daemon_didPhase(flash_job_t *job, const char *phase, int status, uint64_t micros)
+{
+  daemon_reply(job->context, "phase %s %s %d %.1f", job->label, phase, status, micros / 1000.0);
 }
 
+static void _daemon_didFinish(flash_job_t *job)
+{
+  daemon_reply(job->context, "result %s %d %.1f %s", job->label, job->result, job->elapsed / 1000.0,
+    flash_resultStr(job->result));
+}
 
-void printdev(libusb_device *dev) 
+static void daemon_flash(daemon_client_t *client, const char *id, const char *selector,
+                         const image_patch_t *patches, int patchCount)
 {
-  struct libusb_device_descriptor desc;
-  // int desc;
-  int r = libusb_get_device_descriptor(dev, &desc);
-  if (r < 0) {
-    printf("-> Failed to get device descriptor\n");
+  pthread_mutex_lock(&imagesLock);
+  daemon_image_t *entry = daemon_findImage(id);
+  daemon_blob_t *blob = entry ? entry->blob : NULL;
+  if (blob)
+    blob->refs++;   // Stays loaded until the flash is over, even if unloaded meanwhile
+  pthread_mutex_unlock(&imagesLock);
+
+  if (NULL == blob)
+  {
+    daemon_reply(client, "error no image %s", id);
     return;
   }
-  printf("  Number of configurations: %d\n", desc.bNumConfigurations);
-  printf("  Device Class: %d\n", desc.bDeviceClass);
-  printf("  VendorID: 0x%02x\n", desc.idVendor);
-  printf("  ProductID: 0x%02x\n", desc.idProduct);
+
+  pthread_mutex_lock(&activeLock);
+  daemonActive++;
+  pthread_mutex_unlock(&activeLock);
+
+  flash_job_t prototype, jobs[FLASH_MAX_DEVICES];
+  memset(&prototype, '\0', sizeof(prototype));
+  prototype.image = blob->image;
+  prototype.cache = blob->cache;
+  prototype.patches = patches;
+  prototype.patchCount = patchCount;
+  prototype.progress = _daemon_didProgress;
+  prototype.phase = _daemon_didPhase;
+  prototype.done = _daemon_didFinish;
+  prototype.context = client;
+
+  device_selector_t match;
+  device_parseSelector(selector, &match);
+
+  uint64_t start = nowMicros();
+  int count = flash_devices(session, &match, &prototype, jobs);
+
+  int i, succeeded = 0;
+  for (i=0; i<count; i++)
+    if (flash_result_ok == jobs[i].result || flash_result_current == jobs[i].result)
+      succeeded++;
+
+  if (0 == count)
+    daemon_reply(client, "error no free device matches %s", selector ? selector : "all");
+  else
+    daemon_reply(client, "%s %d/%d %.1f", (succeeded == count) ? "ok" : "error", succeeded, count,
+      (nowMicros() - start) / 1000.0);
+
+  pthread_mutex_lock(&imagesLock);
+  daemon_blobRelease(blob);
+  pthread_mutex_unlock(&imagesLock);
+
+  pthread_mutex_lock(&activeLock);
+  daemonActive--;
+  pthread_cond_broadcast(&activeDone);
+  pthread_mutex_unlock(&activeLock);
+}
+
+static void * _daemon_clientMain(void *context)
+{
+  daemon_client_t *client = context;
+  FILE *in = fdopen(dup(client->fd), "r");
+  char line[DAEMON_MAX_LINE];
+
+  while (in && fgets(line, sizeof(line), in))
+  {
+    char *save = NULL;
+    char *command = strtok_r(line, " \t\r\n", &save);
+    char *arg1    = strtok_r(NULL, " \t\r\n", &save);
+    char *arg2    = strtok_r(NULL, " \t\r\n", &save);
+
+    if (NULL == command)
+      continue;
+
+    if (0 == strcmp(command, "load") && arg1 && arg2)
+      daemon_load(client, arg1, arg2);
+    else if (0 == strcmp(command, "unload") && arg1)
+      daemon_unload(client, arg1);
+    else if (0 == strcmp(command, "images"))
+      daemon_images(client);
+    else if (0 == strcmp(command, "devices"))
+      daemon_devices(client);
+    else if (0 == strcmp(command, "flash") && arg1)
+    {
+      // Anything after the selector is a patch for this flash only
+      image_patch_t patches[FLASH_MAX_PATCHES];
+      int patchCount = 0, ok = 1;
+      char *spec;
+      while (ok && (spec = strtok_r(NULL, " \t\r\n", &save)))
+      {
+        ok = (patchCount < FLASH_MAX_PATCHES) && 0 == flash_parsePatch(spec, &patches[patchCount]);
+        patchCount += ok;
+      }
+
+      if (ok)
+        daemon_flash(client, arg1, arg2, patches, patchCount);
+      else
+        daemon_reply(client, "error bad patch %s", spec);
+      flash_freePatches(patches, patchCount);
+    }
+    else if (0 == strcmp(command, "quit"))
+    {
+      daemon_reply(client, "ok");
+      break;
+    }
+    else if (0 == strcmp(command, "shutdown"))
+    {
+      daemon_reply(client, "ok");
+      daemonStopping = 1;
+      shutdown(daemonListenFd, SHUT_RDWR); // Wakes accept()
+      break;
+    }
+    else
+      daemon_reply(client, "error unknown command %s", command);
+  }
+
+  if (in)
+    fclose(in);
+  close(client->fd);
+  pthread_mutex_destroy(&client->writeLock);
+  free(client);
+  return NULL;
+}
+
+static int daemon_run(const char *path, const char *cacheDir)
+{
+  daemonCacheDir = cacheDir;
+  signal(SIGPIPE, SIG_IGN);   // Report a client that went away as a failed write
+
+  struct sockaddr_un addr;
+  memset(&addr, '\0', sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    printf(CL_RED "Socket path too long: %s\n" CL_RESET, path);
+    return 2;
+  }
+  strcpy(addr.sun_path, path);
+
+  daemonListenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (-1 == daemonListenFd || 0 != bind(daemonListenFd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      0 != listen(daemonListenFd, 8))
+  {
+    perror(CL_RED "Could not listen" CL_RESET);
+    return 2;
+  }
+
+  printf(CL_GREEN "Listening on %s\n" CL_RESET, path);
+
+  while (!daemonStopping)
+  {
+    int fd = accept(daemonListenFd, NULL, NULL);
+    if (-1 == fd)
+    {
+      if (EINTR == errno || ECONNABORTED == errno)
+        continue;
+      if (!daemonStopping)
+        perror(CL_RED "Could not accept" CL_RESET);
+      break;
+    }
+
+    daemon_client_t *client = malloc(sizeof(daemon_client_t));
+    client->fd = fd;
+    pthread_mutex_init(&client->writeLock, NULL);
+
+    pthread_t thread;
+    if (0 != pthread_create(&thread, NULL, _daemon_clientMain, client))
+    {
+      close(fd);
+      pthread_mutex_destroy(&client->writeLock);
+      free(client);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+
+  close(daemonListenFd);
+  unlink(path);
+
+  // Let running flashes finish
+  pthread_mutex_lock(&activeLock);
+  while (daemonActive > 0)
+    pthread_cond_wait(&activeDone, &activeLock);
+  pthread_mutex_unlock(&activeLock);
+
+  printf("Stopped\n");
+  return 0;
 }
 
 #pragma mark - Bootloader
@@ -137,175 +854,201 @@ void printdev(libusb_device *dev)
 int main(int argc, char *argv[])
 {
   int s;//tatus
+  int allDevices = 0;
+  int polled = 0;
+  int watching = 0;
+  image_patch_t patches[FLASH_MAX_PATCHES];
+  int patchCount = 0;
+  const char *simConfig = NULL;
+  const char *cacheDir = NULL;
+  const char *daemonPath = NULL;
+  flash_options_t options;
 
-  libusb_init(&ctx);
+  flash_defaultOptions(&options);
   
   // Read options
   int opt;
-  while ((opt = getopt(argc, argv, "V:p:v:")) != -1)
+  while ((opt = getopt(argc, argv, "V:p:v:q:t:aS:T:iB:C:D:P:s:nr:LW:w")) != -1)
   {
     switch(opt)
     {
       case 'V': // Verbosity
         verbose = atoi(optarg);
         printf("Setting verbose: %d\n", verbose);
-        if (verbose > 2)
-          libusb_set_debug(ctx, 3);
-        
         break;
 
       case 'v': // Vendor ID
-        sscanf((optarg[1] == 'x' || optarg[1] == 'X') ? optarg + 2 : optarg, "%04x", &forceVendorID);
+        sscanf((optarg[1] == 'x' || optarg[1] == 'X') ? optarg + 2 : optarg, "%04x", &options.vendorID);
         break;
 
       case 'p': // Product ID
-        sscanf((optarg[1] == 'x' || optarg[1] == 'X') ? optarg + 2 : optarg, "%04x", &forceProductID);
+        sscanf((optarg[1] == 'x' || optarg[1] == 'X') ? optarg + 2 : optarg, "%04x", &options.productID);
+        break;
+
+      case 'q': // Bulk transfers in flight
+        options.queueDepth = MAX(atoi(optarg), 1);
+        break;
+
+      case 't': // Pages per bulk transfer, or "auto"
+        options.pagesPerTransfer = (0 == strcmp(optarg, "auto")) ? BOOTLOADER_PAGES_AUTO : MAX(atoi(optarg), 1);
+        break;
+
+      case 'P': // Only the device on this port, e.g. "1-2.3"
+        snprintf(deviceSelector.path, sizeof(deviceSelector.path), "%s", optarg);
+        break;
+
+      case 's': // Only the device with this serial number
+        snprintf(deviceSelector.serial, sizeof(deviceSelector.serial), "%s", optarg);
+        break;
+
+      case 'a': // Every attached device
+        allDevices = 1;
+        break;
+
+      case 'W': // Write bytes over the image for this unit: <addr>=<hex> or <addr>=@<file>
+        if (patchCount == FLASH_MAX_PATCHES || flash_parsePatch(optarg, &patches[patchCount]) < 0)
+        {
+          flash_freePatches(patches, patchCount);
+          return 1;
+        }
+        patchCount++;
+        break;
+
+      case 'r': // Erase, write and verify cycles before giving up on a device
+        options.writeAttempts = atoi(optarg);
+        break;
+
+      case 'L': // Keep the fixed timeouts instead of learning them from devices
+        options.learnTimeouts = 0;
+        break;
+
+      case 'w': // Flash again whenever the input file is rebuilt
+        watching = 1;
+        break;
+
+      case 'n': // Drive the flash from a poll loop (machine.h) rather than blocking calls
+        polled = 1;
+        break;
+
+      case 'S': // Flash a simulated bootloader instead of a device, e.g. "128a4u,kbps=300"
+        simConfig = optarg;
+        break;
+
+      case 'i': // Skip devices whose application CRC already matches the image
+        options.skipIfCurrent = 1;
+        break;
+
+      case 'B': // Expected boot section CRC (REQ_CRC_BOOT), in hex
+        options.checkBootCRC = 1;
+        options.expectedBootCRC = strtoul(optarg, NULL, 16);
+        break;
+
+      case 'C': // Directory for the parsed image cache
+        cacheDir = optarg;
+        break;
+
+      case 'D': // Serve jobs on a Unix socket; "-" for the default path
+        daemonPath = strcmp(optarg, "-") ? optarg : DAEMON_SOCKET;
+        break;
+
+      case 'T': // Phase and transfer timing: "summary", or a path for Chrome trace JSON too
+        trace_start(strcmp(optarg, "summary") ? optarg : NULL);
+        atexit(trace_finish);
         break;
     }
   }
-  
-  // Find an interesting device
-  //
-  libusb_device *dev = find_device();
-  libusb_device_handle *devHandle = NULL;
-  
-  if (NULL == dev)
-  {
-    printf("Could not locate device\n");
-    exit(1);
-  }
 
-  
-  // Open Device
-  //
-  if (dev) 
+  s = flash_sessionNew(&session, &options, NULL);
+  if (0 != s)
   {
-    s = libusb_open(dev, &devHandle);
-    if (0 != s)
-    {
-      printf(CL_RED "Could not open device: error %d\n" CL_RESET, s);
-      exit(2);
-    }
-    
-    // Referenced device is returned from find_device; open also adds a reference.
-    // Let libusb own the device now.
-    libusb_unref_device(dev);
+    printf(CL_RED "Could not start libusb: error %d\n" CL_RESET, s);
+    return 2;
   }
-
-
-  // Dump device info for debugging
-  //
   if (verbose > 2)
+    libusb_set_debug(flash_sessionContext(session), 3);
+
+  if (daemonPath)
   {
-    printf("Using Device:\n");
-    printdev(dev);
+    s = daemon_run(daemonPath, cacheDir);
+    flash_sessionFree(session);
+    return s;
   }
-  
 
-  // Determine what to do. If the device has a prototype vendor ID, 
-  // assume it should be reset to bootloader. Otherwise, flash.
-  //
-  struct libusb_device_descriptor desc;
-  int r = libusb_get_device_descriptor(dev, &desc);
-  if (r < 0) {
-    printf("-> Failed to get device descriptor\n");
-    exit(1);
-  }
-  
-  if (desc.idVendor != BOOTLOADER_VID && desc.idProduct != BOOTLOADER_PID)
-  {
-    printf(CL_YELLOW "Resetting application\n" CL_RESET);
-
-    // Set Configuration
-    s = libusb_set_configuration(devHandle, 1);
-    if (s !=0) { printf( CL_RED "libusb_set_configuration error %d\n" CL_RESET, s); }
-
-    // Reset device into bootloader
-    s = libusb_control_transfer(devHandle, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN, REQ_APP_RESET, 0, 0, NULL, 0, 1000);
-    if (s < 0) { printf( CL_RED "libusb_control_transfer error %d\n" CL_RESET, s); }
-
-    libusb_close(devHandle);
-    devHandle = NULL;
-    
-    // Now, find the device in bootloader, meaning we need to eschew the preferential
-    // treatment formerly given to the device/product IDs
-    forceVendorID  = 0x59e3;
-    forceProductID = 0xbbbb;
-    
-    // Give device time to gather its thoughts
-    usleep(500000);
-    
-    int i;
-    for (i=0; i<10; i++)
+#if !XFLASH_ARENA
+  if (watching)
+  {
+    if (0 == strcmp(argv[argc-1], "-"))
     {
-      usleep(100000); // Wait 100 milliseconds for the device to reattach
-      dev = find_device();
-      if (NULL != dev) 
-        break;
+      printf(CL_RED "-w needs a file, not standard input\n" CL_RESET);
+      s = 1;
     }
-    
-    if (NULL == dev)
+    else
     {
-      // We've waited a whole second for the device to reattach and came up emtpy-handed.
-      printf(CL_RED "Unable to locate device after reset\n");
-      exit(2);
+      s = flash_watch(argv[argc-1], cacheDir, simConfig, polled, allDevices, patches, patchCount);
     }
+    flash_freePatches(patches, patchCount);
+    flash_sessionFree(session);
+    return s;
+  }
+#endif
 
-    // Go ahead and open this device now.
-    s = libusb_open(dev, &devHandle);
-    if (0 != s)
-    {
-      printf(CL_RED "Could not open device: error %d\n" CL_RESET, s);
-      exit(2);
-    }
+  // Parse the input once, on a worker while devices reset; everything else works from 
+  // the image. Standard input is streamed to a single device as it arrives instead.
+  const char *path = argv[argc-1];
+#if XFLASH_ARENA
+  // Always stream, so memory use doesn't depend on the image
+  if (allDevices || cacheDir || patchCount || watching)
+  {
+    printf(CL_RED "-a, -C, -W and -w need a build without ARENA=1\n" CL_RESET);
+    flash_sessionFree(session);
+    return 1;
+  }
+  arena_init(&arena, arenaBuffer, sizeof(arenaBuffer));
+  ihex_init(&arenaHex);
+  arenaHex.arena = &arena;
+  ihex_t * hex = ihex_loadFile(&arenaHex, path) ? &arenaHex : NULL;
+  int streaming = 1;
+#else
+  ihex_t * hex = ihex_fromPath(path);
+  int streaming = !allDevices && 0 == strcmp(path, "-");
+#endif
+  if (NULL == hex)
+  {
+    flash_sessionFree(session);
+    return 2;
+  }
 
-    // Referenced device is returned from find_device; open also adds a reference.
-    // Let libusb own the device now.
-    libusb_unref_device(dev);
+  flash_prep_t prep, *preparing = NULL;
+  if (!streaming)
+  {
+    flash_prepStart(&prep, hex, cacheDir);
+    preparing = &prep;
+    hex = NULL;
   }
-  
 
-  // Parse args
-  // Assuming flash for now
+  if (allDevices)
+  {
+    s = flash_allDevices(preparing, patches, patchCount);
+    flash_prepFree(preparing);
+    flash_freePatches(patches, patchCount);
+    flash_sessionFree(session);
+    return s;
+  }
 
+  flash_job_t job;
+  memset(&job, '\0', sizeof(job));
+  job.prep = preparing;
+  job.hex = hex;
+  job.patches = patches;
+  job.patchCount = patchCount;
+#if XFLASH_ARENA
+  job.arena = &arena;
+#endif
 
-  // Create a bootloader object to manage the flash
-  bootloader_t bootloader;
-  bootloader_init(&bootloader, devHandle);
+  flash_result_t result = flash_single(&job, simConfig, polled);
 
-  
-  ihex_t * hex = ihex_fromPath(argv[argc-1]);
-  ihex_crc(hex, bootloader.info.memsize, 0xff);
-  
-  // Erase device
-  s = bootloader_erase(&bootloader);
-  
-  // Write flash
-  printf(CL_GREEN "-> Writing %d bytes\n" CL_RESET, hex->size);
-  bootloader_writeFlash(&bootloader, hex);
-  printf(CL_GREEN "\nDone\n" CL_RESET);
-    
-  // Check App CRC
-  uint32_t crc=0;
-  s = bootloader_appCRC(&bootloader, &crc); 
-  printf("File CRC:0x%04x\n", hex->crc);
-  printf("App CRC: 0x%04x\n", crc);
-
-  if (crc == hex->crc)
-  {
-    printf(CL_GREEN "CRC Matches\n" CL_RESET);
-    s = bootloader_reset(&bootloader);
-    if (s != 0)
-    {
-      printf(CL_RED "Could not reset target: %d\n" CL_RESET, s);
-    }
-  }
-  else
-  {
-    printf(CL_RED "CRC Mismatch\n" CL_RESET);
-  }
-  
-  bootloader_free(&bootloader);
-  ihex_free(hex);
-  return 0;
-}
\ No newline at end of file
+  flash_cleanup(preparing, hex);
+  flash_freePatches(patches, patchCount);
+  flash_sessionFree(session);
+  return flash_exitStatus(result);
+}